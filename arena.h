@@ -0,0 +1,225 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */ 
+
+/*
+ * A bump allocator handed to yajl through yajl_alloc_funcs, so that the
+ * lexer buffers and parser stacks for a document are carved out of one
+ * block of memory which is rewound, rather than freed, once the document
+ * is done with
+ */
+
+#ifndef __PY_YAJL_ARENA_H__
+#define __PY_YAJL_ARENA_H__
+
+#include <Python.h>
+#include <string.h>
+
+#include <yajl/yajl_common.h>
+
+/* not every file calls every helper, as for PY_YAJL_TAPE_INLINE in tape.h */
+#ifdef __GNUC__
+#define PY_YAJL_ARENA_INLINE(type) __attribute__((unused)) Py_LOCAL_INLINE(type)
+#else
+#define PY_YAJL_ARENA_INLINE(type) Py_LOCAL_INLINE(type)
+#endif
+
+/* size of a fresh chunk, most small documents never need a second one */
+#define PY_YAJL_ARENA_CHUNK_SZ (16 * 1024)
+/* more than this is given back to the system when the arena is reset */
+#define PY_YAJL_ARENA_KEEP_SZ (1024 * 1024)
+/* every block is preceded by its size, and both are kept this aligned */
+#define PY_YAJL_ARENA_ALIGN 16
+
+typedef struct _py_yajl_arena_chunk {
+    struct _py_yajl_arena_chunk *next;
+    size_t size;
+    size_t used;
+    size_t last;    /* offset of the most recent block, for free()/realloc() */
+} py_yajl_arena_chunk;
+
+typedef struct {
+    py_yajl_arena_chunk *chunks;    /* the one being carved up comes first */
+    size_t reserved;                /* bytes held in chunks */
+    size_t in_use;                  /* bytes handed out since the last reset */
+    size_t high_water;              /* most ever in use between two resets */
+    size_t resets;
+} py_yajl_arena;
+
+#define PY_YAJL_ARENA_ROUND(n) (((n) + PY_YAJL_ARENA_ALIGN - 1) & ~((size_t)(PY_YAJL_ARENA_ALIGN) - 1))
+#define PY_YAJL_ARENA_HEADER PY_YAJL_ARENA_ROUND(sizeof(py_yajl_arena_chunk))
+#define PY_YAJL_ARENA_DATA(chunk) ((char *)(chunk) + PY_YAJL_ARENA_HEADER)
+#define PY_YAJL_ARENA_BLOCK_SZ(ptr) (*(size_t *)((char *)(ptr) - PY_YAJL_ARENA_ALIGN))
+
+PY_YAJL_ARENA_INLINE(py_yajl_arena_chunk *) py_yajl_arena_grow(py_yajl_arena *arena, size_t need)
+{
+    size_t size = PY_YAJL_ARENA_CHUNK_SZ;
+    py_yajl_arena_chunk *chunk = NULL;
+
+    while (size < need)
+        size *= 2;
+    chunk = (py_yajl_arena_chunk *)(malloc(PY_YAJL_ARENA_HEADER + size));
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = arena->chunks;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->last = 0;
+    arena->chunks = chunk;
+    arena->reserved += size;
+    return chunk;
+}
+
+PY_YAJL_ARENA_INLINE(void *) py_yajl_arena_malloc(void *ctx, unsigned int sz)
+{
+    py_yajl_arena *arena = (py_yajl_arena *)(ctx);
+    py_yajl_arena_chunk *chunk = arena->chunks;
+    size_t need = PY_YAJL_ARENA_ALIGN + PY_YAJL_ARENA_ROUND((size_t)(sz));
+    char *block = NULL;
+
+    if ( (chunk == NULL) || (chunk->size - chunk->used < need) ) {
+        chunk = py_yajl_arena_grow(arena, need);
+        if (chunk == NULL)
+            return NULL;
+    }
+
+    block = PY_YAJL_ARENA_DATA(chunk) + chunk->used;
+    *(size_t *)(block) = need - PY_YAJL_ARENA_ALIGN;
+    chunk->last = chunk->used;
+    chunk->used += need;
+
+    arena->in_use += need;
+    if (arena->in_use > arena->high_water)
+        arena->high_water = arena->in_use;
+    return block + PY_YAJL_ARENA_ALIGN;
+}
+
+/* is `ptr` the most recent block carved out of the current chunk? */
+PY_YAJL_ARENA_INLINE(int) py_yajl_arena_is_last(py_yajl_arena *arena, void *ptr)
+{
+    py_yajl_arena_chunk *chunk = arena->chunks;
+
+    return (chunk != NULL) && (chunk->used > 0) &&
+        ((char *)(ptr) == PY_YAJL_ARENA_DATA(chunk) + chunk->last + PY_YAJL_ARENA_ALIGN);
+}
+
+/* Only the most recent block is really freed, the rest waits for a reset */
+PY_YAJL_ARENA_INLINE(void) py_yajl_arena_free(void *ctx, void *ptr)
+{
+    py_yajl_arena *arena = (py_yajl_arena *)(ctx);
+    py_yajl_arena_chunk *chunk = arena->chunks;
+
+    if ( (ptr == NULL) || (!py_yajl_arena_is_last(arena, ptr)) )
+        return;
+    arena->in_use -= chunk->used - chunk->last;
+    chunk->used = chunk->last;
+}
+
+PY_YAJL_ARENA_INLINE(void *) py_yajl_arena_realloc(void *ctx, void *ptr, unsigned int sz)
+{
+    py_yajl_arena *arena = (py_yajl_arena *)(ctx);
+    py_yajl_arena_chunk *chunk = arena->chunks;
+    size_t old, want;
+    void *moved = NULL;
+
+    if (ptr == NULL)
+        return py_yajl_arena_malloc(ctx, sz);
+
+    old = PY_YAJL_ARENA_BLOCK_SZ(ptr);
+    want = PY_YAJL_ARENA_ROUND((size_t)(sz));
+    if (want <= old)
+        return ptr;
+
+    /* the most recent block can simply grow into the rest of its chunk */
+    if ( (py_yajl_arena_is_last(arena, ptr)) && (chunk->size - chunk->used >= want - old) ) {
+        PY_YAJL_ARENA_BLOCK_SZ(ptr) = want;
+        chunk->used += want - old;
+        arena->in_use += want - old;
+        if (arena->in_use > arena->high_water)
+            arena->high_water = arena->in_use;
+        return ptr;
+    }
+
+    moved = py_yajl_arena_malloc(ctx, sz);
+    if (moved == NULL)
+        return NULL;
+    memcpy(moved, ptr, old);
+    return moved;
+}
+
+PY_YAJL_ARENA_INLINE(void) py_yajl_arena_release(py_yajl_arena *arena)
+{
+    py_yajl_arena_chunk *chunk = arena->chunks;
+    py_yajl_arena_chunk *next = NULL;
+
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->reserved = 0;
+    arena->in_use = 0;
+}
+
+/*
+ * Rewind the arena once nothing allocated from it is in use any more. If
+ * the last document spilled over into more chunks they're merged into
+ * one big enough for next time, within reason.
+ */
+PY_YAJL_ARENA_INLINE(void) py_yajl_arena_reset(py_yajl_arena *arena)
+{
+    size_t reserved = arena->reserved;
+
+    arena->resets++;
+    if ( (arena->chunks) && (arena->chunks->next == NULL) && (reserved <= PY_YAJL_ARENA_KEEP_SZ) ) {
+        arena->chunks->used = 0;
+        arena->chunks->last = 0;
+        arena->in_use = 0;
+        return;
+    }
+
+    py_yajl_arena_release(arena);
+    if (reserved > PY_YAJL_ARENA_KEEP_SZ)
+        reserved = PY_YAJL_ARENA_KEEP_SZ;
+    if (reserved)
+        py_yajl_arena_grow(arena, reserved);
+}
+
+PY_YAJL_ARENA_INLINE(void) py_yajl_arena_funcs(py_yajl_arena *arena, yajl_alloc_funcs *funcs)
+{
+    funcs->malloc = py_yajl_arena_malloc;
+    funcs->realloc = py_yajl_arena_realloc;
+    funcs->free = py_yajl_arena_free;
+    funcs->ctx = (void *)(arena);
+}
+
+#endif
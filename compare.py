@@ -57,6 +57,7 @@ def padright(s, upto, padchar=" "):
 
 contenders = [
     ('yajl', (yajl.Encoder().encode, yajl.Decoder().decode)),
+    ('yajl.dumps', (yajl.dumps, yajl.loads)),
 ]
 if cjson:
     contenders.append(('cjson', (cjson.encode, cjson.decode)))
@@ -75,3 +76,42 @@ for name, args in contenders:
         des=format(y),
         tot=format(x + y)
     ))
+
+# Fixed per-call overhead dominates for small (~200 byte) messages
+small_data = {
+    "id": 1234,
+    "method": "user.lookup",
+    "params": {"user": "foo@example.com", "fields": ["name", "email", "groups"]},
+    "trace": {"parent": "4bf92f3577b34da6", "span": "00f067aa0ba902b7", "sampled": True},
+}
+tmpl = string.Template("$name small message: serialize $ser us/call  deserialize $des us/call")
+for name, args in contenders:
+    test(args[0], args[1], small_data)
+    x, y = profile(args[0], args[1], small_data, x=200*1000)
+    print(tmpl.substitute(
+        name=padright(name, 11),
+        ser=format(x * 5),
+        des=format(y * 5)
+    ))
+
+# A batch of independent messages, lexed in parallel by yajl.loads_many()
+batch = [yajl.dumps(dict(small_data, id=i)) for i in range(20*1000)]
+start = time.time()
+results = [yajl.loads(message) for message in batch]
+base = time.time() - start
+del results
+print("%s batch of %d: %s s  (%s msgs/s)" % (padright('yajl.loads', 11),
+    len(batch), format(base), int(len(batch) / base)))
+tmpl = string.Template("$name batch of $count: $secs s  ($rate msgs/s)")
+for threads in (1, 2, 4, 8):
+    assert yajl.loads_many(batch[:10], threads=threads) == [yajl.loads(m) for m in batch[:10]]
+    start = time.time()
+    results = yajl.loads_many(batch, threads=threads)
+    took = time.time() - start
+    del results
+    print(tmpl.substitute(
+        name=padright('threads=%d' % threads, 11),
+        count=len(batch),
+        secs=format(took),
+        rate=int(len(batch) / took)
+    ))
@@ -32,54 +32,68 @@
 
 
 #include <Python.h>
+#include <pythread.h>
 
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
 
 #include "py_yajl.h"
+#include "strscan.h"
+#include "numparse.h"
 
-int _PlaceObject(_YajlDecoder *self, PyObject *parent, PyObject *child)
+/*
+ * Hands a new reference to `object` over to the innermost open container,
+ * or makes it the root of the document if there isn't one. Containers are
+ * only created once all their items are known, until then the items wait
+ * on the value stack
+ */
+int PlaceObject(_YajlDecoder *self, PyObject *object)
 {
-    if ( (!self) || (!child) || (!parent) )
+    if (!object)
         return failure;
 
-    if (PyList_Check(parent)) {
-        PyList_Append(parent, child);
-        // child is now owned by parent!
-        if ((child) && (child != Py_None)) {
-            Py_XDECREF(child);
-        }
-        return success;
-    } else if (PyDict_Check(parent)) {
-        PyObject* key = py_yajl_ps_current(self->keys);
-        PyDict_SetItem(parent, key, child);
-        py_yajl_ps_pop(self->keys);
-        // child is now owned by parent!
-        Py_XDECREF(key);
-        if ((child) && (child != Py_None)) {
-            Py_XDECREF(child);
-        }
+    if (py_yajl_ps_length(self->elements) == 0) {
+        self->root = object;
         return success;
     }
-    return failure;
+
+    if (!py_yajl_ps_push(self->values, object)) {
+        Py_DECREF(object);
+        PyErr_NoMemory();
+        return failure;
+    }
+    return success;
 }
 
-int PlaceObject(_YajlDecoder *self, PyObject *object)
+static int _push_frame(_YajlDecoder *self, unsigned int dict)
 {
-    unsigned int length = py_yajl_ps_length(self->elements);
+    _YajlFrame frame;
 
-    if (length == 0) {
-        /*
-         * When the length is zero, and we're entering this code path
-         * we should only be handling "primitive types" i.e. strings and
-         * numbers, not dict/list.
-         */
-        self->root = object;
-        return success;
+    frame.dict = dict;
+    frame.start = py_yajl_ps_length(self->values);
+    frame.field = NULL;
+    if (!py_yajl_ps_push(self->elements, frame)) {
+        PyErr_NoMemory();
+        return failure;
     }
-    return _PlaceObject(self, py_yajl_ps_current(self->elements), object);
+    return success;
+}
+
+/*
+ * Closes the innermost container, returning where its items start on
+ * the value stack
+ */
+static unsigned int _pop_frame(_YajlDecoder *self)
+{
+    unsigned int start = py_yajl_ps_current(self->elements).start;
+
+    py_yajl_ps_pop(self->elements);
+    return start;
 }
 
 
@@ -94,133 +108,326 @@ static int handle_bool(void *ctx, int value)
     return PlaceObject(ctx, PyBool_FromLong((long)(value)));
 }
 
-static int handle_number(void *ctx, const char *value, unsigned int length)
+/*
+ * Numbers the fast paths in handle_number() can't deal with, i.e. very
+ * long integers and floats with more than 19 significant digits
+ */
+static PyObject *_slow_number(const char *value, unsigned int length, int floaty)
 {
-    _YajlDecoder *self = (_YajlDecoder *)(ctx);
-    PyObject *object;
+    char stackbuf[64];
+    char *buffer = stackbuf;
+    PyObject *object = NULL;
+
+    if (length >= sizeof(stackbuf)) {
+        buffer = (char *)(PyMem_Malloc(length + 1));
+        if (buffer == NULL)
+            return PyErr_NoMemory();
+    }
+    memcpy(buffer, value, length);
+    buffer[length] = '\0';
+
+    if (floaty) {
+#if PY_VERSION_HEX >= 0x02070000
+        double number = PyOS_string_to_double(buffer, NULL, NULL);
+        if ( (number != -1.0) || (!PyErr_Occurred()) )
+            object = PyFloat_FromDouble(number);
+#else
+        object = PyFloat_FromDouble(PyOS_ascii_atof(buffer));
+#endif
+    } else {
 #ifdef IS_PYTHON3
-    PyBytesObject *string;
+        object = PyLong_FromString(buffer, NULL, 10);
 #else
-    PyObject *string;
+        object = PyInt_FromString(buffer, NULL, 10);
 #endif
+    }
+
+    if (buffer != stackbuf)
+        PyMem_Free(buffer);
+    return object;
+}
+
+static PyObject *_decode_number(const char *value, unsigned int length)
+{
+    PyObject *object = NULL;
+    const char *p = value;
+    const char *end = value + length;
+    unsigned long long mantissa = 0;
+    int digits = 0, exponent = 0, negative = 0, floaty = 0, truncated = 0;
+    double number;
 
-    int floaty_char;
+    /*
+     * yajl has already checked this is a valid JSON number, so just
+     * accumulate up to 19 significant digits (as many as always fit
+     * into 64 bits) and the decimal exponent
+     */
+    if (*p == '-') {
+        negative = 1;
+        p++;
+    }
+    for (; (p < end) && (*p >= '0') && (*p <= '9'); p++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa)
+                digits++;
+        } else {
+            exponent++;
+            truncated = 1;
+        }
+    }
+    if ( (p < end) && (*p == '.') ) {
+        floaty = 1;
+        for (p++; (p < end) && (*p >= '0') && (*p <= '9'); p++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa)
+                    digits++;
+                exponent--;
+            } else if (*p != '0') {
+                truncated = 1;
+            }
+        }
+    }
+    if ( (p < end) && ((*p == 'e') || (*p == 'E')) ) {
+        int exp_negative = 0, exp_value = 0;
 
-    // take a moment here to scan the input string to see if there's
-    // any chars which suggest this is a floating point number
-    for (floaty_char = 0; floaty_char < length; floaty_char++) {
-        switch (value[floaty_char]) {
-            case '.': case 'e': case 'E': goto floatin;
+        floaty = 1;
+        p++;
+        if ( (p < end) && ((*p == '-') || (*p == '+')) ) {
+            exp_negative = (*p == '-');
+            p++;
         }
+        for (; (p < end) && (*p >= '0') && (*p <= '9'); p++) {
+            /* anything this big is 0 or inf anyway */
+            if (exp_value < 100000)
+                exp_value = exp_value * 10 + (*p - '0');
+        }
+        exponent += exp_negative ? -exp_value : exp_value;
     }
 
-  floatin:
+    if (!floaty) {
+        if (truncated) {
+            object = _slow_number(value, length, 0);
+        } else if (negative) {
+            /* -2**63 is the only magnitude over LLONG_MAX that still fits */
+            if (mantissa <= 9223372036854775808ULL) {
+                long long signed_number = -(long long)(mantissa - 1) - 1;
+#ifdef IS_PYTHON3
+                object = PyLong_FromLongLong(signed_number);
+#else
+                if (signed_number >= LONG_MIN)
+                    object = PyInt_FromLong((long)(signed_number));
+                else
+                    object = PyLong_FromLongLong(signed_number);
+#endif
+            } else {
+                object = _slow_number(value, length, 0);
+            }
+        } else {
 #ifdef IS_PYTHON3
-    string = (PyBytesObject *)PyBytes_FromStringAndSize(value, length);
-    if (floaty_char >= length) {
-        object = PyLong_FromString(string->ob_sval, NULL, 10);
+            object = PyLong_FromUnsignedLongLong(mantissa);
+#else
+            if (mantissa <= LONG_MAX)
+                object = PyInt_FromLong((long)(mantissa));
+            else
+                object = PyLong_FromUnsignedLongLong(mantissa);
+#endif
+        }
+    } else if ( (!truncated) &&
+            (py_yajl_decimal_to_double(mantissa, exponent, negative, &number)) ) {
+        object = PyFloat_FromDouble(number);
     } else {
-        object = PyFloat_FromString((PyObject *)string);
+        object = _slow_number(value, length, 1);
+    }
+
+    return object;
+}
+
+static int handle_number(void *ctx, const char *value, unsigned int length)
+{
+    return PlaceObject(ctx, _decode_number(value, length));
+}
+
+/*
+ * Most strings are plain ASCII, which can be copied straight into a new
+ * string object without going through the UTF-8 decoder
+ */
+static PyObject *_decode_string(const unsigned char *value, unsigned int length)
+{
+    PyObject *object = NULL;
+
+    if (py_yajl_ascii_prefix(value, length) < length)
+        return PyUnicode_FromStringAndSize((const char *) value, length);
+
+#ifdef IS_PEP393
+    object = PyUnicode_New(length, 127);
+    if (object) {
+        memcpy(PyUnicode_1BYTE_DATA(object), value, length);
     }
 #else
-    string = PyString_FromStringAndSize(value, length);
-    if (floaty_char >= length) {
-        object = PyInt_FromString(PyString_AS_STRING(string), NULL, 10);
-    } else {
-        object = PyFloat_FromString(string, NULL);
+    object = PyUnicode_FromUnicode(NULL, length);
+    if (object) {
+        Py_UNICODE *buffer = PyUnicode_AS_UNICODE(object);
+        unsigned int i;
+
+        for (i = 0; i < length; i++) {
+            buffer[i] = (Py_UNICODE)(value[i]);
+        }
     }
 #endif
-    Py_XDECREF(string);
-    return PlaceObject(self, object);
+    return object;
 }
 
 static int handle_string(void *ctx, const unsigned char *value, unsigned int length)
 {
-    return PlaceObject(ctx, PyUnicode_FromStringAndSize((char *)value, length));
+    return PlaceObject(ctx, _decode_string(value, length));
 }
 
 static int handle_start_dict(void *ctx)
 {
-    PyObject *object = PyDict_New();
-    if (!object)
-        return failure;
-
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->elements, object);
-    return success;
+    return _push_frame((_YajlDecoder *)(ctx), 1);
 }
 
-static int handle_dict_key(void *ctx, const unsigned char *value, unsigned int length)
+/*
+ * Records tend to repeat the same handful of keys over and over, so hand
+ * back the same (interned, already hashed) key object for the same bytes
+ */
+static PyObject *_cached_key(_YajlDecoder *self, const unsigned char *value, unsigned int length)
 {
-    PyObject *object = PyUnicode_FromStringAndSize((const char *) value, length);
+    _YajlKeyCacheEntry *entry = NULL;
+    PyObject *object = NULL;
+    unsigned int hash = 2166136261U;
+    unsigned int i;
 
+    if (length > PY_YAJL_KEY_CACHE_LEN)
+        return _decode_string(value, length);
+
+    if (self->keycache == NULL) {
+        self->keycache = (_YajlKeyCacheEntry *)(calloc(PY_YAJL_KEY_CACHE_SZ,
+                    sizeof(_YajlKeyCacheEntry)));
+        if (self->keycache == NULL)
+            return PyErr_NoMemory();
+    }
+
+    /* FNV-1a */
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ value[i]) * 16777619U;
+    }
+    entry = &self->keycache[hash & (PY_YAJL_KEY_CACHE_SZ - 1)];
+
+    if ( (entry->key) && (entry->length == length) &&
+            (memcmp(entry->bytes, value, length) == 0) ) {
+        Py_INCREF(entry->key);
+        return entry->key;
+    }
+
+    object = _decode_string(value, length);
     if (object == NULL)
-        return failure;
+        return NULL;
+#ifdef IS_PYTHON3
+    PyUnicode_InternInPlace(&object);
+#endif
+    /* Computes and caches the hash for every dict it's inserted into */
+    if (PyObject_Hash(object) == -1) {
+        Py_DECREF(object);
+        return NULL;
+    }
 
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->keys, object);
-    return success;
+    Py_XDECREF(entry->key);
+    Py_INCREF(object);
+    entry->key = object;
+    entry->length = length;
+    memcpy(entry->bytes, value, length);
+    return object;
+}
+
+static int handle_dict_key(void *ctx, const unsigned char *value, unsigned int length)
+{
+    /* the value that follows is pushed right after its key */
+    return PlaceObject(ctx, _cached_key((_YajlDecoder *)(ctx), value, length));
 }
 
+/*
+ * Creates the dict with room for exactly its number of keys, so it never
+ * has to be resized while the key, value pairs from the value stack are
+ * moved into it. The keys come from _cached_key() with their hashes
+ * already computed
+ */
 static int handle_end_dict(void *ctx)
 {
     _YajlDecoder *self = (_YajlDecoder *)(ctx);
-    PyObject *last, *popped;
-    unsigned int length;
+    PyObject **items;
+    PyObject *popped;
+    unsigned int start, count, i;
+    int rc = 0;
 
-    length = py_yajl_ps_length(self->elements);
-    if (length == 1) {
-        /*
-         * If this is the last element in the stack
-         * then it's "root" and we should finish up
-         */
-        self->root = py_yajl_ps_current(self->elements);
-        py_yajl_ps_pop(self->elements);
-        return success;
-    } else if (length < 2) {
+    if (py_yajl_ps_length(self->elements) == 0)
         return failure;
-    }
 
-    /*
-     * If not, then we should properly add this dict
-     * to it's appropriate parent
-     */
-    popped = py_yajl_ps_current(self->elements);
-    py_yajl_ps_pop(self->elements);
-    last = py_yajl_ps_current(self->elements);
+    start = _pop_frame(self);
+    count = py_yajl_ps_length(self->values) - start;
+    items = self->values.stack + start;
+
+    popped = PY_YAJL_NEW_DICT(count / 2);
+    if (!popped)
+        return failure;
+    for (i = 0; (i + 1 < count) && (rc == 0); i += 2) {
+        rc = PyDict_SetItem(popped, items[i], items[i + 1]);
+    }
+    for (i = 0; i < count; i++) {
+        Py_DECREF(items[i]);
+    }
+    self->values.used = start;
 
-    return _PlaceObject(self, last, popped);
+    if (rc != 0) {
+        Py_DECREF(popped);
+        return failure;
+    }
+    return PlaceObject(self, popped);
 }
 
 static int handle_start_list(void *ctx)
 {
-    PyObject *object = PyList_New(0);
-
-    if (!object)
-        return failure;
-
-    py_yajl_ps_push(((_YajlDecoder *)(ctx))->elements, object);
-    return success;
+    return _push_frame((_YajlDecoder *)(ctx), 0);
 }
 
+/*
+ * Creates the list (or tuple) at exactly its final size and moves the
+ * items collected on the value stack into it
+ */
 static int handle_end_list(void *ctx)
 {
     _YajlDecoder *self = (_YajlDecoder *)(ctx);
-    PyObject *last, *popped;
-    unsigned int length;
+    PyObject **items;
+    PyObject *popped;
+    unsigned int start, count, i;
 
-    length = py_yajl_ps_length(self->elements);
-    if (length == 1) {
-        self->root = py_yajl_ps_current(self->elements);
-        py_yajl_ps_pop(self->elements);
-        return success;
-    } else if (length < 2) {
+    if (py_yajl_ps_length(self->elements) == 0)
         return failure;
-    }
 
-    popped = py_yajl_ps_current(self->elements);
-    py_yajl_ps_pop(self->elements);
-    last = py_yajl_ps_current(self->elements);
+    start = _pop_frame(self);
+    count = py_yajl_ps_length(self->values) - start;
+    items = self->values.stack + start;
+
+    if (self->tuples) {
+        popped = PyTuple_New(count);
+        if (!popped)
+            return failure;
+        for (i = 0; i < count; i++) {
+            PyTuple_SET_ITEM(popped, i, items[i]);
+        }
+    } else {
+        popped = PyList_New(count);
+        if (!popped)
+            return failure;
+        for (i = 0; i < count; i++) {
+            PyList_SET_ITEM(popped, i, items[i]);
+        }
+    }
+    /* the new container owns the items now */
+    self->values.used = start;
 
-    return _PlaceObject(self, last, popped);
+    return PlaceObject(self, popped);
 }
 
 static yajl_callbacks decode_callbacks = {
@@ -237,112 +444,1451 @@ static yajl_callbacks decode_callbacks = {
     handle_end_list
 };
 
-PyObject *_internal_decode(_YajlDecoder *self, char *buffer, unsigned int buflen)
-{
-    yajl_handle parser = NULL;
-    yajl_status yrc;
-    yajl_parser_config config = { 1, 1 };
+/*
+ * With a `fields` projection, values outside of it are still validated by
+ * yajl but never turned into objects. These wrap the callbacks above.
+ */
+static const _YajlField _skip_field = { 0, NULL, NULL, 0 };
+/* stands for a value which isn't wanted at all */
+#define PY_YAJL_SKIP (&_skip_field)
 
-    if (self->elements.used > 0) {
-        py_yajl_ps_free(self->elements);
-        py_yajl_ps_init(self->elements);
-    }
-    if (self->keys.used > 0) {
-        py_yajl_ps_free(self->keys);
-        py_yajl_ps_init(self->keys);
-    }
+/* What's wanted of the next value, NULL for all of it */
+static const _YajlField *_wanted(_YajlDecoder *self)
+{
+    _YajlFrame *frame = NULL;
 
-    /* callbacks, config, allocfuncs */
-    parser = yajl_alloc(&decode_callbacks, &config, NULL, (void *)(self));
-    yrc = yajl_parse(parser, (const unsigned char *)(buffer), buflen);
-    yajl_parse_complete(parser);
-    yajl_free(parser);
+    if (py_yajl_ps_length(self->elements) == 0)
+        return self->fields;
 
-    if (yrc != yajl_status_ok) {
-        PyErr_SetObject(PyExc_ValueError,
-                PyUnicode_FromString(yajl_status_to_string(yrc)));
+    frame = &self->elements.stack[self->elements.used - 1];
+    if (frame->field == NULL)
         return NULL;
-    }
+    if (frame->dict)
+        return self->pending;
+    if (frame->field->items == NULL)
+        return PY_YAJL_SKIP;
+    return (frame->field->items->whole) ? NULL : frame->field->items;
+}
 
-    if (self->root == NULL) {
-        PyErr_SetObject(PyExc_ValueError,
-                PyUnicode_FromString("The root object is NULL"));
-        return NULL;
-    }
+static int _skipped(_YajlDecoder *self)
+{
+    return (self->skipping) || (_wanted(self) == PY_YAJL_SKIP);
+}
 
-    // Callee now owns memory, we'll leave refcnt at one and
-    // null out our pointer.
-    PyObject *root = self->root;
-    self->root = NULL;
-    return root;
+static int project_null(void *ctx)
+{
+    return _skipped(ctx) ? success : handle_null(ctx);
 }
 
-PyObject *py_yajldecoder_decode(PYARGS)
+static int project_bool(void *ctx, int value)
 {
-    _YajlDecoder *decoder = (_YajlDecoder *)(self);
-    char *buffer = NULL;
-    PyObject *pybuffer = NULL;
-    PyObject *result = NULL;
-    Py_ssize_t buflen = 0;
+    return _skipped(ctx) ? success : handle_bool(ctx, value);
+}
 
-    if (!PyArg_ParseTuple(args, "O", &pybuffer))
-        return NULL;
+static int project_number(void *ctx, const char *value, unsigned int length)
+{
+    return _skipped(ctx) ? success : handle_number(ctx, value, length);
+}
+
+static int project_string(void *ctx, const unsigned char *value, unsigned int length)
+{
+    return _skipped(ctx) ? success : handle_string(ctx, value, length);
+}
 
-    Py_INCREF(pybuffer);
+static int project_dict_key(void *ctx, const unsigned char *value, unsigned int length)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    const _YajlField *field = NULL;
+    unsigned int i;
 
-    if (PyUnicode_Check(pybuffer)) {
-        if (!(result = PyUnicode_AsUTF8String(pybuffer))) {
-            Py_DECREF(pybuffer);
-            return NULL;
+    if (self->skipping)
+        return success;
+
+    field = self->elements.stack[self->elements.used - 1].field;
+    if (field == NULL)
+        return handle_dict_key(ctx, value, length);
+
+    self->pending = PY_YAJL_SKIP;
+    for (i = 0; i < field->count; i++) {
+        if ( (field->keys[i].length == length) &&
+                (memcmp(field->keys[i].name, value, length) == 0) ) {
+            self->pending = (field->keys[i].field->whole) ? NULL : field->keys[i].field;
+            return handle_dict_key(ctx, value, length);
         }
-        Py_DECREF(pybuffer);
-        pybuffer = result;
-        result = NULL;
     }
+    return success;
+}
 
-    if (PyString_Check(pybuffer)) {
-        if (PyString_AsStringAndSize(pybuffer, &buffer, &buflen)) {
-            Py_DECREF(pybuffer);
-            return NULL;
-        }
-    } else {
-        /* really seems like this should be a TypeError, but
-           tests/unit.py:ErrorCasesTests.test_None disagrees */
-        Py_DECREF(pybuffer);
-        PyErr_SetString(PyExc_ValueError, "string or unicode expected");
-        return NULL;
+/* What's wanted of a dict or list being started, PY_YAJL_SKIP if nothing */
+static const _YajlField *_project_start(_YajlDecoder *self)
+{
+    const _YajlField *field = NULL;
+
+    if (self->skipping) {
+        self->skipping++;
+        return PY_YAJL_SKIP;
     }
+    field = _wanted(self);
+    if (field == PY_YAJL_SKIP)
+        self->skipping = 1;
+    return field;
+}
 
-    if (!buflen) {
-        PyErr_SetObject(PyExc_ValueError,
-                PyUnicode_FromString("Cannot parse an empty buffer"));
-        return NULL;
+static int project_start_dict(void *ctx)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    const _YajlField *field = _project_start(self);
+
+    if (field == PY_YAJL_SKIP)
+        return success;
+    if (handle_start_dict(ctx) != success)
+        return failure;
+    self->elements.stack[self->elements.used - 1].field = field;
+    return success;
+}
+
+static int project_end_dict(void *ctx)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+
+    if (self->skipping) {
+        self->skipping--;
+        return success;
     }
+    return handle_end_dict(ctx);
+}
 
-    result = _internal_decode(decoder, buffer, (unsigned int)buflen);
-    Py_DECREF(pybuffer);
-    return result;
+static int project_start_list(void *ctx)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
+    const _YajlField *field = _project_start(self);
+
+    if (field == PY_YAJL_SKIP)
+        return success;
+    if (handle_start_list(ctx) != success)
+        return failure;
+    self->elements.stack[self->elements.used - 1].field = field;
+    return success;
 }
 
-int yajldecoder_init(PYARGS)
+static int project_end_list(void *ctx)
 {
-    _YajlDecoder *me = (_YajlDecoder *)(self);
-    py_yajl_ps_init(me->elements);
-    py_yajl_ps_init(me->keys);
-    me->root = NULL;
+    _YajlDecoder *self = (_YajlDecoder *)(ctx);
 
-    return 0;
+    if (self->skipping) {
+        self->skipping--;
+        return success;
+    }
+    return handle_end_list(ctx);
 }
 
-void yajldecoder_dealloc(_YajlDecoder *self)
+static yajl_callbacks project_callbacks = {
+    project_null,
+    project_bool,
+    NULL,
+    NULL,
+    project_number,
+    project_string,
+    project_start_dict,
+    project_dict_key,
+    project_end_dict,
+    project_start_list,
+    project_end_list
+};
+
+/*
+ * Drop anything left over from a previous parse (i.e. one that bailed out
+ * half way through a document) so the decoder can be reused
+ */
+static void _reset_decoder(_YajlDecoder *self)
 {
-    py_yajl_ps_free(self->elements);
-    py_yajl_ps_init(self->elements);
-    py_yajl_ps_free(self->keys);
-    py_yajl_ps_init(self->keys);
+    unsigned int i;
+
+    for (i = 0; i < py_yajl_ps_length(self->values); i++) {
+        Py_XDECREF(self->values.stack[i]);
+    }
+    self->elements.used = 0;
+    self->values.used = 0;
+    self->pending = NULL;
+    self->skipping = 0;
+
     if (self->root) {
         Py_XDECREF(self->root);
+        self->root = NULL;
     }
+}
+
+/*
+ * The first half of decoding a long document: yajl lexes and validates it
+ * onto the decoder's tape, without touching any Python objects
+ */
+static int tape_null(void *ctx)
+{
+    return py_yajl_tape_push(ctx, PY_YAJL_TOKEN_NULL, 0, 0) != NULL;
+}
+
+static int tape_bool(void *ctx, int value)
+{
+    return py_yajl_tape_push(ctx, value ? PY_YAJL_TOKEN_TRUE : PY_YAJL_TOKEN_FALSE, 0, 0) != NULL;
+}
+
+static int tape_number(void *ctx, const char *value, unsigned int length)
+{
+    return py_yajl_tape_push_bytes(ctx, PY_YAJL_TOKEN_NUMBER,
+            (const unsigned char *)(value), length);
+}
+
+static int tape_string(void *ctx, const unsigned char *value, unsigned int length)
+{
+    return py_yajl_tape_push_bytes(ctx, PY_YAJL_TOKEN_STRING, value, length);
+}
+
+static int tape_dict_key(void *ctx, const unsigned char *value, unsigned int length)
+{
+    return py_yajl_tape_push_bytes(ctx, PY_YAJL_TOKEN_KEY, value, length);
+}
+
+static int tape_start_dict(void *ctx)
+{
+    return py_yajl_tape_open(ctx, PY_YAJL_TOKEN_START_DICT);
+}
+
+static int tape_end_dict(void *ctx)
+{
+    return py_yajl_tape_close(ctx, PY_YAJL_TOKEN_END_DICT);
+}
+
+static int tape_start_list(void *ctx)
+{
+    return py_yajl_tape_open(ctx, PY_YAJL_TOKEN_START_LIST);
+}
+
+static int tape_end_list(void *ctx)
+{
+    return py_yajl_tape_close(ctx, PY_YAJL_TOKEN_END_LIST);
+}
+
+static yajl_callbacks tape_callbacks = {
+    tape_null,
+    tape_bool,
+    NULL,
+    NULL,
+    tape_number,
+    tape_string,
+    tape_start_dict,
+    tape_dict_key,
+    tape_end_dict,
+    tape_start_list,
+    tape_end_list
+};
+
+/*
+ * The second half: walks the tape with the GIL held, building objects.
+ * The tape already knows how many items every dict and list will have, so
+ * each is created at its final size and filled in place. While a container
+ * is open it sits on the value stack (with the key of a dict's pending
+ * value above it), and its frame counts the items filled in so far.
+ */
+static int _push_value(_YajlDecoder *self, PyObject *object)
+{
+    if (object == NULL)
+        return failure;
+    if (!py_yajl_ps_push(self->values, object)) {
+        Py_DECREF(object);
+        PyErr_NoMemory();
+        return failure;
+    }
+    return success;
+}
+
+static int _build_from_tape(_YajlDecoder *self, py_yajl_tape *tape,
+        size_t first, size_t last)
+{
+    py_yajl_token *token = tape->tokens + first;
+    py_yajl_token *end = tape->tokens + last;
+    _YajlFrame *frame = NULL;
+    PyObject *object = NULL;
+    PyObject *key = NULL;
+    int rc;
+
+    for (; token < end; token++) {
+        switch (PY_YAJL_TOKEN_TYPE(token)) {
+            case PY_YAJL_TOKEN_NULL:
+                Py_INCREF(Py_None);
+                object = Py_None;
+                break;
+            case PY_YAJL_TOKEN_FALSE:
+                Py_INCREF(Py_False);
+                object = Py_False;
+                break;
+            case PY_YAJL_TOKEN_TRUE:
+                Py_INCREF(Py_True);
+                object = Py_True;
+                break;
+            case PY_YAJL_TOKEN_NUMBER:
+                object = _decode_number(
+                        (const char *)(py_yajl_tape_bytes(tape, token)), token->length);
+                break;
+            case PY_YAJL_TOKEN_STRING:
+                object = _decode_string(py_yajl_tape_bytes(tape, token), token->length);
+                break;
+            case PY_YAJL_TOKEN_KEY:
+                object = _cached_key(self, py_yajl_tape_bytes(tape, token), token->length);
+                if (_push_value(self, object) != success)
+                    return failure;
+                continue;
+            case PY_YAJL_TOKEN_START_DICT:
+                object = PY_YAJL_NEW_DICT(token->length);
+                if ( (_push_value(self, object) != success) ||
+                        (_push_frame(self, 1) != success) ) {
+                    return failure;
+                }
+                continue;
+            case PY_YAJL_TOKEN_START_LIST:
+                if (self->tuples) {
+                    object = PyTuple_New(token->length);
+                } else {
+                    object = PyList_New(token->length);
+                }
+                if ( (_push_value(self, object) != success) ||
+                        (_push_frame(self, 0) != success) ) {
+                    return failure;
+                }
+                /* counts the items filled in, rather than where they start */
+                self->elements.stack[self->elements.used - 1].start = 0;
+                continue;
+            case PY_YAJL_TOKEN_END_DICT:
+            case PY_YAJL_TOKEN_END_LIST:
+                if (py_yajl_ps_length(self->elements) == 0)
+                    return failure;
+                py_yajl_ps_pop(self->elements);
+                object = py_yajl_ps_current(self->values);
+                py_yajl_ps_pop(self->values);
+                break;
+            default:
+                return failure;
+        }
+
+        if (object == NULL)
+            return failure;
+
+        if (py_yajl_ps_length(self->elements) == 0) {
+            self->root = object;
+            continue;
+        }
+
+        frame = &self->elements.stack[self->elements.used - 1];
+        if (!frame->dict) {
+            /* the tape's item counts can be trusted, they came from yajl */
+            assert(frame->start < (unsigned int)(Py_SIZE(py_yajl_ps_current(self->values))));
+            if (self->tuples) {
+                PyTuple_SET_ITEM(py_yajl_ps_current(self->values), frame->start, object);
+            } else {
+                PyList_SET_ITEM(py_yajl_ps_current(self->values), frame->start, object);
+            }
+            frame->start++;
+            continue;
+        }
+
+        key = py_yajl_ps_current(self->values);
+        py_yajl_ps_pop(self->values);
+        rc = PyDict_SetItem(py_yajl_ps_current(self->values), key, object);
+        Py_DECREF(key);
+        Py_DECREF(object);
+        if (rc != 0)
+            return failure;
+    }
+    return success;
+}
+
+/*
+ * Hands `buffer` to yajl, which only takes unsigned int lengths, at most
+ * PY_YAJL_SLICE bytes at a time; `progress`, if any, is called with the
+ * bytes fed so far and the total after each slice. Adds the bytes yajl
+ * took before it finished or gave up to `consumed`, if that's wanted.
+ * May be called without the GIL, which is then taken for `progress`.
+ */
+static yajl_status _internal_feed(yajl_handle parser, const unsigned char *buffer,
+        size_t buflen, PyObject *progress, size_t *consumed)
+{
+    yajl_status yrc = yajl_status_insufficient_data;
+    PyGILState_STATE gstate;
+    PyObject *result = NULL;
+    size_t done = 0, slice;
+
+    while ( (done < buflen) && (yrc == yajl_status_insufficient_data) ) {
+        slice = (buflen - done > PY_YAJL_SLICE) ? PY_YAJL_SLICE : buflen - done;
+        yrc = yajl_parse(parser, buffer + done, (unsigned int)(slice));
+        if (yrc != yajl_status_insufficient_data) {
+            done += yajl_get_bytes_consumed(parser);
+            break;
+        }
+        done += slice;
+
+        if (progress) {
+            gstate = PyGILState_Ensure();
+            result = PyObject_CallFunction(progress, "nn",
+                    (Py_ssize_t)(done), (Py_ssize_t)(buflen));
+            Py_XDECREF(result);
+            PyGILState_Release(gstate);
+            if (result == NULL) {
+                yrc = yajl_status_client_canceled;
+                break;
+            }
+        }
+    }
+    if (consumed) {
+        *consumed += done;
+    }
+    return yrc;
+}
+
+yajl_handle _internal_decode_start(_YajlDecoder *self)
+{
+    yajl_parser_config config = { 1, 1 };
+    yajl_alloc_funcs allocs;
+    yajl_handle parser = NULL;
+
+    _reset_decoder(self);
+    py_yajl_arena_funcs(&self->arena, &allocs);
+
+    /* callbacks, config, allocfuncs */
+    parser = yajl_alloc((self->fields) ? &project_callbacks : &decode_callbacks,
+            &config, &allocs, (void *)(self));
+    self->parsing = (parser != NULL);
+    return parser;
+}
+
+PyObject *_internal_decode_finish(_YajlDecoder *self, yajl_handle parser, yajl_status yrc)
+{
+    /*
+     * A document ending in a bare number can't be terminated until
+     * yajl knows there's no more input coming
+     */
+    if (yrc == yajl_status_insufficient_data) {
+        yrc = yajl_parse_complete(parser);
+    }
+    yajl_free(parser);
+    py_yajl_arena_reset(&self->arena);
+    self->parsing = 0;
+
+    if (yrc != yajl_status_ok) {
+        _reset_decoder(self);
+        /* Prefer an exception raised from inside one of our callbacks */
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_ValueError,
+                    PyUnicode_FromString(yajl_status_to_string(yrc)));
+        }
+        return NULL;
+    }
+
+    if (self->root == NULL) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("The root object is NULL"));
+        return NULL;
+    }
+
+    // Callee now owns memory, we'll leave refcnt at one and
+    // null out our pointer.
+    PyObject *root = self->root;
+    self->root = NULL;
+    return root;
+}
+
+/*
+ * Lexes `buffer` onto `tape`, with yajl's memory coming from `arena`.
+ * Touches no Python objects other than `progress`, so it's safe to call
+ * without the GIL
+ */
+yajl_status _internal_lex(py_yajl_tape *tape, py_yajl_arena *arena,
+        const unsigned char *buffer, size_t buflen, PyObject *progress)
+{
+    yajl_parser_config config = { 1, 1 };
+    yajl_alloc_funcs allocs;
+    yajl_handle parser = NULL;
+    yajl_status yrc;
+
+    py_yajl_tape_reset(tape, buffer, buflen);
+    py_yajl_arena_funcs(arena, &allocs);
+
+    parser = yajl_alloc(&tape_callbacks, &config, &allocs, (void *)(tape));
+    if (parser == NULL) {
+        tape->failed = 1;
+        return yajl_status_error;
+    }
+
+    yrc = _internal_feed(parser, buffer, buflen, progress, NULL);
+    if (yrc == yajl_status_insufficient_data) {
+        yrc = yajl_parse_complete(parser);
+    }
+    yajl_free(parser);
+    py_yajl_arena_reset(arena);
+    return yrc;
+}
+
+/*
+ * Builds the objects for a lexed tape with a `fields` projection, feeding
+ * the tokens to the projecting callbacks; whatever isn't wanted of a dict
+ * or list is jumped over in one go
+ */
+static int _replay_projected(_YajlDecoder *self, py_yajl_tape *tape)
+{
+    py_yajl_token *token = tape->tokens;
+    py_yajl_token *end = tape->tokens + tape->used;
+    int rc = success;
+
+    for (; (token < end) && (rc == success); token++) {
+        switch (PY_YAJL_TOKEN_TYPE(token)) {
+            case PY_YAJL_TOKEN_NULL:
+                rc = project_null(self);
+                break;
+            case PY_YAJL_TOKEN_FALSE:
+                rc = project_bool(self, 0);
+                break;
+            case PY_YAJL_TOKEN_TRUE:
+                rc = project_bool(self, 1);
+                break;
+            case PY_YAJL_TOKEN_NUMBER:
+                rc = project_number(self,
+                        (const char *)(py_yajl_tape_bytes(tape, token)), token->length);
+                break;
+            case PY_YAJL_TOKEN_STRING:
+                rc = project_string(self, py_yajl_tape_bytes(tape, token), token->length);
+                break;
+            case PY_YAJL_TOKEN_KEY:
+                rc = project_dict_key(self, py_yajl_tape_bytes(tape, token), token->length);
+                break;
+            case PY_YAJL_TOKEN_START_DICT:
+            case PY_YAJL_TOKEN_START_LIST:
+                if (PY_YAJL_TOKEN_TYPE(token) == PY_YAJL_TOKEN_START_DICT)
+                    rc = project_start_dict(self);
+                else
+                    rc = project_start_list(self);
+                if (self->skipping) {
+                    self->skipping = 0;
+                    token = tape->tokens + token->offset;
+                }
+                break;
+            case PY_YAJL_TOKEN_END_DICT:
+                rc = project_end_dict(self);
+                break;
+            case PY_YAJL_TOKEN_END_LIST:
+                rc = project_end_list(self);
+                break;
+            default:
+                rc = failure;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Builds the objects for a tape filled in by _internal_lex(), which
+ * returned `yrc`, or raises the error it ran into
+ */
+PyObject *_internal_build(_YajlDecoder *self, py_yajl_tape *tape, yajl_status yrc)
+{
+    PyObject *root = NULL;
+
+    _reset_decoder(self);
+    if (tape->failed) {
+        PyErr_NoMemory();
+    } else if (yrc != yajl_status_ok) {
+        /* unless it was `progress` which gave up */
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_ValueError,
+                    PyUnicode_FromString(yajl_status_to_string(yrc)));
+        }
+    } else if ( ((self->fields) ? _replay_projected(self, tape) :
+                _build_from_tape(self, tape, 0, tape->used)) != success ) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_ValueError,
+                    PyUnicode_FromString("Malformed tape"));
+        }
+    } else {
+        root = self->root;
+        self->root = NULL;
+    }
+    _reset_decoder(self);
+    return root;
+}
+
+/*
+ * Builds the value which starts at token `index` of a lexed tape in full,
+ * i.e. everything up to the end of a dict or list
+ */
+PyObject *_internal_build_value(_YajlDecoder *self, py_yajl_tape *tape, size_t index)
+{
+    py_yajl_token *token = &tape->tokens[index];
+    size_t last = index + 1;
+    PyObject *root = NULL;
+
+    if ( (PY_YAJL_TOKEN_TYPE(token) == PY_YAJL_TOKEN_START_DICT) ||
+            (PY_YAJL_TOKEN_TYPE(token) == PY_YAJL_TOKEN_START_LIST) ) {
+        last = token->offset + 1;
+    }
+
+    _reset_decoder(self);
+    self->parsing = 1;
+    if (_build_from_tape(self, tape, index, last) == success) {
+        root = self->root;
+        self->root = NULL;
+    } else if (!PyErr_Occurred()) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("Malformed tape"));
+    }
+    _reset_decoder(self);
+    self->parsing = 0;
+    return root;
+}
+
+/* The str for the dict key at token `index` of a lexed tape */
+PyObject *_internal_build_key(_YajlDecoder *self, py_yajl_tape *tape, size_t index)
+{
+    py_yajl_token *token = &tape->tokens[index];
+
+    return _cached_key(self, py_yajl_tape_bytes(tape, token), token->length);
+}
+
+/*
+ * Decodes a long document in two passes, so that other threads can run
+ * while yajl is busy with the first one
+ */
+static PyObject *_internal_decode_tape(_YajlDecoder *self, char *buffer, size_t buflen)
+{
+    py_yajl_tape *tape = &self->tape;
+    PyObject *root = NULL;
+    yajl_status yrc;
+
+    self->parsing = 1;
+    Py_BEGIN_ALLOW_THREADS
+    yrc = _internal_lex(tape, &self->arena, (const unsigned char *)(buffer), buflen,
+            self->progress);
+    Py_END_ALLOW_THREADS
+
+    root = _internal_build(self, tape, yrc);
+    py_yajl_tape_trim(tape);
+    self->parsing = 0;
+    return root;
+}
+
+PyObject *_internal_decode(_YajlDecoder *self, char *buffer, size_t buflen)
+{
+    yajl_handle parser = NULL;
+    yajl_status yrc;
+
+    if (buflen >= PY_YAJL_TAPE_MIN) {
+        return _internal_decode_tape(self, buffer, buflen);
+    }
+
+    parser = _internal_decode_start(self);
+
+    if (parser == NULL) {
+        return PyErr_NoMemory();
+    }
+
+    yrc = _internal_feed(parser, (const unsigned char *)(buffer), buflen,
+            self->progress, NULL);
+    return _internal_decode_finish(self, parser, yrc);
+}
+
+/*
+ * The offset of the first thing after a document's value which isn't
+ * whitespace (or, with `comments`, a comment), `buflen` if there's none
+ */
+static size_t _trailing_content(const unsigned char *buffer, size_t offset,
+        size_t buflen, int comments)
+{
+    while (offset < buflen) {
+        switch (buffer[offset]) {
+            case ' ': case '\t': case '\n': case '\r':
+                offset++;
+                continue;
+            default:
+                break;
+        }
+        if ( (!comments) || (buffer[offset] != '/') || (offset + 1 == buflen) )
+            return offset;
+        if (buffer[offset + 1] == '/') {
+            for (offset += 2; (offset < buflen) && (buffer[offset] != '\n'); offset++);
+        } else if (buffer[offset + 1] == '*') {
+            size_t start = offset;
+            for (offset += 2; (offset + 1 < buflen) &&
+                    ((buffer[offset] != '*') || (buffer[offset + 1] != '/')); offset++);
+            if (offset + 1 >= buflen)
+                return start;
+            offset += 2;
+        } else {
+            return offset;
+        }
+    }
+    return buflen;
+}
+
+/*
+ * Parses `buffer` without building anything, setting `offset` to -1 if it
+ * holds a well formed document or to the byte yajl gave up at if it
+ * doesn't. yajl's own UTF-8 checking works a byte at a time, so when
+ * `check_utf8` is set the whole buffer is checked up front instead.
+ * Comments are only allowed with `comments` set.
+ */
+static yajl_status _validate_buffer(py_yajl_arena *arena, const unsigned char *buffer,
+        size_t buflen, int check_utf8, int comments, Py_ssize_t *offset)
+{
+    yajl_parser_config config = { 0, 0 };
+    yajl_alloc_funcs allocs;
+    yajl_handle parser = NULL;
+    yajl_status yrc;
+    size_t invalid = buflen;
+    size_t consumed = 0;
+
+    config.allowComments = comments ? 1 : 0;
+    if (check_utf8) {
+        invalid = py_yajl_utf8_invalid(buffer, buflen);
+    }
+
+    py_yajl_arena_funcs(arena, &allocs);
+    parser = yajl_alloc(NULL, &config, &allocs, NULL);
+    if (parser == NULL) {
+        return yajl_status_error;
+    }
+
+    yrc = _internal_feed(parser, buffer, buflen, NULL, &consumed);
+    if (yrc == yajl_status_insufficient_data) {
+        yrc = yajl_parse_complete(parser);
+        consumed = buflen;
+    }
+    yajl_free(parser);
+    py_yajl_arena_reset(arena);
+
+    /* yajl stops at the end of the value, anything after it is an error */
+    if ( (yrc == yajl_status_ok) && (consumed < buflen) ) {
+        consumed = _trailing_content(buffer, consumed, buflen, comments);
+        if (consumed < buflen)
+            yrc = yajl_status_error;
+    }
+
+    if (yrc == yajl_status_ok) {
+        *offset = (invalid < consumed) ? (Py_ssize_t)(invalid) : -1;
+    }
+    else {
+        *offset = (Py_ssize_t)((invalid < consumed) ? invalid : consumed);
+    }
+    return yajl_status_ok;
+}
+
+int _internal_validate(_YajlDecoder *self, char *buffer, size_t buflen,
+        int check_utf8, int comments, Py_ssize_t *offset)
+{
+    yajl_status yrc;
+
+    self->parsing = 1;
+    if (buflen >= PY_YAJL_TAPE_MIN) {
+        Py_BEGIN_ALLOW_THREADS
+        yrc = _validate_buffer(&self->arena, (const unsigned char *)(buffer), buflen,
+                check_utf8, comments, offset);
+        Py_END_ALLOW_THREADS
+    }
+    else {
+        yrc = _validate_buffer(&self->arena, (const unsigned char *)(buffer), buflen,
+                check_utf8, comments, offset);
+    }
+    self->parsing = 0;
+
+    if (yrc != yajl_status_ok) {
+        PyErr_NoMemory();
+        return failure;
+    }
+    return success;
+}
+
+/*
+ * The bytes held by an owner from _internal_input()
+ */
+static void _input_bytes(PyObject *owner, char **buffer, Py_ssize_t *buflen)
+{
+#ifdef IS_PEP393
+    if (PyUnicode_Check(owner)) {
+        *buffer = (char *)(PyUnicode_1BYTE_DATA(owner));
+        *buflen = PyUnicode_GET_LENGTH(owner);
+        return;
+    }
+#endif
+    if (PyMemoryView_Check(owner)) {
+        Py_buffer *view = PyMemoryView_GET_BUFFER(owner);
+        *buffer = (char *)(view->buf);
+        *buflen = view->len;
+    } else {
+        PyString_AsStringAndSize(owner, buffer, buflen);
+    }
+}
+
+/*
+ * loads_many() lexes its documents on a pool of C threads, none of which
+ * ever needs the GIL; the calling thread lexes alongside them and then
+ * builds all the objects, in order, once they're done
+ */
+typedef struct {
+    const unsigned char *buffer;
+    Py_ssize_t buflen;
+    py_yajl_tape tape;
+    yajl_status status;
+} _YajlBatchItem;
+
+/* items a thread claims at a time */
+#define PY_YAJL_BATCH_STEP 8
+
+/* bytes of input it takes for another thread to be worth waking */
+#define PY_YAJL_BATCH_BYTES 65536
+
+typedef struct {
+    _YajlBatchItem *items;
+    Py_ssize_t count;
+    /* the next items to lex, guarded by `lock` */
+    Py_ssize_t next;
+    /* threads (the caller included) still lexing, guarded by `lock` */
+    int running;
+    PyThread_type_lock lock;
+    /* held by the caller until the last thread is done */
+    PyThread_type_lock done;
+} _YajlBatch;
+
+/*
+ * The pool's threads outlive the calls that started them, each blocking
+ * on its own `wake` lock until it's handed another batch
+ */
+typedef struct {
+    PyThread_type_lock wake;
+    /* the batch being lexed, NULL while idle, guarded by _pool.lock */
+    _YajlBatch *batch;
+} _YajlPoolThread;
+
+/* most threads the pool keeps */
+#define PY_YAJL_POOL_MAX 64
+
+static struct {
+    PyThread_type_lock lock;
+    _YajlPoolThread *threads[PY_YAJL_POOL_MAX];
+    int size;
+    /* the process the threads were started in, they don't survive fork() */
+    long pid;
+} _pool;
+
+static void _batch_worker(_YajlBatch *batch, _YajlPoolThread *thread)
+{
+    _YajlBatchItem *item = NULL;
+    py_yajl_arena arena;
+    py_yajl_tape scratch;
+    Py_ssize_t index, stop;
+    int last;
+
+    memset(&arena, 0, sizeof(py_yajl_arena));
+    py_yajl_tape_init(&scratch);
+    for (;;) {
+        PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+        index = batch->next;
+        batch->next += PY_YAJL_BATCH_STEP;
+        PyThread_release_lock(batch->lock);
+        if (index >= batch->count)
+            break;
+
+        stop = (index + PY_YAJL_BATCH_STEP < batch->count) ?
+                index + PY_YAJL_BATCH_STEP : batch->count;
+        for (; index < stop; index++) {
+            item = &batch->items[index];
+            if (item->buflen == 0) {
+                continue;
+            }
+            item->status = _internal_lex(&scratch, &arena, item->buffer,
+                    (size_t)(item->buflen), NULL);
+            /* the tapes are all held until the objects get built */
+            py_yajl_tape_copy(&item->tape, &scratch);
+        }
+    }
+    py_yajl_tape_release(&scratch);
+    py_yajl_arena_release(&arena);
+
+    /* idle again before the caller can see the batch is done */
+    if (thread) {
+        PyThread_acquire_lock(_pool.lock, WAIT_LOCK);
+        thread->batch = NULL;
+        PyThread_release_lock(_pool.lock);
+    }
+
+    PyThread_acquire_lock(batch->lock, WAIT_LOCK);
+    last = (--batch->running == 0);
+    PyThread_release_lock(batch->lock);
+    if (last)
+        PyThread_release_lock(batch->done);
+}
+
+static void _pool_thread(void *arg)
+{
+    _YajlPoolThread *thread = (_YajlPoolThread *)(arg);
+    _YajlBatch *batch;
+
+    for (;;) {
+        PyThread_acquire_lock(thread->wake, WAIT_LOCK);
+        PyThread_acquire_lock(_pool.lock, WAIT_LOCK);
+        batch = thread->batch;
+        PyThread_release_lock(_pool.lock);
+        if (batch)
+            _batch_worker(batch, thread);
+    }
+}
+
+/*
+ * Hands `batch` to up to `wanted` idle pool threads, starting more if there
+ * aren't enough, and returns how many took it. Called with the GIL held,
+ * which keeps other callers out of here.
+ */
+static int _pool_start(_YajlBatch *batch, int wanted)
+{
+    _YajlPoolThread *thread = NULL;
+    long pid = (long)(getpid());
+    int i, started = 0;
+
+    if ( (_pool.lock) && (_pool.pid != pid) ) {
+        /* a forked child has none of the threads, and maybe a held lock */
+        memset(&_pool, 0, sizeof(_pool));
+    }
+    if (_pool.lock == NULL) {
+        if (!(_pool.lock = PyThread_allocate_lock()))
+            return 0;
+        _pool.pid = pid;
+    }
+
+    PyThread_acquire_lock(_pool.lock, WAIT_LOCK);
+    for (i = 0; (i < _pool.size) && (started < wanted); i++) {
+        if (_pool.threads[i]->batch == NULL) {
+            _pool.threads[i]->batch = batch;
+            PyThread_release_lock(_pool.threads[i]->wake);
+            started++;
+        }
+    }
+    PyThread_release_lock(_pool.lock);
+
+    while ( (started < wanted) && (_pool.size < PY_YAJL_POOL_MAX) ) {
+        thread = (_YajlPoolThread *)(calloc(1, sizeof(_YajlPoolThread)));
+        if (thread == NULL)
+            break;
+        if (!(thread->wake = PyThread_allocate_lock())) {
+            free(thread);
+            break;
+        }
+        /* it's not in the pool yet, so nothing else can see `batch` */
+        thread->batch = batch;
+        /* -1 (as whatever the thread id type is) if it failed */
+        if ((long)(PyThread_start_new_thread(_pool_thread, thread)) == -1) {
+            PyThread_free_lock(thread->wake);
+            free(thread);
+            break;
+        }
+        _pool.threads[_pool.size++] = thread;
+        started++;
+    }
+    return started;
+}
+
+/*
+ * One thread per CPU, unless asked otherwise, but no more than have a
+ * share of the items and PY_YAJL_BATCH_BYTES of input each
+ */
+static int _batch_threads(int threads, Py_ssize_t count, Py_ssize_t total)
+{
+#if defined(HAVE_SYSCONF) && defined(_SC_NPROCESSORS_ONLN)
+    if (threads <= 0)
+        threads = (int)(sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+    if (threads > (count + PY_YAJL_BATCH_STEP - 1) / PY_YAJL_BATCH_STEP)
+        threads = (int)((count + PY_YAJL_BATCH_STEP - 1) / PY_YAJL_BATCH_STEP);
+    if (threads > total / PY_YAJL_BATCH_BYTES + 1)
+        threads = (int)(total / PY_YAJL_BATCH_BYTES + 1);
+    if (threads > PY_YAJL_POOL_MAX + 1)
+        threads = PY_YAJL_POOL_MAX + 1;
+    if (threads <= 0)
+        threads = 1;
+    return threads;
+}
+
+/*
+ * Decodes every str or bytes object in `sequence`, lexing them on up to
+ * `threads` threads. A document which fails to decode raises a ValueError
+ * (with the document's `index`) or, if `return_errors` is set, has that
+ * error put in its place in the list returned
+ */
+PyObject *_internal_decode_many(_YajlDecoder *self, PyObject *sequence,
+        int threads, int return_errors)
+{
+    _YajlBatch batch;
+    PyObject *owners = NULL;
+    PyObject *result = NULL;
+    PyObject *object = NULL;
+    PyObject *index = NULL;
+    PyObject *type, *value, *traceback;
+    char *buffer = NULL;
+    Py_ssize_t i, buflen = 0, total = 0;
+    int started = 0;
+
+    memset(&batch, 0, sizeof(_YajlBatch));
+    if (!(sequence = PySequence_Fast(sequence, "loads_many() expects a sequence")))
+        return NULL;
+    batch.count = PySequence_Fast_GET_SIZE(sequence);
+
+    /* the str objects' UTF-8 copies, and buffer exports, have to outlive the lexing */
+    if (!(owners = PyList_New(batch.count)))
+        goto done;
+    for (i = 0; i < batch.count; i++) {
+        object = _internal_input(PySequence_Fast_GET_ITEM(sequence, i), &buffer, &buflen);
+        if (object == NULL)
+            goto done;
+        PyList_SET_ITEM(owners, i, object);
+    }
+
+    if (batch.count) {
+        batch.items = (_YajlBatchItem *)(calloc(batch.count, sizeof(_YajlBatchItem)));
+        batch.lock = PyThread_allocate_lock();
+        batch.done = PyThread_allocate_lock();
+        if ( (batch.items == NULL) || (batch.lock == NULL) || (batch.done == NULL) ) {
+            PyErr_NoMemory();
+            goto done;
+        }
+    }
+    for (i = 0; i < batch.count; i++) {
+        _input_bytes(PyList_GET_ITEM(owners, i), &buffer, &buflen);
+        batch.items[i].buffer = (const unsigned char *)(buffer);
+        batch.items[i].buflen = buflen;
+        batch.items[i].status = yajl_status_error;
+        total += buflen;
+    }
+
+    if (batch.count) {
+        threads = _batch_threads(threads, batch.count, total);
+        PyThread_acquire_lock(batch.done, WAIT_LOCK);
+        batch.running = threads;
+
+        started = (threads > 1) ? 1 + _pool_start(&batch, threads - 1) : 1;
+        /* threads which couldn't be had have nothing to wait for */
+        PyThread_acquire_lock(batch.lock, WAIT_LOCK);
+        batch.running -= threads - started;
+        PyThread_release_lock(batch.lock);
+
+        Py_BEGIN_ALLOW_THREADS
+        _batch_worker(&batch, NULL);
+        PyThread_acquire_lock(batch.done, WAIT_LOCK);
+        PyThread_release_lock(batch.done);
+        Py_END_ALLOW_THREADS
+    }
+
+    if (!(result = PyList_New(batch.count)))
+        goto done;
+    self->parsing = 1;
+    for (i = 0; i < batch.count; i++) {
+        if (batch.items[i].buflen == 0) {
+            PyErr_SetString(PyExc_ValueError, "Cannot parse an empty buffer");
+            object = NULL;
+        } else {
+            object = _internal_build(self, &batch.items[i].tape, batch.items[i].status);
+        }
+        py_yajl_tape_release(&batch.items[i].tape);
+
+        if ( (object == NULL) && (PyErr_ExceptionMatches(PyExc_ValueError)) ) {
+            /* tell which of the documents it was */
+            PyErr_Fetch(&type, &value, &traceback);
+            PyErr_NormalizeException(&type, &value, &traceback);
+            index = PyLong_FromSsize_t(i);
+            if ( (value == NULL) || (index == NULL) ||
+                    (PyObject_SetAttrString(value, "index", index) < 0) ) {
+                Py_XDECREF(type);
+                Py_XDECREF(value);
+                Py_XDECREF(traceback);
+            } else if (return_errors) {
+                object = value;
+                Py_XDECREF(type);
+                Py_XDECREF(traceback);
+            } else {
+                PyErr_Restore(type, value, traceback);
+            }
+            Py_XDECREF(index);
+        }
+        if (object == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, object);
+    }
+    self->parsing = 0;
+
+done:
+    if (batch.items) {
+        for (i = 0; i < batch.count; i++) {
+            py_yajl_tape_release(&batch.items[i].tape);
+        }
+        free(batch.items);
+    }
+    if (batch.lock)
+        PyThread_free_lock(batch.lock);
+    if (batch.done)
+        PyThread_free_lock(batch.done);
+    Py_XDECREF(owners);
+    Py_DECREF(sequence);
+    return result;
+}
+
+static void _free_fields(_YajlField *field)
+{
+    unsigned int i;
+
+    if (field == NULL)
+        return;
+    for (i = 0; i < field->count; i++) {
+        free(field->keys[i].name);
+        _free_fields(field->keys[i].field);
+    }
+    free(field->keys);
+    _free_fields(field->items);
+    free(field);
+}
+
+/* The node below `field` for the key `name`, added if it's not there */
+static _YajlField *_field_key(_YajlField *field, const char *name, unsigned int length)
+{
+    _YajlFieldKey *keys = NULL;
+    _YajlFieldKey *key = NULL;
+    unsigned int i;
+
+    for (i = 0; i < field->count; i++) {
+        if ( (field->keys[i].length == length) &&
+                (memcmp(field->keys[i].name, name, length) == 0) ) {
+            return field->keys[i].field;
+        }
+    }
+
+    keys = (_YajlFieldKey *)(realloc(field->keys, sizeof(_YajlFieldKey) * (field->count + 1)));
+    if (keys == NULL)
+        return NULL;
+    field->keys = keys;
+    key = &keys[field->count];
+    key->name = (char *)(malloc(length + 1));
+    key->field = (_YajlField *)(calloc(1, sizeof(_YajlField)));
+    if ( (key->name == NULL) || (key->field == NULL) ) {
+        free(key->name);
+        free(key->field);
+        return NULL;
+    }
+    memcpy(key->name, name, length);
+    key->length = length;
+    field->count++;
+    return key->field;
+}
+
+/*
+ * Adds one path, such as "user.id" or "items[*].price", to the trie:
+ * dict keys separated by dots, with `[*]` standing for every item of a list
+ */
+static int _compile_path(_YajlField *root, const char *path, Py_ssize_t length)
+{
+    const char *p = path;
+    const char *end = path + length;
+    const char *name = NULL;
+    _YajlField *field = root;
+
+    if (length == 0)
+        goto invalid;
+
+    while (p < end) {
+        if (*p == '[') {
+            if ( (end - p < 3) || (memcmp(p, "[*]", 3) != 0) )
+                goto invalid;
+            if ( (field->items == NULL) &&
+                    (!(field->items = (_YajlField *)(calloc(1, sizeof(_YajlField))))) ) {
+                PyErr_NoMemory();
+                return failure;
+            }
+            field = field->items;
+            p += 3;
+            continue;
+        }
+        if (p != path) {
+            if (*p != '.')
+                goto invalid;
+            p++;
+        }
+        for (name = p; (p < end) && (*p != '.') && (*p != '['); p++) {
+        }
+        if (p == name)
+            goto invalid;
+        if (!(field = _field_key(field, name, (unsigned int)(p - name)))) {
+            PyErr_NoMemory();
+            return failure;
+        }
+    }
+    field->whole = 1;
+    return success;
+
+invalid:
+    PyErr_Format(PyExc_ValueError, "Invalid field path: '%s'", path);
+    return failure;
+}
+
+static _YajlField *_compile_fields(PyObject *spec)
+{
+    _YajlField *root = (_YajlField *)(calloc(1, sizeof(_YajlField)));
+    PyObject *item = NULL;
+    PyObject *owner = NULL;
+    char *path = NULL;
+    Py_ssize_t i, length = 0;
+    int rc;
+
+    if (root == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (i = 0; i < PyTuple_GET_SIZE(spec); i++) {
+        item = PyTuple_GET_ITEM(spec, i);
+        if (PyUnicode_Check(item)) {
+            owner = PyUnicode_AsUTF8String(item);
+        } else if (PyString_Check(item)) {
+            Py_INCREF(item);
+            owner = item;
+        } else {
+            PyErr_SetString(PyExc_TypeError, "`fields` must be strings");
+            owner = NULL;
+        }
+        if ( (owner == NULL) || (PyString_AsStringAndSize(owner, &path, &length)) ) {
+            Py_XDECREF(owner);
+            _free_fields(root);
+            return NULL;
+        }
+        rc = _compile_path(root, path, length);
+        Py_DECREF(owner);
+        if (rc != success) {
+            _free_fields(root);
+            return NULL;
+        }
+    }
+    return root;
+}
+
+/*
+ * Decodes only the parts of the document named by the paths in `fields`,
+ * or all of it if that's NULL or None. The trie compiled from the paths
+ * is kept for as long as the same ones keep being asked for
+ */
+static PyObject *_decode_fields(_YajlDecoder *self, char *buffer, size_t buflen,
+        PyObject *fields)
+{
+    _YajlField *compiled = NULL;
+    PyObject *spec = NULL;
+    PyObject *result = NULL;
+
+    if ( (fields == NULL) || (fields == Py_None) )
+        return _internal_decode(self, buffer, buflen);
+
+    if ( (PyUnicode_Check(fields)) || (PyString_Check(fields)) ) {
+        PyErr_SetString(PyExc_TypeError,
+                "`fields` must be a sequence of paths, not a single string");
+        return NULL;
+    }
+    if (!(spec = PySequence_Tuple(fields)))
+        return NULL;
+
+    if ( (self->fields_spec == NULL) ||
+            (PyObject_RichCompareBool(self->fields_spec, spec, Py_EQ) != 1) ) {
+        PyErr_Clear();
+        if (!(compiled = _compile_fields(spec))) {
+            Py_DECREF(spec);
+            return NULL;
+        }
+        _free_fields(self->fields_compiled);
+        Py_XDECREF(self->fields_spec);
+        self->fields_compiled = compiled;
+        self->fields_spec = spec;
+    } else {
+        Py_DECREF(spec);
+    }
+
+    self->fields = self->fields_compiled;
+    result = _internal_decode(self, buffer, buflen);
+    self->fields = NULL;
+    return result;
+}
+
+/*
+ * _decode_fields(), with `progress` (if neither NULL nor None) told how
+ * far along yajl is every PY_YAJL_SLICE bytes of a long document
+ */
+PyObject *_internal_decode_fields(_YajlDecoder *self, char *buffer, size_t buflen,
+        PyObject *fields, PyObject *progress)
+{
+    PyObject *result = NULL;
+
+    if (progress == Py_None)
+        progress = NULL;
+    if ( (progress) && (!PyCallable_Check(progress)) ) {
+        PyErr_SetString(PyExc_TypeError, "`progress` must be callable");
+        return NULL;
+    }
+
+    self->progress = progress;
+    result = _decode_fields(self, buffer, buflen, fields);
+    self->progress = NULL;
+    return result;
+}
+
+/*
+ * Finds the UTF-8 bytes to decode for a str or bytes object, returning a
+ * new reference to the object that owns them
+ */
+PyObject *_internal_input(PyObject *object, char **buffer, Py_ssize_t *buflen)
+{
+    PyObject *owner = NULL;
+
+    if (PyUnicode_Check(object)) {
+#ifdef IS_PEP393
+        /*
+         * An ASCII-only str already is its own UTF-8 encoding, so there's
+         * no need to encode a copy of it
+         */
+        if (PyUnicode_READY(object) < 0) {
+            return NULL;
+        }
+        if (PyUnicode_IS_COMPACT_ASCII(object)) {
+            Py_INCREF(object);
+            owner = object;
+        } else
+#endif
+        if (!(owner = PyUnicode_AsUTF8String(object))) {
+            return NULL;
+        }
+    } else if (PyString_Check(object)) {
+        Py_INCREF(object);
+        owner = object;
+    } else if (PyObject_CheckBuffer(object)) {
+        /*
+         * Anything else exporting its memory is parsed where it lies; the
+         * memoryview holds the export, so a bytearray can't be resized
+         * under us while the GIL is released
+         */
+        if (!(owner = PyMemoryView_FromObject(object))) {
+            return NULL;
+        }
+        if (!PyBuffer_IsContiguous(PyMemoryView_GET_BUFFER(owner), 'C')) {
+            Py_DECREF(owner);
+            PyErr_SetString(PyExc_ValueError, "contiguous buffer expected");
+            return NULL;
+        }
+    } else {
+        /* really seems like this should be a TypeError, but
+           tests/unit.py:ErrorCasesTests.test_None disagrees */
+        PyErr_SetString(PyExc_ValueError, "string or unicode expected");
+        return NULL;
+    }
+
+    _input_bytes(owner, buffer, buflen);
+    return owner;
+}
+
+PyObject *py_yajldecoder_decode(PYARGS)
+{
+    _YajlDecoder *decoder = (_YajlDecoder *)(self);
+    char *buffer = NULL;
+    PyObject *pybuffer = NULL;
+    PyObject *fields = NULL;
+    PyObject *progress = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t buflen = 0;
+    static char *kwlist[] = {"s", "fields", "progress", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO:decode", kwlist, &pybuffer,
+                &fields, &progress))
+        return NULL;
+
+    if (!(pybuffer = _internal_input(pybuffer, &buffer, &buflen)))
+        return NULL;
+
+    if (!buflen) {
+        Py_DECREF(pybuffer);
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("Cannot parse an empty buffer"));
+        return NULL;
+    }
+
+    /* the GIL is let go of while decoding long documents */
+    if (decoder->parsing) {
+        Py_DECREF(pybuffer);
+        PyErr_SetString(PyExc_RuntimeError,
+                "Decoder is already decoding a document in another thread");
+        return NULL;
+    }
+
+    result = _internal_decode_fields(decoder, buffer, (size_t)(buflen), fields, progress);
+    Py_DECREF(pybuffer);
+    return result;
+}
+
+/*
+ * Returns the counters of the allocator behind this decoder's parsers
+ */
+PyObject *py_yajldecoder_arena_stats(PYARGS)
+{
+    _YajlDecoder *decoder = (_YajlDecoder *)(self);
+
+    return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+            "reserved", (Py_ssize_t)(decoder->arena.reserved),
+            "in_use", (Py_ssize_t)(decoder->arena.in_use),
+            "high_water", (Py_ssize_t)(decoder->arena.high_water),
+            "documents", (Py_ssize_t)(decoder->arena.resets));
+}
+
+int yajldecoder_init(PYARGS)
+{
+    _YajlDecoder *me = (_YajlDecoder *)(self);
+    PyObject *tuples = NULL;
+    static char *kwlist[] = {"tuples", NULL};
+    int truth;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &tuples))
+        return -1;
+    if (tuples) {
+        truth = PyObject_IsTrue(tuples);
+        if (truth < 0)
+            return -1;
+        me->tuples = truth;
+    }
+
+    py_yajl_ps_init(me->elements);
+    py_yajl_ps_init(me->values);
+    me->root = NULL;
+    me->parsing = 0;
+    me->progress = NULL;
+    py_yajl_tape_init(&me->tape);
+
+    return 0;
+}
+
+void yajldecoder_dealloc(_YajlDecoder *self)
+{
+    unsigned int i;
+
+    _reset_decoder(self);
+    if (self->keycache) {
+        for (i = 0; i < PY_YAJL_KEY_CACHE_SZ; i++) {
+            Py_XDECREF(self->keycache[i].key);
+        }
+        free(self->keycache);
+        self->keycache = NULL;
+    }
+    py_yajl_ps_free(self->elements);
+    py_yajl_ps_init(self->elements);
+    py_yajl_ps_free(self->values);
+    py_yajl_ps_init(self->values);
+    py_yajl_arena_release(&self->arena);
+    py_yajl_tape_release(&self->tape);
+    _free_fields(self->fields_compiled);
+    self->fields_compiled = NULL;
+    Py_CLEAR(self->fields_spec);
 #ifdef IS_PYTHON3
     Py_TYPE(self)->tp_free((PyObject*)self);
 #else
@@ -37,250 +37,987 @@
 #include <yajl_buf.h>
 
 #include "py_yajl.h"
+#include "strscan.h"
+#include "numformat.h"
 
 static const char *hexdigit = "0123456789abcdef";
 
 /* Located in yajl_hacks.c */
-extern yajl_gen_status yajl_gen_raw_string(yajl_gen g,
-        const unsigned char * str, unsigned int len);
+typedef struct py_yajl_gen_t * py_yajl_gen;
 
-static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
+extern py_yajl_gen py_yajl_gen_alloc(yajl_print_t print, const yajl_gen_config * config,
+        unsigned int max_depth, void * ctx);
+extern void py_yajl_gen_free(py_yajl_gen g);
+extern void py_yajl_gen_reset(py_yajl_gen g, const yajl_gen_config * config,
+        unsigned int max_depth, void * ctx);
+extern unsigned int py_yajl_gen_depth(py_yajl_gen g);
+extern unsigned int py_yajl_gen_pretty(py_yajl_gen g);
+extern void * py_yajl_gen_context(py_yajl_gen g);
+
+extern yajl_gen_status py_yajl_gen_null(py_yajl_gen g);
+extern yajl_gen_status py_yajl_gen_bool(py_yajl_gen g, int boolean);
+extern yajl_gen_status py_yajl_gen_number(py_yajl_gen g, const char * str, unsigned int len);
+extern yajl_gen_status py_yajl_gen_map_open(py_yajl_gen g);
+extern yajl_gen_status py_yajl_gen_map_close(py_yajl_gen g);
+extern yajl_gen_status py_yajl_gen_array_open(py_yajl_gen g);
+extern yajl_gen_status py_yajl_gen_array_close(py_yajl_gen g);
+extern yajl_gen_status py_yajl_gen_raw_string(py_yajl_gen g,
+        const unsigned char * str, size_t len);
+extern yajl_gen_status py_yajl_gen_string(py_yajl_gen g,
+        const unsigned char * str, size_t len);
+extern yajl_gen_status py_yajl_gen_string_open(py_yajl_gen g);
+extern yajl_gen_status py_yajl_gen_string_close(py_yajl_gen g);
+extern yajl_gen_status py_yajl_gen_number_open(py_yajl_gen g);
+extern yajl_gen_status py_yajl_gen_number_close(py_yajl_gen g);
+
+static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object);
+static char *_reserve(struct StringAndUsedCount *sauc, size_t length);
+
+/*
+ * Writes the escaped form of a single character which isn't plain (see
+ * PY_YAJL_PLAIN) to `dest`, returning the number of bytes written, at
+ * most 12 for a surrogate pair
+ */
+static size_t _escape_char(char *dest, Py_UCS4 ch, unsigned int utf8)
 {
-    yajl_gen handle = (yajl_gen)(self->_generator);
-    yajl_gen_status status = yajl_gen_in_error_state;
-    PyObject *iterator, *item;
+    switch (ch) {
+        case '\t': dest[0] = '\\'; dest[1] = 't'; return 2;
+        case '\n': dest[0] = '\\'; dest[1] = 'n'; return 2;
+        case '\r': dest[0] = '\\'; dest[1] = 'r'; return 2;
+        case '\f': dest[0] = '\\'; dest[1] = 'f'; return 2;
+        case '\b': dest[0] = '\\'; dest[1] = 'b'; return 2;
+        case '\\': dest[0] = '\\'; dest[1] = '\\'; return 2;
+        case '\"': dest[0] = '\\'; dest[1] = '\"'; return 2;
+        default:
+            break;
+    }
 
-    if (object == Py_None) {
-        return yajl_gen_null(handle);
+    /* Lone surrogates can't be written out as UTF-8, so they're always escaped */
+    if ( (utf8) && (ch >= 0x80) && ((ch < 0xD800) || (ch > 0xDFFF)) ) {
+        if (ch < 0x800) {
+            dest[0] = (char)(0xC0 | (ch >> 6));
+            dest[1] = (char)(0x80 | (ch & 0x3F));
+            return 2;
+        }
+        if (ch < 0x10000) {
+            dest[0] = (char)(0xE0 | (ch >> 12));
+            dest[1] = (char)(0x80 | ((ch >> 6) & 0x3F));
+            dest[2] = (char)(0x80 | (ch & 0x3F));
+            return 3;
+        }
+        dest[0] = (char)(0xF0 | (ch >> 18));
+        dest[1] = (char)(0x80 | ((ch >> 12) & 0x3F));
+        dest[2] = (char)(0x80 | ((ch >> 6) & 0x3F));
+        dest[3] = (char)(0x80 | (ch & 0x3F));
+        return 4;
     }
-    if (object == Py_True) {
-        return yajl_gen_bool(handle, 1);
+
+    /* Characters outside the BMP become a '\uxxxx\uxxxx' surrogate pair */
+    if (ch >= 0x10000) {
+        ch -= 0x10000;
+        return _escape_char(dest, 0xD800 | (ch >> 10), utf8) +
+                _escape_char(dest + 6, 0xDC00 | (ch & 0x3FF), utf8);
     }
-    if (object == Py_False) {
-        return yajl_gen_bool(handle, 0);
+
+    /* Everything else, control characters included, maps to '\uxxxx' */
+    dest[0] = '\\';
+    dest[1] = 'u';
+    dest[2] = hexdigit[(ch >> 12) & 0x000F];
+    dest[3] = hexdigit[(ch >> 8) & 0x000F];
+    dest[4] = hexdigit[(ch >> 4) & 0x000F];
+    dest[5] = hexdigit[ch & 0x000F];
+    return 6;
+}
+
+/*
+ * Escape `length` code points of a given width into `dest`, copying runs
+ * of plain characters across in one go
+ */
+static size_t _escape_ucs1(char *dest, const unsigned char *src, size_t length, unsigned int utf8)
+{
+    char *start = dest;
+    size_t i = 0, run;
+
+    while (i < length) {
+        run = py_yajl_plain_prefix_ucs1(src + i, length - i);
+        memcpy(dest, src + i, run);
+        dest += run;
+        i += run;
+        if (i < length) {
+            dest += _escape_char(dest, src[i++], utf8);
+        }
     }
-    if (PyUnicode_Check(object)) {
-        Py_ssize_t length = PyUnicode_GET_SIZE(object);
-        Py_UNICODE *raw_unicode = PyUnicode_AS_UNICODE(object);
+    return (size_t)(dest - start);
+}
+
+static size_t _escape_ucs2(char *dest, const unsigned short *src, size_t length, unsigned int utf8)
+{
+    char *start = dest;
+    size_t i = 0, j, run;
+
+    while (i < length) {
+        run = py_yajl_plain_prefix_ucs2(src + i, length - i);
+        for (j = 0; j < run; j++) {
+            dest[j] = (char)(src[i + j]);
+        }
+        dest += run;
+        i += run;
+        if (i < length) {
+            dest += _escape_char(dest, src[i++], utf8);
+        }
+    }
+    return (size_t)(dest - start);
+}
+
+static size_t _escape_ucs4(char *dest, const unsigned int *src, size_t length, unsigned int utf8)
+{
+    char *start = dest;
+    size_t i = 0, j, run;
+
+    while (i < length) {
+        run = py_yajl_plain_prefix_ucs4(src + i, length - i);
+        for (j = 0; j < run; j++) {
+            dest[j] = (char)(src[i + j]);
+        }
+        dest += run;
+        i += run;
+        if (i < length) {
+            dest += _escape_char(dest, src[i++], utf8);
+        }
+    }
+    return (size_t)(dest - start);
+}
+
+/*
+ * Integers are formatted straight into the output buffer, `negative`
+ * selects whether `magnitude` is really a long long
+ */
+static yajl_gen_status _write_integer(_YajlEncoder *self, unsigned long long magnitude,
+        int negative)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    struct StringAndUsedCount *sauc = NULL;
+    yajl_gen_status status;
+    char *dest = NULL;
+
+    status = py_yajl_gen_number_open(handle);
+    if (status != yajl_gen_status_ok) {
+        return status;
+    }
+    sauc = (struct StringAndUsedCount *)(py_yajl_gen_context(handle));
+    dest = _reserve(sauc, PY_YAJL_INT_BUF_SZ);
+    if (dest == NULL) {
+        return yajl_gen_in_error_state;
+    }
+    if (negative) {
+        sauc->used += py_yajl_format_i64(dest, (long long)(magnitude));
+    } else {
+        sauc->used += py_yajl_format_u64(dest, magnitude);
+    }
+    return py_yajl_gen_number_close(handle);
+}
+
+/*
+ * Anything from -2**63 up to 2**64-1 is formatted directly, bigger ints
+ * go through int.__str__() (not str(), which subclasses may override)
+ */
+static yajl_gen_status ProcessLong(_YajlEncoder *self, PyObject *object)
+{
+    yajl_gen_status status;
+    PyObject *digits = NULL;
+    unsigned long long magnitude;
+    long long number;
+    int overflow = 0;
+    char *buffer = NULL;
+    Py_ssize_t length;
+
+    number = PyLong_AsLongLongAndOverflow(object, &overflow);
+    if ( (number == -1) && (PyErr_Occurred()) ) {
+        return yajl_gen_in_error_state;
+    }
+    if (!overflow) {
+        return _write_integer(self, (unsigned long long)(number), number < 0);
+    }
+    if (overflow > 0) {
+        magnitude = PyLong_AsUnsignedLongLong(object);
+        if (!PyErr_Occurred()) {
+            return _write_integer(self, magnitude, 0);
+        }
+        if (!PyErr_ExceptionMatches(PyExc_OverflowError)) {
+            return yajl_gen_in_error_state;
+        }
+        PyErr_Clear();
+    }
+
+    digits = PyLong_Type.tp_str(object);
+    if (digits == NULL) {
+        return yajl_gen_in_error_state;
+    }
+#ifdef IS_PEP393
+    buffer = (char *)(PyUnicode_AsUTF8AndSize(digits, &length));
+#else
+    if (PyUnicode_Check(digits)) {
+        PyObject *encoded = PyUnicode_AsUTF8String(digits);
+        Py_DECREF(digits);
+        digits = encoded;
+    }
+    if ( (digits != NULL) && (PyString_AsStringAndSize(digits, &buffer, &length) < 0) ) {
+        buffer = NULL;
+    }
+#endif
+    if (buffer == NULL) {
+        Py_XDECREF(digits);
+        return yajl_gen_in_error_state;
+    }
+    status = py_yajl_gen_number((py_yajl_gen)(self->_generator), buffer, (unsigned int)(length));
+    Py_DECREF(digits);
+    return status;
+}
+
+/*
+ * Floats are written with the fewest digits which read back as the same
+ * double, unless a fixed number of significant digits has been asked for
+ */
+static yajl_gen_status _write_double(_YajlEncoder *self, double value)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    struct StringAndUsedCount *sauc = NULL;
+    yajl_gen_status status;
+    char *dest = NULL;
+
+    if (!Py_IS_FINITE(value)) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("Out of range float values are not JSON compliant"));
+        return yajl_gen_in_error_state;
+    }
+
+    if (self->float_precision) {
+#if PY_VERSION_HEX >= 0x02070000
+        char *buffer = PyOS_double_to_string(value, 'g', self->float_precision,
+                Py_DTSF_ADD_DOT_0, NULL);
+        if (buffer == NULL) {
+            return yajl_gen_in_error_state;
+        }
+        status = py_yajl_gen_number(handle, buffer, (unsigned int)(strlen(buffer)));
+        PyMem_Free(buffer);
+#else
+        char buffer[PY_YAJL_DOUBLE_BUF_SZ];
+        PyOS_snprintf(buffer, sizeof(buffer), "%.*g", self->float_precision, value);
+        status = py_yajl_gen_number(handle, buffer, (unsigned int)(strlen(buffer)));
+#endif
+        return status;
+    }
+
+    status = py_yajl_gen_number_open(handle);
+    if (status != yajl_gen_status_ok) {
+        return status;
+    }
+    sauc = (struct StringAndUsedCount *)(py_yajl_gen_context(handle));
+    dest = _reserve(sauc, PY_YAJL_DOUBLE_BUF_SZ);
+    if (dest == NULL) {
+        return yajl_gen_in_error_state;
+    }
+    sauc->used += py_yajl_format_double(dest, value);
+    return py_yajl_gen_number_close(handle);
+}
+
+static yajl_gen_status ProcessFloat(_YajlEncoder *self, PyObject *object)
+{
+    return _write_double(self, PyFloat_AS_DOUBLE(object));
+}
+
+/* code points escaped per trip through _reserve() */
+#define PY_YAJL_ESCAPE_BLOCK 4096
+
+/*
+ * Unicode strings are escaped straight into the output buffer, a block
+ * at a time with enough room reserved for the worst case of every code
+ * point in the block needing a '\uxxxx' escape (or a pair of them)
+ */
+static yajl_gen_status ProcessUnicode(_YajlEncoder *self, PyObject *object)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    struct StringAndUsedCount *sauc = NULL;
+    yajl_gen_status status;
+    const char *data = NULL;
+    Py_ssize_t length, offset, block;
+    int kind;
+    size_t worst;
+    char *dest = NULL;
+
+#ifdef IS_PEP393
+    if (PyUnicode_READY(object) < 0) {
+        return yajl_gen_in_error_state;
+    }
+    data = (const char *)(PyUnicode_DATA(object));
+    length = PyUnicode_GET_LENGTH(object);
+    kind = PyUnicode_KIND(object);
+#else
+    data = (const char *)(PyUnicode_AS_UNICODE(object));
+    length = PyUnicode_GET_SIZE(object);
+    kind = (int)(sizeof(Py_UNICODE));
+#endif
+    worst = (kind == 4) ? 12 : 6;
+
+    status = py_yajl_gen_string_open(handle);
+    if (status != yajl_gen_status_ok) {
+        return status;
+    }
+    sauc = (struct StringAndUsedCount *)(py_yajl_gen_context(handle));
+#ifdef IS_PEP393
+    if ( (self->utf8) && (!PyUnicode_IS_ASCII(object)) ) {
+#else
+    if (self->utf8) {
+#endif
+        sauc->nonascii = 1;
+    }
+
+    for (offset = 0; offset < length; offset += block) {
+        block = length - offset;
+        if (block > PY_YAJL_ESCAPE_BLOCK) {
+            block = PY_YAJL_ESCAPE_BLOCK;
+        }
+        dest = _reserve(sauc, (size_t)(block) * worst);
+        if (dest == NULL) {
+            return yajl_gen_in_error_state;
+        }
+        switch (kind) {
+            case 1:
+                sauc->used += _escape_ucs1(dest,
+                        (const unsigned char *)(data) + offset, block, self->utf8);
+                break;
+            case 2:
+                sauc->used += _escape_ucs2(dest,
+                        (const unsigned short *)(data) + offset, block, self->utf8);
+                break;
+            default:
+                sauc->used += _escape_ucs4(dest,
+                        (const unsigned int *)(data) + offset, block, self->utf8);
+                break;
+        }
+    }
+    return py_yajl_gen_string_close(handle);
+}
+
+/*
+ * JSON object keys have to be strings, numeric keys are converted
+ * with str()
+ */
+static yajl_gen_status ProcessKey(_YajlEncoder *self, PyObject *key)
+{
+    yajl_gen_status status;
+    PyObject *newKey = NULL;
+
+    if ( (PyFloat_Check(key)) ||
+#ifndef IS_PYTHON3
+        (PyInt_Check(key)) ||
+#endif
+        (PyLong_Check(key)) ) {
+
         /*
-         * Create a buffer with enough space for code-points, preceeding and
-         * following quotes and a null termination character
+         * Performing the conversion separately for Python 2
+         * and Python 3 to ensure we consistently generate
+         * unicode strings in both versions
          */
-        char *buffer = (char *)(malloc(sizeof(char) * (1 + length * 6)));
-        unsigned int offset = 0;
-
-        while (length-- > 0) {
-            Py_UNICODE ch = *raw_unicode++;
-
-            /* Escape escape characters */
-            switch (ch) {
-                case '\t':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 't';
-                    continue;
-                    break;
-                case '\n':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 'n';
-                    continue;
-                    break;
-                case '\r':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 'r';
-                    continue;
-                    break;
-                case '\f':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 'f';
-                    continue;
-                    break;
-                case '\b':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = 'b';
-                    continue;
-                    break;
-                case '\\':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = '\\';
-                    continue;
-                    break;
-                case '\"':
-                    buffer[offset++] = '\\';
-                    buffer[offset++] = '\"';
-                    continue;
-                    break;
-                default:
-                    break;
-            }
+#ifdef IS_PYTHON3
+        newKey = PyObject_Str(key);
+#else
+        newKey = PyObject_Unicode(key);
+#endif
+        if (newKey == NULL) {
+            return yajl_gen_in_error_state;
+        }
+        status = ProcessObject(self, newKey);
+        Py_DECREF(newKey);
+        return status;
+    }
+    return ProcessObject(self, key);
+}
 
-            /* Map 16-bit characters to '\uxxxx' */
-            if (ch >= 256) {
-                buffer[offset++] = '\\';
-                buffer[offset++] = 'u';
-                buffer[offset++] = hexdigit[(ch >> 12) & 0x000F];
-                buffer[offset++] = hexdigit[(ch >> 8) & 0x000F];
-                buffer[offset++] = hexdigit[(ch >> 4) & 0x000F];
-                buffer[offset++] = hexdigit[ch & 0x000F];
-                continue;
-            }
+/*
+ * Raises the error for a dict or list the generator wouldn't open, which
+ * is down to either `max_depth` or the generator's stack not growing
+ */
+static void _open_error(_YajlEncoder *self, py_yajl_gen handle)
+{
+    if (PyErr_Occurred())
+        return;
+    if ( (self->max_depth) && (py_yajl_gen_depth(handle) >= self->max_depth) ) {
+        PyErr_Format(PyExc_ValueError, "Maximum nesting depth of %u exceeded",
+                self->max_depth);
+    } else {
+        PyErr_NoMemory();
+    }
+}
+
+#define PY_YAJL_ENCODE_FAILED(status) \
+    (((status) == yajl_gen_in_error_state) || ((status) == yajl_max_depth_exceeded))
+
+static yajl_gen_status _process_array(_YajlEncoder *self, PyObject *object)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    yajl_gen_status status;
+    PyObject *iterator = NULL, *item;
+    Py_ssize_t i;
+
+    /* lists and tuples are indexed, anything else is iterated over */
+    if ( (!PyList_CheckExact(object)) && (!PyTuple_CheckExact(object)) ) {
+        iterator = PyObject_GetIter(object);
+        if (iterator == NULL)
+            return yajl_gen_in_error_state;
+    }
+    status = py_yajl_gen_array_open(handle);
+    if (status == yajl_max_depth_exceeded) {
+        _open_error(self, handle);
+        Py_XDECREF(iterator);
+        return yajl_gen_in_error_state;
+    }
+    if (Py_EnterRecursiveCall(" while encoding a JSON array")) {
+        Py_XDECREF(iterator);
+        return yajl_gen_in_error_state;
+    }
+
+    if (iterator) {
+        while ((item = PyIter_Next(iterator))) {
+            status = ProcessObject(self, item);
+            Py_DECREF(item);
+            if (PY_YAJL_ENCODE_FAILED(status))
+                break;
+        }
+        Py_DECREF(iterator);
+    } else {
+        /* a list's size is checked every time, default() may change it */
+        for (i = 0; i < PySequence_Fast_GET_SIZE(object); i++) {
+            item = PySequence_Fast_GET_ITEM(object, i);
+            Py_INCREF(item);
+            status = ProcessObject(self, item);
+            Py_DECREF(item);
+            if (PY_YAJL_ENCODE_FAILED(status))
+                break;
+        }
+    }
+    Py_LeaveRecursiveCall();
+
+    if ( (PY_YAJL_ENCODE_FAILED(status)) || (PyErr_Occurred()) )
+        return yajl_gen_in_error_state;
+    return py_yajl_gen_array_close(handle);
+}
+
+static yajl_gen_status _process_map(_YajlEncoder *self, PyObject *object)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    yajl_gen_status status;
+    PyObject *key, *value;
+    Py_ssize_t position = 0;
+
+    status = py_yajl_gen_map_open(handle);
+    if (status == yajl_max_depth_exceeded) {
+        _open_error(self, handle);
+        return yajl_gen_in_error_state;
+    }
+    if (Py_EnterRecursiveCall(" while encoding a JSON object"))
+        return yajl_gen_in_error_state;
+    while (PyDict_Next(object, &position, &key, &value)) {
+        status = ProcessKey(self, key);
+        if (PY_YAJL_ENCODE_FAILED(status))
+            break;
+
+        status = ProcessObject(self, value);
+        if (PY_YAJL_ENCODE_FAILED(status))
+            break;
+    }
+    Py_LeaveRecursiveCall();
+
+    if (PY_YAJL_ENCODE_FAILED(status))
+        return yajl_gen_in_error_state;
+    return py_yajl_gen_map_close(handle);
+}
+
+/* buffer elements formatted per trip through _reserve() */
+#define PY_YAJL_FORMAT_BLOCK 1024
+
+/*
+ * The struct module code of a buffer's elements if they're numbers (or
+ * bools) this can format, otherwise 0. Only native sizes are understood.
+ */
+static char _buffer_code(Py_buffer *view)
+{
+    const char *format = view->format ? view->format : "B";
+    size_t size;
+
+    if (*format == '@')
+        format++;
+    if ( (format[0] == '\0') || (format[1] != '\0') )
+        return 0;
+
+    switch (format[0]) {
+        case '?': size = sizeof(unsigned char); break;
+        case 'b': case 'B': size = sizeof(char); break;
+        case 'h': case 'H': size = sizeof(short); break;
+        case 'i': case 'I': size = sizeof(int); break;
+        case 'l': case 'L': size = sizeof(long); break;
+        case 'q': case 'Q': size = sizeof(long long); break;
+        case 'n': case 'N': size = sizeof(size_t); break;
+        case 'f': size = sizeof(float); break;
+        case 'd': size = sizeof(double); break;
+        default:
+            return 0;
+    }
+    if ((size_t)(view->itemsize) != size)
+        return 0;
+    return format[0];
+}
+
+#define PY_YAJL_FORMAT_LOOP(type, write) \
+    for (i = 0; i < count; i++, item += stride) {   \
+        type value;                                 \
+        memcpy(&value, item, sizeof(type));         \
+        if ( (separate) || (i) )                    \
+            *dest++ = ',';                          \
+        write;                                      \
+    }                                               \
+    break
 
-            /* Map non-printable US ASCII to '\u00hh' */
-            if ( (ch < 0x20) || (ch >= 0x7F) ) {
-                buffer[offset++] = '\\';
-                buffer[offset++] = 'u';
-                buffer[offset++] = '0';
-                buffer[offset++] = '0';
-                buffer[offset++] = hexdigit[(ch >> 4) & 0x0F];
-                buffer[offset++] = hexdigit[ch & 0x0F];
-                continue;
+/*
+ * Formats `count` elements, `stride` bytes apart, straight into `dest`
+ * with a comma before each (but the first, unless `separate`), returning
+ * the number of bytes written or (size_t)-1 for a NaN or infinity. Each
+ * element takes at most PY_YAJL_DOUBLE_BUF_SZ + 1 bytes.
+ */
+static size_t _format_elements(char *dest, const char *item, Py_ssize_t stride,
+        Py_ssize_t count, char code, int separate)
+{
+    char *start = dest;
+    Py_ssize_t i;
+
+    switch (code) {
+        case '?':
+            PY_YAJL_FORMAT_LOOP(unsigned char,
+                    memcpy(dest, value ? "true" : "false", value ? 4 : 5);
+                    dest += value ? 4 : 5);
+        case 'b':
+            PY_YAJL_FORMAT_LOOP(signed char, dest += py_yajl_format_i64(dest, value));
+        case 'B':
+            PY_YAJL_FORMAT_LOOP(unsigned char, dest += py_yajl_format_u64(dest, value));
+        case 'h':
+            PY_YAJL_FORMAT_LOOP(short, dest += py_yajl_format_i64(dest, value));
+        case 'H':
+            PY_YAJL_FORMAT_LOOP(unsigned short, dest += py_yajl_format_u64(dest, value));
+        case 'i':
+            PY_YAJL_FORMAT_LOOP(int, dest += py_yajl_format_i64(dest, value));
+        case 'I':
+            PY_YAJL_FORMAT_LOOP(unsigned int, dest += py_yajl_format_u64(dest, value));
+        case 'l':
+            PY_YAJL_FORMAT_LOOP(long, dest += py_yajl_format_i64(dest, value));
+        case 'L':
+            PY_YAJL_FORMAT_LOOP(unsigned long, dest += py_yajl_format_u64(dest, value));
+        case 'q':
+            PY_YAJL_FORMAT_LOOP(long long, dest += py_yajl_format_i64(dest, value));
+        case 'Q':
+            PY_YAJL_FORMAT_LOOP(unsigned long long, dest += py_yajl_format_u64(dest, value));
+        case 'n':
+            PY_YAJL_FORMAT_LOOP(Py_ssize_t, dest += py_yajl_format_i64(dest, value));
+        case 'N':
+            PY_YAJL_FORMAT_LOOP(size_t, dest += py_yajl_format_u64(dest, value));
+        case 'f':
+            PY_YAJL_FORMAT_LOOP(float,
+                    if (!Py_IS_FINITE(value)) return (size_t)(-1);
+                    dest += py_yajl_format_double(dest, (double)(value)));
+        case 'd':
+            PY_YAJL_FORMAT_LOOP(double,
+                    if (!Py_IS_FINITE(value)) return (size_t)(-1);
+                    dest += py_yajl_format_double(dest, value));
+        default:
+            break;
+    }
+    return (size_t)(dest - start);
+}
+
+#undef PY_YAJL_FORMAT_LOOP
+
+/*
+ * One run of elements along a buffer's last dimension. Compact output has
+ * the whole run written as if it were a single atom, beautified output
+ * or a fixed float precision needs an atom at a time.
+ */
+static yajl_gen_status _process_buffer_run(_YajlEncoder *self, const char *item,
+        Py_ssize_t stride, Py_ssize_t count, char code)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    struct StringAndUsedCount *sauc = NULL;
+    yajl_gen_status status = yajl_gen_status_ok;
+    Py_ssize_t offset, block, most;
+    size_t written;
+    char *dest = NULL;
+
+    if ( (self->float_precision) && ((code == 'f') || (code == 'd')) ) {
+        for (offset = 0; offset < count; offset++, item += stride) {
+            double value;
+            if (code == 'f') {
+                float single;
+                memcpy(&single, item, sizeof(float));
+                value = (double)(single);
+            } else {
+                memcpy(&value, item, sizeof(double));
             }
+            status = _write_double(self, value);
+            if (PY_YAJL_ENCODE_FAILED(status))
+                return status;
+        }
+        return status;
+    }
+
+    most = py_yajl_gen_pretty(handle) ? 1 : PY_YAJL_FORMAT_BLOCK;
+    for (offset = 0; offset < count; offset += block) {
+        block = count - offset;
+        if (block > most) {
+            block = most;
+        }
+        if ( (most == 1) || (offset == 0) ) {
+            status = py_yajl_gen_number_open(handle);
+            if (status != yajl_gen_status_ok)
+                return status;
+        }
+        sauc = (struct StringAndUsedCount *)(py_yajl_gen_context(handle));
+        dest = _reserve(sauc, (size_t)(block) * (PY_YAJL_DOUBLE_BUF_SZ + 1));
+        if (dest == NULL)
+            return yajl_gen_in_error_state;
+        written = _format_elements(dest, item + offset * stride, stride, block, code,
+                (most != 1) && (offset != 0));
+        if (written == (size_t)(-1)) {
+            PyErr_SetObject(PyExc_ValueError,
+                    PyUnicode_FromString("Out of range float values are not JSON compliant"));
+            return yajl_gen_in_error_state;
+        }
+        sauc->used += written;
+        if ( (most == 1) || (offset + block == count) ) {
+            status = py_yajl_gen_number_close(handle);
+        }
+    }
+    return status;
+}
+
+/*
+ * Each dimension of a buffer becomes a JSON array, so a 2x3 buffer of
+ * doubles is written as [[1.0,2.0,3.0],[4.0,5.0,6.0]]
+ */
+static yajl_gen_status _process_buffer_dim(_YajlEncoder *self, Py_buffer *view,
+        const char *item, int dim, char code)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    yajl_gen_status status;
+    Py_ssize_t i;
 
-            /* Handle proper ascii chars */
-            if ( (ch >= 0x20) && (ch < 0x7F) ) {
-                buffer[offset++] = (char)(ch);
-                continue;
+    status = py_yajl_gen_array_open(handle);
+    if (status == yajl_max_depth_exceeded) {
+        _open_error(self, handle);
+        return yajl_gen_in_error_state;
+    }
+    if (status != yajl_gen_status_ok)
+        return status;
+
+    if (dim == view->ndim - 1) {
+        status = _process_buffer_run(self, item, view->strides[dim], view->shape[dim], code);
+    } else {
+        for (i = 0; i < view->shape[dim]; i++) {
+            status = _process_buffer_dim(self, view, item + i * view->strides[dim],
+                    dim + 1, code);
+            if (PY_YAJL_ENCODE_FAILED(status))
+                break;
+        }
+    }
+
+    if (PY_YAJL_ENCODE_FAILED(status))
+        return yajl_gen_in_error_state;
+    return py_yajl_gen_array_close(handle);
+}
+
+/*
+ * Buffers of numbers (array.array, memoryview and the like) are formatted
+ * from their memory without a Python object per element. Anything else
+ * sets *handled to 0 and is left for default().
+ */
+static yajl_gen_status _process_buffer(_YajlEncoder *self, PyObject *object, int *handled)
+{
+    yajl_gen_status status;
+    Py_buffer view;
+    char code;
+
+    *handled = 0;
+    if (PyObject_GetBuffer(object, &view, PyBUF_STRIDES | PyBUF_FORMAT) < 0) {
+        PyErr_Clear();
+        return yajl_gen_status_ok;
+    }
+    code = _buffer_code(&view);
+    if (code == 0) {
+        PyBuffer_Release(&view);
+        return yajl_gen_status_ok;
+    }
+
+    *handled = 1;
+    if (view.ndim == 0) {
+        status = _process_buffer_run(self, (const char *)(view.buf), 0, 1, code);
+    } else {
+        status = _process_buffer_dim(self, &view, (const char *)(view.buf), 0, code);
+    }
+    PyBuffer_Release(&view);
+    return status;
+}
+
+/* most types whose handler (or lack of one) an encoder remembers */
+#define PY_YAJL_HANDLER_CACHE_SZ 256
+
+/*
+ * The function register()ed for `type` or the nearest of its bases, as a
+ * borrowed reference, or None if there isn't one. What's found for each
+ * type is cached until the next register() call.
+ */
+static PyObject *_lookup_handler(_YajlEncoder *self, PyTypeObject *type)
+{
+    PyObject *handler = PyDict_GetItem(self->handler_cache, (PyObject *)(type));
+    PyObject *mro = type->tp_mro;
+    Py_ssize_t i;
+
+    if (handler)
+        return handler;
+
+    /* the cache keeps the types alive, so starts over rather than growing forever */
+    if (PyDict_Size(self->handler_cache) >= PY_YAJL_HANDLER_CACHE_SZ)
+        PyDict_Clear(self->handler_cache);
+
+    handler = Py_None;
+    if (mro) {
+        for (i = 0; i < PyTuple_GET_SIZE(mro); i++) {
+            PyObject *found = PyDict_GetItem(self->handlers, PyTuple_GET_ITEM(mro, i));
+            if (found) {
+                handler = found;
+                break;
             }
         }
-        buffer[offset] = '\0';
-        return yajl_gen_raw_string(handle, (const unsigned char *)(buffer), (unsigned int)(offset));
     }
+    if (PyDict_SetItem(self->handler_cache, (PyObject *)(type), handler) < 0)
+        return NULL;
+    return handler;
+}
+
+/*
+ * Encodes whatever a handler or default() returned in place of an object
+ * it was handed, stealing the reference
+ */
+static yajl_gen_status _process_replacement(_YajlEncoder *self, PyObject *replacement)
+{
+    yajl_gen_status status;
+
+    if (replacement == NULL)
+        return yajl_gen_in_error_state;
+    if (Py_EnterRecursiveCall(" while encoding a JSON value")) {
+        Py_DECREF(replacement);
+        return yajl_gen_in_error_state;
+    }
+    status = ProcessObject(self, replacement);
+    Py_LeaveRecursiveCall();
+    Py_DECREF(replacement);
+    return status;
+}
+
+/*
+ * Bytes (str on Python 2) are passed through as they are, see
+ * _internal_encode()
+ */
+static yajl_gen_status _process_bytes(_YajlEncoder *self, PyObject *object)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    const unsigned char *buffer = NULL;
+    Py_ssize_t length;
+
 #ifdef IS_PYTHON3
-    if (PyBytes_Check(object)) {
+    PyBytes_AsStringAndSize(object, (char **)&buffer, &length);
 #else
-    if (PyString_Check(object)) {
+    PyString_AsStringAndSize(object, (char **)&buffer, &length);
 #endif
-        const unsigned char *buffer = NULL;
-        Py_ssize_t length;
+    if (py_yajl_ascii_prefix(buffer, (size_t)(length)) != (size_t)(length)) {
+        ((struct StringAndUsedCount *)(py_yajl_gen_context(handle)))->nonascii = 1;
+    }
+    return py_yajl_gen_string(handle, buffer, (size_t)(length));
+}
+
+static PyObject *__default = NULL;
+
+static yajl_gen_status ProcessObject(_YajlEncoder *self, PyObject *object)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    PyTypeObject *type = Py_TYPE(object);
+    PyObject *handler = NULL;
+
+    if (object == Py_None) {
+        return py_yajl_gen_null(handle);
+    }
+    if (object == Py_True) {
+        return py_yajl_gen_bool(handle, 1);
+    }
+    if (object == Py_False) {
+        return py_yajl_gen_bool(handle, 0);
+    }
+
+    /* The built-in types themselves, which are by far the most common */
+    if (type == &PyUnicode_Type) {
+        return ProcessUnicode(self, object);
+    }
+#ifndef IS_PYTHON3
+    if (type == &PyString_Type) {
+        return _process_bytes(self, object);
+    }
+    if (type == &PyInt_Type) {
+        long number = PyInt_AS_LONG(object);
+        return _write_integer(self, (unsigned long long)(number), number < 0);
+    }
+#endif
+    if (type == &PyLong_Type) {
+        return ProcessLong(self, object);
+    }
+    if (type == &PyFloat_Type) {
+        return ProcessFloat(self, object);
+    }
+    if (type == &PyDict_Type) {
+        return _process_map(self, object);
+    }
+    if ( (type == &PyList_Type) || (type == &PyTuple_Type) ) {
+        return _process_array(self, object);
+    }
+
+    /* Then anything register()ed for the type, ahead of its base classes */
+    if (self->handlers) {
+        handler = _lookup_handler(self, type);
+        if (handler == NULL)
+            return yajl_gen_in_error_state;
+        if (handler != Py_None) {
+            yajl_gen_status status;
+            /* the handler could register() something, emptying the cache */
+            Py_INCREF(handler);
+            status = _process_replacement(self,
+                    PyObject_CallFunctionObjArgs(handler, object, NULL));
+            Py_DECREF(handler);
+            return status;
+        }
+    }
+
+    /* loads_lazy() proxies stand in for dicts and lists, so are written as them */
+    if ( (type == &YajlLazyDictType) || (type == &YajlLazyListType) ) {
+        return _process_replacement(self, py_yajllazy_to_python(object, NULL, NULL));
+    }
+
+    if (PyUnicode_Check(object)) {
+        return ProcessUnicode(self, object);
+    }
 #ifdef IS_PYTHON3
-        PyBytes_AsStringAndSize(object, (char **)&buffer, &length);
+    if (PyBytes_Check(object)) {
 #else
-        PyString_AsStringAndSize(object, (char **)&buffer, &length);
+    if (PyString_Check(object)) {
 #endif
-        return yajl_gen_string(handle, buffer, (unsigned int)(length));
+        return _process_bytes(self, object);
     }
 #ifndef IS_PYTHON3
-    if (PyInt_Check(object)) {
-        long number = PyInt_AsLong(object);
-        if ( (number == -1) && (PyErr_Occurred()) ) {
-            return yajl_gen_in_error_state;
-        }
-        return yajl_gen_integer(handle, number);
+    if (PyInt_Check(object)) {
+        long number = PyInt_AS_LONG(object);
+        return _write_integer(self, (unsigned long long)(number), number < 0);
     }
 #endif
     if (PyLong_Check(object)) {
-        long long number = PyLong_AsLongLong(object);
-        char *buffer = NULL;
-
-        if ( (number == -1) && (PyErr_Occurred()) ) {
-            return yajl_gen_in_error_state;;
-        }
-
-        /*
-         * Nifty trick for getting the buffer length of a long long, going
-         * to convert this long long into a buffer to be handled by
-         * yajl_gen_number()
-         */
-        unsigned int length = (unsigned int)(snprintf(NULL, 0, "%lld", number)) + 1;
-        buffer = (char *)(malloc(length));
-        snprintf(buffer, length, "%lld", number);
-        return yajl_gen_number(handle, buffer, length - 1);
+        return ProcessLong(self, object);
     }
     if (PyFloat_Check(object)) {
-        return yajl_gen_double(handle, PyFloat_AsDouble(object));
+        return ProcessFloat(self, object);
     }
     if (PyList_Check(object)||PyGen_Check(object)||PyTuple_Check(object)) {
-        /*
-         * Recurse and handle the list
-         */
-        iterator = PyObject_GetIter(object);
-        if (iterator == NULL)
-            goto exit;
-        status = yajl_gen_array_open(handle);
-        if (status == yajl_max_depth_exceeded) {
-            Py_XDECREF(iterator);
-            goto exit;
-        }
-        while ((item = PyIter_Next(iterator))) {
-            status = ProcessObject(self, item);
-            Py_XDECREF(item);
-        }
-        Py_XDECREF(iterator);
-        yajl_gen_status close_status = yajl_gen_array_close(handle);
-        if (status == yajl_gen_in_error_state)
-            return status;
-        return close_status;
+        return _process_array(self, object);
     }
     if (PyDict_Check(object)) {
-        PyObject *key, *value;
-        Py_ssize_t position = 0;
-
-        status = yajl_gen_map_open(handle);
-        if (status == yajl_max_depth_exceeded) goto exit;
-        while (PyDict_Next(object, &position, &key, &value)) {
-            PyObject *newKey = key;
-
-            if ( (PyFloat_Check(key)) ||
-#ifndef IS_PYTHON3
-                (PyInt_Check(key)) ||
-#endif
-                (PyLong_Check(key)) ) {
+        return _process_map(self, object);
+    }
+    if ( (PyObject_CheckBuffer(object)) && (!PyByteArray_Check(object)) ) {
+        int handled;
+        yajl_gen_status status = _process_buffer(self, object, &handled);
+        if (handled)
+            return status;
+    }
 
-                /*
-                 * Performing the conversion separately for Python 2
-                 * and Python 3 to ensure we consistently generate
-                 * unicode strings in both versions
-                 */
+    if (__default == NULL) {
 #ifdef IS_PYTHON3
-                newKey = PyObject_Str(key);
+        __default = PyUnicode_InternFromString("default");
 #else
-                newKey = PyObject_Unicode(key);
+        __default = PyString_InternFromString("default");
 #endif
-            }
+        if (__default == NULL)
+            return yajl_gen_in_error_state;
+    }
+    return _process_replacement(self,
+            PyObject_CallMethodObjArgs((PyObject *)(self), __default, object, NULL));
+}
 
-            status = ProcessObject(self, newKey);
-            if (status == yajl_gen_in_error_state) return status;
-            if (status == yajl_max_depth_exceeded) goto exit;
+/*
+ * Hand everything buffered up in `sauc` to its stream's write() method,
+ * on failure sauc->str is released which turns the printer into a no-op
+ */
+static PyObject *_take_chunk(struct StringAndUsedCount *sauc)
+{
+    char *buffer = NULL;
+    PyObject *chunk = NULL;
+    Py_ssize_t consumed = 0;
 
-            status = ProcessObject(self, value);
-            if (status == yajl_gen_in_error_state) return status;
-            if (status == yajl_max_depth_exceeded) goto exit;
-        }
-        return yajl_gen_map_close(handle);
+    if (!sauc->str)
+        return NULL;
+
+#ifdef IS_PYTHON3
+    buffer = ((PyBytesObject *)sauc->str)->ob_sval;
+    /* Hold back a multibyte character split across chunks */
+    chunk = PyUnicode_DecodeUTF8Stateful(buffer, sauc->used, "strict", &consumed);
+#else
+    buffer = ((PyStringObject *)sauc->str)->ob_sval;
+    consumed = sauc->used;
+    chunk = PyString_FromStringAndSize(buffer, consumed);
+#endif
+    if (!chunk) {
+        Py_CLEAR(sauc->str);
+        return NULL;
     }
-    else {
-        object =  PyObject_CallMethod((PyObject *)self, "default", "O", object);
-        if (object==NULL)
-            goto exit;
-        status = ProcessObject(self, object);
-        return status;
+
+    sauc->used -= consumed;
+    if (sauc->used) {
+        memmove(buffer, buffer + consumed, sauc->used);
     }
+    return chunk;
+}
 
+static void _flush(struct StringAndUsedCount *sauc)
+{
+    PyObject *chunk = _take_chunk(sauc);
+    PyObject *result = NULL;
 
+    if (!chunk)
+        return;
 
-    exit:
-        return yajl_gen_in_error_state;
+    result = PyObject_CallMethod(sauc->stream, "write", "O", chunk);
+    Py_DECREF(chunk);
+    if (!result) {
+        Py_CLEAR(sauc->str);
+        return;
+    }
+    Py_DECREF(result);
 }
 
-yajl_alloc_funcs *y_allocs = NULL;
-/* a structure used to pass context to our printer function */
-struct StringAndUsedCount
-{
-    PyObject * str;
-    size_t used;
-};
-
-static void py_yajl_printer(void * ctx,
-                            const char * str,
-                            unsigned int len)
+/*
+ * Makes room for at least `length` more bytes in `sauc` and returns where
+ * they go, or NULL if the buffer couldn't be grown
+ */
+static char *_reserve(struct StringAndUsedCount *sauc, size_t length)
 {
-    struct StringAndUsedCount * sauc = (struct StringAndUsedCount *) ctx;
     size_t newsize;
 
-    if (!sauc || !sauc->str) return;
+    if (!sauc || !sauc->str) return NULL;
 
     /* resize our string if necc */
     newsize = Py_SIZE(sauc->str);
-    while (sauc->used + len > newsize) newsize *= 2;
+    while (sauc->used + length > newsize) newsize *= 2;
     if (newsize != Py_SIZE(sauc->str)) {
 #ifdef IS_PYTHON3
         _PyBytes_Resize(&(sauc->str), newsize);
@@ -288,28 +1025,43 @@ static void py_yajl_printer(void * ctx,
         _PyString_Resize(&(sauc->str), newsize);
 #endif
         if (!sauc->str)
-            return;
+            return NULL;
     }
 
-    /* and append data if available */
-    if (len && str) {
 #ifdef IS_PYTHON3
-        memcpy((void *)(((PyBytesObject *)sauc->str)->ob_sval + sauc->used), str, len);
+    return ((PyBytesObject *)sauc->str)->ob_sval + sauc->used;
 #else
-        memcpy((void *) (((PyStringObject *) sauc->str)->ob_sval + sauc->used), str, len);
+    return ((PyStringObject *)sauc->str)->ob_sval + sauc->used;
 #endif
+}
+
+static void py_yajl_printer(void * ctx,
+                            const char * str,
+                            unsigned int len)
+{
+    struct StringAndUsedCount * sauc = (struct StringAndUsedCount *) ctx;
+    char *dest = _reserve(sauc, len);
+
+    if (!dest) return;
+
+    /* and append data if available */
+    if (len && str) {
+        memcpy((void *)(dest), str, len);
         sauc->used += len;
     }
+
+    /* past the high-water mark, pass what we have along to the stream */
+    if ( (sauc->stream) && (sauc->used >= sauc->flush_at) ) {
+        _flush(sauc);
+    }
 }
 
 /* Efficiently allocate a python string of a fixed size containing uninitialized memory */
 static PyObject * lowLevelStringAlloc(Py_ssize_t size)
 {
 #ifdef IS_PYTHON3
-    PyBytesObject * op = (PyBytesObject *)PyObject_MALLOC(sizeof(PyBytesObject) + size);
-    if (op) {
-        PyObject_INIT_VAR(op, &PyBytes_Type, size);
-    }
+    /* the buffer may be handed back as is by encode_bytes(), so no shortcuts */
+    PyObject * op = PyBytes_FromStringAndSize(NULL, size);
 #else
     PyStringObject * op = (PyStringObject *)PyObject_MALLOC(sizeof(PyStringObject) + size);
     if (op) {
@@ -321,34 +1073,56 @@ static PyObject * lowLevelStringAlloc(Py_ssize_t size)
     return (PyObject *) op;
 }
 
-PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config genconfig)
+/*
+ * Runs `obj` through a fresh generator printing into `sauc`, which the
+ * caller has set up, returns non-zero with an exception set on failure
+ */
+static int _internal_encode_into(_YajlEncoder *self, PyObject *obj,
+        yajl_gen_config genconfig, struct StringAndUsedCount *sauc)
 {
-    yajl_gen generator = NULL;
+    py_yajl_gen generator = NULL;
+    /* default() may well call back into this same encoder */
+    void *previous = self->_generator;
     yajl_gen_status status;
-    struct StringAndUsedCount sauc;
-#ifdef IS_PYTHON3
-    PyObject *result = NULL;
-#endif
 
     /* initialize context for our printer function which
      * performs low level string appending, using the python
      * string implementation as a chunked growth buffer */
-    sauc.used = 0;
-    sauc.str = lowLevelStringAlloc(PY_YAJL_CHUNK_SZ);
+    sauc->used = 0;
+    sauc->nonascii = 0;
+    sauc->str = lowLevelStringAlloc(PY_YAJL_CHUNK_SZ);
 
-    generator = yajl_gen_alloc2(py_yajl_printer, &genconfig, NULL, (void *) &sauc);
+    if (self->_spare) {
+        generator = (py_yajl_gen)(self->_spare);
+        self->_spare = NULL;
+        py_yajl_gen_reset(generator, &genconfig, self->max_depth, (void *) sauc);
+    } else {
+        generator = py_yajl_gen_alloc(py_yajl_printer, &genconfig, self->max_depth,
+                (void *) sauc);
+    }
+    if (!generator) {
+        Py_CLEAR(sauc->str);
+        PyErr_NoMemory();
+        return failure;
+    }
 
     self->_generator = generator;
 
     status = ProcessObject(self, obj);
 
-    yajl_gen_free(generator);
-    self->_generator = NULL;
+    self->_generator = previous;
+    if (self->_spare) {
+        py_yajl_gen_free(generator);
+    } else {
+        self->_spare = generator;
+    }
 
     /* if resize failed inside our printer function we'll have a null sauc.str */
-    if (!sauc.str) {
-        PyErr_SetObject(PyExc_ValueError, PyUnicode_FromString("Allocation failure"));
-        return NULL;
+    if (!sauc->str) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetObject(PyExc_ValueError, PyUnicode_FromString("Allocation failure"));
+        }
+        return failure;
     }
 
     if ( (status == yajl_gen_in_error_state) ||
@@ -360,21 +1134,309 @@ PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config ge
         if (!PyErr_Occurred()) {
             PyErr_SetObject(PyExc_TypeError, PyUnicode_FromString("Object is not JSON serializable"));
         }
-        Py_XDECREF(sauc.str);
+        Py_CLEAR(sauc->str);
+        return failure;
+    }
+    return success;
+}
+
+/* Hands back the output buffer itself, shrunk to fit */
+static PyObject *_finish_bytes(struct StringAndUsedCount *sauc)
+{
+    /* truncate to used size, and resize will handle the null plugging */
+#ifdef IS_PYTHON3
+    _PyBytes_Resize(&sauc->str, sauc->used);
+#else
+    _PyString_Resize(&sauc->str, sauc->used);
+#endif
+    return sauc->str;
+}
+
+PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config genconfig)
+{
+    struct StringAndUsedCount sauc;
+#ifdef IS_PYTHON3
+    PyObject *result = NULL;
+#endif
+
+    sauc.stream = NULL;
+    if (_internal_encode_into(self, obj, genconfig, &sauc) == failure) {
         return NULL;
     }
 
 #ifdef IS_PYTHON3
+#ifdef IS_PEP393
+    /*
+     * Unless non-ASCII text was written out as is, the output is all
+     * ASCII and can be copied into a compact str without decoding it
+     */
+    if (!sauc.nonascii) {
+        result = PyUnicode_New(sauc.used, 127);
+        if (result) {
+            memcpy(PyUnicode_1BYTE_DATA(result), PyBytes_AS_STRING(sauc.str), sauc.used);
+        }
+        Py_DECREF(sauc.str);
+        return result;
+    }
+#endif
     result = PyUnicode_DecodeUTF8(((PyBytesObject *)sauc.str)->ob_sval, sauc.used, "strict");
     Py_XDECREF(sauc.str);
     return result;
 #else
-    /* truncate to used size, and resize will handle the null plugging */
-    _PyString_Resize(&sauc.str, sauc.used);
-    return sauc.str;
+    return _finish_bytes(&sauc);
 #endif
 }
 
+PyObject *_internal_encode_bytes(_YajlEncoder *self, PyObject *obj, yajl_gen_config genconfig)
+{
+    struct StringAndUsedCount sauc;
+
+    sauc.stream = NULL;
+    if (_internal_encode_into(self, obj, genconfig, &sauc) == failure) {
+        return NULL;
+    }
+    return _finish_bytes(&sauc);
+}
+
+PyObject *_internal_stream_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config genconfig,
+        PyObject *stream, size_t flush_at)
+{
+    struct StringAndUsedCount sauc;
+
+    sauc.stream = stream;
+    sauc.flush_at = flush_at;
+    if (_internal_encode_into(self, obj, genconfig, &sauc) == failure) {
+        return NULL;
+    }
+
+    /* whatever is left over after the last full chunk */
+    if (sauc.used) {
+        _flush(&sauc);
+    }
+    if (!sauc.str) {
+        return NULL;
+    }
+    Py_DECREF(sauc.str);
+    Py_RETURN_TRUE;
+}
+
+/*
+ * The iterator returned from Encoder.iterencode() can't hang on to a C
+ * stack between calls, so instead of recursing through ProcessObject()
+ * it keeps the containers it's in the middle of on `frames`
+ */
+static yajl_gen_status _iterencode_value(_YajlEncodeIterator *self, PyObject *object)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    yajl_gen_status status = yajl_gen_status_ok;
+    _YajlEncoder *encoder = (_YajlEncoder *)(self->encoder);
+    PyObject *container = NULL, *handler;
+
+    /* a register()ed subclass of list or dict is encoded by its handler */
+    if ( (encoder->handlers) && (!PyList_CheckExact(object)) &&
+            (!PyTuple_CheckExact(object)) && (!PyDict_CheckExact(object)) ) {
+        handler = _lookup_handler(encoder, Py_TYPE(object));
+        if (handler == NULL)
+            return yajl_gen_in_error_state;
+        if (handler != Py_None)
+            return ProcessObject(encoder, object);
+    }
+
+    if (PyList_Check(object)||PyGen_Check(object)||PyTuple_Check(object)) {
+        container = PyObject_GetIter(object);
+        if (container == NULL)
+            return yajl_gen_in_error_state;
+        status = py_yajl_gen_array_open(handle);
+    } else if (PyDict_Check(object)) {
+        container = object;
+        Py_INCREF(container);
+        status = py_yajl_gen_map_open(handle);
+    } else {
+        /* Anything else is small enough to encode in one go */
+        return ProcessObject(encoder, object);
+    }
+
+    if (status != yajl_gen_status_ok) {
+        if (status == yajl_max_depth_exceeded)
+            _open_error(encoder, handle);
+        Py_DECREF(container);
+        return status;
+    }
+
+    if (self->depth == self->size) {
+        _YajlEncodeFrame *frames = (_YajlEncodeFrame *)(realloc(self->frames,
+                    sizeof(_YajlEncodeFrame) * (self->size + PY_YAJL_CHUNK_SZ)));
+        if (frames == NULL) {
+            Py_DECREF(container);
+            PyErr_NoMemory();
+            return yajl_gen_in_error_state;
+        }
+        self->frames = frames;
+        self->size += PY_YAJL_CHUNK_SZ;
+    }
+    self->frames[self->depth].object = container;
+    self->frames[self->depth].position = 0;
+    self->depth++;
+    return status;
+}
+
+static yajl_gen_status _iterencode_step(_YajlEncodeIterator *self)
+{
+    py_yajl_gen handle = (py_yajl_gen)(self->_generator);
+    yajl_gen_status status = yajl_gen_status_ok;
+    _YajlEncodeFrame *frame = NULL;
+    PyObject *key, *value;
+
+    if (self->root) {
+        status = _iterencode_value(self, self->root);
+        Py_CLEAR(self->root);
+        if (self->depth == 0)
+            self->finished = 1;
+        return status;
+    }
+
+    frame = &self->frames[self->depth - 1];
+    if (PyDict_Check(frame->object)) {
+        if (PyDict_Next(frame->object, &frame->position, &key, &value)) {
+            Py_INCREF(key);
+            Py_INCREF(value);
+            status = ProcessKey((_YajlEncoder *)(self->encoder), key);
+            if (status == yajl_gen_status_ok) {
+                status = _iterencode_value(self, value);
+            }
+            Py_DECREF(key);
+            Py_DECREF(value);
+            return status;
+        }
+        status = py_yajl_gen_map_close(handle);
+    } else {
+        if ((value = PyIter_Next(frame->object))) {
+            status = _iterencode_value(self, value);
+            Py_DECREF(value);
+            return status;
+        }
+        if (PyErr_Occurred())
+            return yajl_gen_in_error_state;
+        status = py_yajl_gen_array_close(handle);
+    }
+
+    /* Done with this container */
+    self->depth--;
+    Py_DECREF(self->frames[self->depth].object);
+    if (self->depth == 0)
+        self->finished = 1;
+    return status;
+}
+
+PyObject *yajlencodeiter_next(_YajlEncodeIterator *self)
+{
+    _YajlEncoder *encoder = (_YajlEncoder *)(self->encoder);
+    void *previous = encoder->_generator;
+    yajl_gen_status status = yajl_gen_status_ok;
+    PyObject *chunk = NULL;
+
+    if (!self->_generator)
+        return NULL;
+
+    /* Encoder.default() may well use the encoder for something else */
+    encoder->_generator = self->_generator;
+    while ( (!self->finished) && (self->buffer.str) &&
+            (self->buffer.used < self->chunksize) ) {
+        status = _iterencode_step(self);
+        if (status != yajl_gen_status_ok)
+            break;
+    }
+    encoder->_generator = previous;
+
+    if ( (status != yajl_gen_status_ok) || (!self->buffer.str) ) {
+        if (!PyErr_Occurred()) {
+            if (self->buffer.str) {
+                PyErr_SetObject(PyExc_TypeError, PyUnicode_FromString("Object is not JSON serializable"));
+            } else {
+                PyErr_SetObject(PyExc_ValueError, PyUnicode_FromString("Allocation failure"));
+            }
+        }
+        goto done;
+    }
+
+    if (self->buffer.used == 0)
+        goto done;
+
+    chunk = _take_chunk(&self->buffer);
+    if (chunk == NULL)
+        goto done;
+    return chunk;
+
+done:
+    /* Either we've run out of output or hit an error, stop iterating */
+    py_yajl_gen_free((py_yajl_gen)(self->_generator));
+    self->_generator = NULL;
+    return NULL;
+}
+
+void yajlencodeiter_dealloc(_YajlEncodeIterator *self)
+{
+    while (self->depth > 0) {
+        self->depth--;
+        Py_DECREF(self->frames[self->depth].object);
+    }
+    if (self->frames) {
+        free(self->frames);
+    }
+    if (self->_generator) {
+        py_yajl_gen_free((py_yajl_gen)(self->_generator));
+    }
+    Py_XDECREF(self->buffer.str);
+    Py_XDECREF(self->root);
+    Py_XDECREF(self->encoder);
+    PyObject_Del(self);
+}
+
+PyObject *py_yajlencoder_iterencode(PYARGS)
+{
+    _YajlEncodeIterator *iterator = NULL;
+    yajl_gen_config config = {0, NULL};
+    PyObject *value = NULL;
+    Py_ssize_t chunksize = PY_YAJL_FLUSH_SZ;
+    static char *kwlist[] = {"object", "chunk_size", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", kwlist, &value, &chunksize))
+        return NULL;
+
+    if (chunksize <= 0) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("`chunk_size` must be a positive integer"));
+        return NULL;
+    }
+
+    iterator = PyObject_New(_YajlEncodeIterator, &YajlEncodeIteratorType);
+    if (iterator == NULL)
+        return NULL;
+
+    Py_INCREF(self);
+    iterator->encoder = self;
+    Py_INCREF(value);
+    iterator->root = value;
+    iterator->frames = NULL;
+    iterator->depth = 0;
+    iterator->size = 0;
+    iterator->chunksize = (size_t)(chunksize);
+    iterator->finished = 0;
+    iterator->buffer.used = 0;
+    iterator->buffer.nonascii = 0;
+    iterator->buffer.stream = NULL;
+    iterator->buffer.str = lowLevelStringAlloc(PY_YAJL_CHUNK_SZ);
+    iterator->_generator = py_yajl_gen_alloc(py_yajl_printer, &config,
+            ((_YajlEncoder *)(self))->max_depth,
+            (void *) &iterator->buffer);
+
+    if ( (!iterator->buffer.str) || (!iterator->_generator) ) {
+        Py_DECREF(iterator);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)(iterator);
+}
+
 PyObject *py_yajlencoder_default(PYARGS)
 {
     PyObject *value;
@@ -395,17 +1457,181 @@ PyObject *py_yajlencoder_encode(PYARGS)
     return _internal_encode(encoder, value, config);
 }
 
+PyObject *py_yajlencoder_encode_bytes(PYARGS)
+{
+    _YajlEncoder *encoder = (_YajlEncoder *)(self);
+    yajl_gen_config config = {0, NULL};
+    PyObject *value;
+
+    if (!PyArg_ParseTuple(args, "O", &value))
+        return NULL;
+    return _internal_encode_bytes(encoder, value, config);
+}
+
 int yajlencoder_init(PYARGS)
 {
     _YajlEncoder *me = (_YajlEncoder *)(self);
+    PyObject *ensure_ascii = NULL;
+    PyObject *float_precision = NULL;
+    PyObject *max_depth = NULL;
+    static char *kwlist[] = {"ensure_ascii", "float_precision", "max_depth", NULL};
+    int truth, precision;
+    long depth;
 
     if (!me)
         return 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOO", kwlist, &ensure_ascii,
+                &float_precision, &max_depth))
+        return -1;
+    if (ensure_ascii) {
+        truth = PyObject_IsTrue(ensure_ascii);
+        if (truth < 0)
+            return -1;
+        me->utf8 = !truth;
+    }
+    precision = _config_float_precision(float_precision);
+    if (precision < 0)
+        return -1;
+    me->float_precision = precision;
+    depth = _config_max_depth(max_depth);
+    if (depth < 0)
+        return -1;
+    me->max_depth = (unsigned int)(depth);
+    return 0;
+}
+
+/*
+ * Checks a `max_depth` argument, returning how many dicts and lists may
+ * be open at once, 0 for no limit (None), or -1 with an exception set
+ */
+long _config_max_depth(PyObject *max_depth)
+{
+    long depth;
+
+    if ( (!max_depth) || (max_depth == Py_None) )
+        return 0;
+
+    depth = PyLong_AsLong(max_depth);
+    if ( (depth == -1) && (PyErr_Occurred()) )
+        return -1;
+    if ( (depth < 1) || ((unsigned long)(depth) > UINT_MAX) ) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("`max_depth` must be None or a positive integer"));
+        return -1;
+    }
+    return depth;
+}
+
+/*
+ * Checks a `float_precision` argument, returning the number of significant
+ * digits to write floats with, 0 for the shortest round trip (None), or
+ * -1 with an exception set
+ */
+int _config_float_precision(PyObject *float_precision)
+{
+    long precision;
+
+    if ( (!float_precision) || (float_precision == Py_None) )
+        return 0;
+
+    precision = PyLong_AsLong(float_precision);
+    if ( (precision == -1) && (PyErr_Occurred()) )
+        return -1;
+    if ( (precision < 1) || (precision > 17) ) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("`float_precision` must be None or between 1 and 17"));
+        return -1;
+    }
+    return (int)(precision);
+}
+
+/*
+ * Encoder.register(type, fn): encodes instances of `type`, and of classes
+ * derived from it, as whatever fn(instance) returns. fn=None removes it.
+ */
+PyObject *py_yajlencoder_register(PYARGS)
+{
+    _YajlEncoder *me = (_YajlEncoder *)(self);
+    PyObject *type = NULL;
+    PyObject *handler = NULL;
+    static char *kwlist[] = {"type", "fn", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO", kwlist, &type, &handler))
+        return NULL;
+    if (!PyType_Check(type)) {
+        PyErr_SetObject(PyExc_TypeError,
+                PyUnicode_FromString("register() expects a type"));
+        return NULL;
+    }
+    /* these never get as far as looking for a handler, see ProcessObject() */
+    if ( (type == (PyObject *)(&PyUnicode_Type)) || (type == (PyObject *)(&PyLong_Type)) ||
+#ifndef IS_PYTHON3
+            (type == (PyObject *)(&PyString_Type)) || (type == (PyObject *)(&PyInt_Type)) ||
+#endif
+            (type == (PyObject *)(&PyFloat_Type)) || (type == (PyObject *)(&PyBool_Type)) ||
+            (type == (PyObject *)(Py_TYPE(Py_None))) || (type == (PyObject *)(&PyDict_Type)) ||
+            (type == (PyObject *)(&PyList_Type)) || (type == (PyObject *)(&PyTuple_Type)) ) {
+        PyErr_Format(PyExc_TypeError, "%s is always encoded as it is, and can't be register()ed",
+                ((PyTypeObject *)(type))->tp_name);
+        return NULL;
+    }
+    if ( (handler != Py_None) && (!PyCallable_Check(handler)) ) {
+        PyErr_SetObject(PyExc_TypeError,
+                PyUnicode_FromString("register() expects a callable or None"));
+        return NULL;
+    }
+
+    if (!me->handlers) {
+        if (handler == Py_None)
+            Py_RETURN_NONE;
+        me->handlers = PyDict_New();
+        me->handler_cache = PyDict_New();
+        if ( (!me->handlers) || (!me->handler_cache) ) {
+            Py_CLEAR(me->handlers);
+            Py_CLEAR(me->handler_cache);
+            return NULL;
+        }
+    }
+
+    if (handler == Py_None) {
+        if (PyDict_GetItem(me->handlers, type) && PyDict_DelItem(me->handlers, type) < 0)
+            return NULL;
+    }
+    else if (PyDict_SetItem(me->handlers, type, handler) < 0) {
+        return NULL;
+    }
+    /* whatever was found for subclasses may have just changed */
+    PyDict_Clear(me->handler_cache);
+    Py_RETURN_NONE;
+}
+
+/*
+ * Handlers are often bound methods of the encoder itself, which makes a
+ * cycle only the garbage collector can break
+ */
+int yajlencoder_traverse(_YajlEncoder *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->handlers);
+    Py_VISIT(self->handler_cache);
+    return 0;
+}
+
+int yajlencoder_clear(_YajlEncoder *self)
+{
+    Py_CLEAR(self->handlers);
+    Py_CLEAR(self->handler_cache);
     return 0;
 }
 
 void yajlencoder_dealloc(_YajlEncoder *self)
 {
+    PyObject_GC_UnTrack(self);
+    yajlencoder_clear(self);
+    if (self->_spare) {
+        py_yajl_gen_free((py_yajl_gen)(self->_spare));
+        self->_spare = NULL;
+    }
 #ifdef IS_PYTHON3
     Py_TYPE(self)->tp_free((PyObject*)self);
 #else
@@ -0,0 +1,504 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */ 
+
+/*
+ * Read-only dict and list proxies over a lexed tape, see yajl.loads_lazy().
+ * Nothing but the tape gets built up front; an item is only decoded when
+ * it's first looked at, then kept, with nested dicts and lists coming back
+ * as proxies of their own.
+ */
+
+#include <Python.h>
+
+#include <string.h>
+
+#include "py_yajl.h"
+
+#define _LAZY_DECODER(self) ((_YajlDecoder *)((self)->decoder))
+#define _LAZY_TAPE(self) (&(_LAZY_DECODER(self)->tape))
+#define _LAZY_TOKEN(self, index) (&(_LAZY_TAPE(self)->tokens[(index)]))
+
+/* The token after the value starting at `index`, skipping over any items */
+static size_t _next_value(_YajlLazy *self, size_t index)
+{
+    py_yajl_token *token = _LAZY_TOKEN(self, index);
+
+    if ( (PY_YAJL_TOKEN_TYPE(token) == PY_YAJL_TOKEN_START_DICT) ||
+            (PY_YAJL_TOKEN_TYPE(token) == PY_YAJL_TOKEN_START_LIST) ) {
+        return token->offset + 1;
+    }
+    return index + 1;
+}
+
+/*
+ * A proxy for the dict or list starting at token `index`, or the decoded
+ * value of any other token
+ */
+static PyObject *_lazy_value(PyObject *decoder, PyObject *owner, size_t index)
+{
+    py_yajl_token *token = &(((_YajlDecoder *)(decoder))->tape.tokens[index]);
+    PyTypeObject *type = NULL;
+    _YajlLazy *proxy = NULL;
+
+    if (PY_YAJL_TOKEN_TYPE(token) == PY_YAJL_TOKEN_START_DICT)
+        type = &YajlLazyDictType;
+    else if (PY_YAJL_TOKEN_TYPE(token) == PY_YAJL_TOKEN_START_LIST)
+        type = &YajlLazyListType;
+    else
+        return _internal_build_value((_YajlDecoder *)(decoder),
+                &((_YajlDecoder *)(decoder))->tape, index);
+
+    proxy = PyObject_New(_YajlLazy, type);
+    if (proxy == NULL)
+        return NULL;
+    Py_INCREF(decoder);
+    proxy->decoder = decoder;
+    Py_XINCREF(owner);
+    proxy->owner = owner;
+    proxy->start = index;
+    proxy->length = token->length;
+    proxy->children = NULL;
+    proxy->cache = NULL;
+    proxy->keys = NULL;
+    return (PyObject *)(proxy);
+}
+
+/*
+ * Finds where each item starts on the tape (each value, for a dict) the
+ * first time any of them is needed
+ */
+static int _lazy_index(_YajlLazy *self)
+{
+    size_t index = self->start + 1;
+    Py_ssize_t i;
+    int dict = (Py_TYPE(self) == &YajlLazyDictType);
+
+    if (self->children)
+        return success;
+
+    self->children = (size_t *)(PyMem_Malloc(sizeof(size_t) * (self->length + 1)));
+    self->cache = (PyObject **)(PyMem_Malloc(sizeof(PyObject *) * (self->length + 1)));
+    if ( (self->children == NULL) || (self->cache == NULL) ) {
+        PyMem_Free(self->children);
+        PyMem_Free(self->cache);
+        self->children = NULL;
+        self->cache = NULL;
+        PyErr_NoMemory();
+        return failure;
+    }
+
+    for (i = 0; i < self->length; i++) {
+        /* a dict's value comes right after its key */
+        if (dict)
+            index++;
+        self->children[i] = index;
+        self->cache[i] = NULL;
+        index = _next_value(self, index);
+    }
+    return success;
+}
+
+/* The `i`th item (or value), decoded the first time it's asked for */
+static PyObject *_lazy_item(_YajlLazy *self, Py_ssize_t i)
+{
+    if (_lazy_index(self) != success)
+        return NULL;
+
+    if (self->cache[i] == NULL) {
+        self->cache[i] = _lazy_value(self->decoder, self->owner, self->children[i]);
+        if (self->cache[i] == NULL)
+            return NULL;
+    }
+    Py_INCREF(self->cache[i]);
+    return self->cache[i];
+}
+
+/*
+ * Maps each of a dict's keys to the index of its value, the last one
+ * winning should a key be repeated, just as for a decoded dict
+ */
+static PyObject *_lazy_keys(_YajlLazy *self)
+{
+    PyObject *key = NULL;
+    PyObject *slot = NULL;
+    Py_ssize_t i;
+    int rc;
+
+    if (self->keys)
+        return self->keys;
+    if (_lazy_index(self) != success)
+        return NULL;
+
+    self->keys = PY_YAJL_NEW_DICT(self->length);
+    if (self->keys == NULL)
+        return NULL;
+    for (i = 0; i < self->length; i++) {
+        key = _internal_build_key(_LAZY_DECODER(self), _LAZY_TAPE(self),
+                self->children[i] - 1);
+        slot = PyLong_FromSsize_t(i);
+        if ( (key == NULL) || (slot == NULL) ) {
+            Py_XDECREF(key);
+            Py_XDECREF(slot);
+            Py_CLEAR(self->keys);
+            return NULL;
+        }
+        rc = PyDict_SetItem(self->keys, key, slot);
+        Py_DECREF(key);
+        Py_DECREF(slot);
+        if (rc < 0) {
+            Py_CLEAR(self->keys);
+            return NULL;
+        }
+    }
+    return self->keys;
+}
+
+/* The value for `key`, or NULL (with no exception set if it simply isn't there) */
+static PyObject *_lazy_lookup(_YajlLazy *self, PyObject *key)
+{
+    PyObject *keys = _lazy_keys(self);
+    PyObject *slot = NULL;
+
+    if (keys == NULL)
+        return NULL;
+    /* an unhashable key is an error, not just a key that isn't there */
+#ifdef IS_PYTHON3
+    slot = PyDict_GetItemWithError(keys, key);
+#else
+    if (PyObject_Hash(key) == -1)
+        return NULL;
+    slot = PyDict_GetItem(keys, key);
+#endif
+    if (slot == NULL)
+        return NULL;
+    return _lazy_item(self, PyLong_AsSsize_t(slot));
+}
+
+/*
+ * Methods shared by both proxy types
+ */
+void yajllazy_dealloc(_YajlLazy *self)
+{
+    Py_ssize_t i;
+
+    if (self->cache) {
+        for (i = 0; i < self->length; i++) {
+            Py_XDECREF(self->cache[i]);
+        }
+    }
+    PyMem_Free(self->cache);
+    PyMem_Free(self->children);
+    Py_XDECREF(self->keys);
+    Py_XDECREF(self->owner);
+    Py_XDECREF(self->decoder);
+    PyObject_Del(self);
+}
+
+PyObject *py_yajllazy_to_python(PYARGS)
+{
+    _YajlLazy *lazy = (_YajlLazy *)(self);
+
+    return _internal_build_value(_LAZY_DECODER(lazy), _LAZY_TAPE(lazy), lazy->start);
+}
+
+PyObject *yajllazy_richcompare(PyObject *self, PyObject *other, int op)
+{
+    PyObject *value = NULL;
+    PyObject *result = NULL;
+
+    if ( (op != Py_EQ) && (op != Py_NE) ) {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    if (!(value = py_yajllazy_to_python(self, NULL, NULL)))
+        return NULL;
+    if ( (Py_TYPE(other) == &YajlLazyDictType) || (Py_TYPE(other) == &YajlLazyListType) ) {
+        if (!(other = py_yajllazy_to_python(other, NULL, NULL))) {
+            Py_DECREF(value);
+            return NULL;
+        }
+    } else {
+        Py_INCREF(other);
+    }
+    result = PyObject_RichCompare(value, other, op);
+    Py_DECREF(value);
+    Py_DECREF(other);
+    return result;
+}
+
+PyObject *yajllazy_repr(PyObject *self)
+{
+    Py_ssize_t length = PyObject_Length(self);
+
+    if (length < 0)
+        return NULL;
+#ifdef IS_PYTHON3
+    return PyUnicode_FromFormat("<%s of %zd items>", Py_TYPE(self)->tp_name, length);
+#else
+    return PyString_FromFormat("<%s of %zd items>", Py_TYPE(self)->tp_name, length);
+#endif
+}
+
+/*
+ * Methods defined for the LazyList type
+ */
+Py_ssize_t yajllazylist_length(PyObject *self)
+{
+    return ((_YajlLazy *)(self))->length;
+}
+
+PyObject *yajllazylist_item(PyObject *self, Py_ssize_t i)
+{
+    _YajlLazy *lazy = (_YajlLazy *)(self);
+
+    if ( (i < 0) || (i >= lazy->length) ) {
+        PyErr_SetString(PyExc_IndexError, "list index out of range");
+        return NULL;
+    }
+    return _lazy_item(lazy, i);
+}
+
+PyObject *yajllazylist_subscript(PyObject *self, PyObject *item)
+{
+    _YajlLazy *lazy = (_YajlLazy *)(self);
+    Py_ssize_t i, start, stop, step, count, n;
+    PyObject *result = NULL;
+    PyObject *value = NULL;
+
+    if (PyIndex_Check(item)) {
+        i = PyNumber_AsSsize_t(item, PyExc_IndexError);
+        if ( (i == -1) && (PyErr_Occurred()) )
+            return NULL;
+        if (i < 0)
+            i += lazy->length;
+        return yajllazylist_item(self, i);
+    }
+    if (!PySlice_Check(item)) {
+        PyErr_SetString(PyExc_TypeError, "list indices must be integers or slices");
+        return NULL;
+    }
+
+#ifdef IS_PYTHON3
+    if (PySlice_GetIndicesEx(item, lazy->length, &start, &stop, &step, &count) < 0)
+#else
+    if (PySlice_GetIndicesEx((PySliceObject *)(item), lazy->length, &start, &stop, &step, &count) < 0)
+#endif
+        return NULL;
+    if (!(result = PyList_New(count)))
+        return NULL;
+    for (n = 0, i = start; n < count; n++, i += step) {
+        if (!(value = _lazy_item(lazy, i))) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, n, value);
+    }
+    return result;
+}
+
+PyObject *py_yajllazylist_index(PYARGS)
+{
+    _YajlLazy *lazy = (_YajlLazy *)(self);
+    PyObject *value = NULL;
+    PyObject *item = NULL;
+    Py_ssize_t i, start = 0, stop = PY_SSIZE_T_MAX;
+    int found;
+
+    if (!PyArg_ParseTuple(args, "O|O&O&:index", &value,
+                _PyEval_SliceIndex, &start, _PyEval_SliceIndex, &stop))
+        return NULL;
+    if (start < 0) {
+        start += lazy->length;
+        if (start < 0)
+            start = 0;
+    }
+    if (stop < 0)
+        stop += lazy->length;
+    for (i = start; (i < stop) && (i < lazy->length); i++) {
+        if (!(item = _lazy_item(lazy, i)))
+            return NULL;
+        found = PyObject_RichCompareBool(item, value, Py_EQ);
+        Py_DECREF(item);
+        if (found < 0)
+            return NULL;
+        if (found)
+            return PyLong_FromSsize_t(i);
+    }
+    PyErr_SetString(PyExc_ValueError, "value is not in list");
+    return NULL;
+}
+
+PyObject *py_yajllazylist_count(PYARGS)
+{
+    _YajlLazy *lazy = (_YajlLazy *)(self);
+    PyObject *item = NULL;
+    Py_ssize_t i, count = 0;
+    int found;
+
+    for (i = 0; i < lazy->length; i++) {
+        if (!(item = _lazy_item(lazy, i)))
+            return NULL;
+        found = PyObject_RichCompareBool(item, args, Py_EQ);
+        Py_DECREF(item);
+        if (found < 0)
+            return NULL;
+        count += found;
+    }
+    return PyLong_FromSsize_t(count);
+}
+
+/*
+ * Methods defined for the LazyDict type
+ */
+Py_ssize_t yajllazydict_length(PyObject *self)
+{
+    PyObject *keys = _lazy_keys((_YajlLazy *)(self));
+
+    return (keys) ? PyDict_Size(keys) : -1;
+}
+
+PyObject *yajllazydict_subscript(PyObject *self, PyObject *key)
+{
+    PyObject *value = _lazy_lookup((_YajlLazy *)(self), key);
+
+    if ( (value == NULL) && (!PyErr_Occurred()) )
+        PyErr_SetObject(PyExc_KeyError, key);
+    return value;
+}
+
+int yajllazydict_contains(PyObject *self, PyObject *key)
+{
+    PyObject *keys = _lazy_keys((_YajlLazy *)(self));
+
+    return (keys) ? PyDict_Contains(keys, key) : -1;
+}
+
+PyObject *yajllazydict_iter(PyObject *self)
+{
+    PyObject *keys = _lazy_keys((_YajlLazy *)(self));
+
+    return (keys) ? PyObject_GetIter(keys) : NULL;
+}
+
+PyObject *py_yajllazydict_get(PYARGS)
+{
+    PyObject *key = NULL;
+    PyObject *fallback = Py_None;
+    PyObject *value = NULL;
+
+    if (!PyArg_ParseTuple(args, "O|O:get", &key, &fallback))
+        return NULL;
+    value = _lazy_lookup((_YajlLazy *)(self), key);
+    if ( (value == NULL) && (!PyErr_Occurred()) ) {
+        Py_INCREF(fallback);
+        value = fallback;
+    }
+    return value;
+}
+
+PyObject *py_yajllazydict_keys(PYARGS)
+{
+    PyObject *keys = _lazy_keys((_YajlLazy *)(self));
+
+    return (keys) ? PyDict_Keys(keys) : NULL;
+}
+
+/* `which` is 0 for values(), 1 for items() */
+static PyObject *_lazy_values(_YajlLazy *self, int which)
+{
+    PyObject *keys = _lazy_keys(self);
+    PyObject *result = NULL;
+    PyObject *key, *slot, *value;
+    Py_ssize_t position = 0, n = 0;
+
+    if ( (keys == NULL) || (!(result = PyList_New(PyDict_Size(keys)))) )
+        return NULL;
+    while (PyDict_Next(keys, &position, &key, &slot)) {
+        value = _lazy_item(self, PyLong_AsSsize_t(slot));
+        if ( (value) && (which) ) {
+            PyObject *pair = PyTuple_Pack(2, key, value);
+            Py_DECREF(value);
+            value = pair;
+        }
+        if (value == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, n++, value);
+    }
+    return result;
+}
+
+PyObject *py_yajllazydict_values(PYARGS)
+{
+    return _lazy_values((_YajlLazy *)(self), 0);
+}
+
+PyObject *py_yajllazydict_items(PYARGS)
+{
+    return _lazy_values((_YajlLazy *)(self), 1);
+}
+
+/*
+ * Lexes `buffer` (owned by `owner`) onto the tape of `decoder`, which is
+ * then kept by the proxies for the document's dicts and lists
+ */
+PyObject *_internal_decode_lazy(PyObject *decoder, PyObject *owner,
+        char *buffer, Py_ssize_t buflen)
+{
+    _YajlDecoder *self = (_YajlDecoder *)(decoder);
+    py_yajl_tape *tape = &self->tape;
+    yajl_status yrc;
+
+    self->parsing = 1;
+    if (buflen >= PY_YAJL_TAPE_MIN) {
+        Py_BEGIN_ALLOW_THREADS
+        yrc = _internal_lex(tape, &self->arena, (const unsigned char *)(buffer),
+                (size_t)(buflen), NULL);
+        Py_END_ALLOW_THREADS
+    } else {
+        yrc = _internal_lex(tape, &self->arena, (const unsigned char *)(buffer),
+                (size_t)(buflen), NULL);
+    }
+    self->parsing = 0;
+    py_yajl_tape_shrink(tape);
+
+    if (tape->failed) {
+        return PyErr_NoMemory();
+    }
+    if ( (yrc != yajl_status_ok) || (tape->used == 0) ) {
+        PyErr_SetObject(PyExc_ValueError, PyUnicode_FromString(
+                    (yrc != yajl_status_ok) ? yajl_status_to_string(yrc) : "The root object is NULL"));
+        return NULL;
+    }
+    return _lazy_value(decoder, owner, 0);
+}
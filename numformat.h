@@ -0,0 +1,408 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */ 
+
+/*
+ * Header only helpers for writing numbers out as JSON text, straight into
+ * the caller's buffer rather than going through snprintf()
+ *
+ * Doubles are written with the fewest digits that read back as the same
+ * value using Grisu2, see Florian Loitsch, "Printing Floating-Point
+ * Numbers Quickly and Accurately with Integers". Grisu2 always round
+ * trips, though in rare cases it gives a digit more than strictly needed
+ */
+
+#ifndef __PY_YAJL_NUMFORMAT_H__
+#define __PY_YAJL_NUMFORMAT_H__
+
+#include <Python.h>
+#include <string.h>
+
+#include "wideint.h"
+
+/* Longest output of py_yajl_format_i64(), "-9223372036854775808" */
+#define PY_YAJL_INT_BUF_SZ 20
+
+/* "00" through "99", so that digits can be written out two at a time */
+static const char py_yajl_digit_pairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+Py_LOCAL_INLINE(int) py_yajl_count_digits(unsigned long long value)
+{
+    int count = 1;
+
+    for (;;) {
+        if (value < 10) return count;
+        if (value < 100) return count + 1;
+        if (value < 1000) return count + 2;
+        if (value < 10000) return count + 3;
+        value /= 10000;
+        count += 4;
+    }
+}
+
+/*
+ * Writes the decimal digits of `value` to `dest` (no terminating NUL)
+ * and returns how many there were
+ */
+Py_LOCAL_INLINE(size_t) py_yajl_format_u64(char *dest, unsigned long long value)
+{
+    int length = py_yajl_count_digits(value);
+    char *end = dest + length;
+    unsigned int pair;
+
+    while (value >= 100) {
+        pair = (unsigned int)(value % 100) * 2;
+        value /= 100;
+        end -= 2;
+        end[0] = py_yajl_digit_pairs[pair];
+        end[1] = py_yajl_digit_pairs[pair + 1];
+    }
+    if (value >= 10) {
+        pair = (unsigned int)(value) * 2;
+        end[-2] = py_yajl_digit_pairs[pair];
+        end[-1] = py_yajl_digit_pairs[pair + 1];
+    } else {
+        end[-1] = (char)('0' + value);
+    }
+    return (size_t)(length);
+}
+
+Py_LOCAL_INLINE(size_t) py_yajl_format_i64(char *dest, long long value)
+{
+    if (value < 0) {
+        /* negate as unsigned so that LLONG_MIN doesn't overflow */
+        dest[0] = '-';
+        return 1 + py_yajl_format_u64(dest + 1, 0ULL - (unsigned long long)(value));
+    }
+    return py_yajl_format_u64(dest, (unsigned long long)(value));
+}
+
+/* Longest output of py_yajl_format_double(), "-2.2250738585072014e-308" */
+#define PY_YAJL_DOUBLE_BUF_SZ 32
+
+static const unsigned long long py_yajl_pow10_u64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL
+};
+
+/* Normalized approximations f * 2^e of 10^k for k = -348, -340, ..., 340 */
+#define PY_YAJL_CACHED_POW10_MIN (-348)
+#define PY_YAJL_CACHED_POW10_STEP 8
+
+static const unsigned long long py_yajl_cached_pow10_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL,
+    0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL,
+    0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL,
+    0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL,
+    0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL,
+    0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL,
+    0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL,
+    0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL,
+    0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL,
+    0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL,
+    0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL,
+    0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL,
+    0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL,
+    0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL,
+    0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL,
+    0xaf87023b9bf0ee6bULL,
+};
+
+static const short py_yajl_cached_pow10_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066,
+};
+
+/* f * 2^e, with as much precision as a 64 bit significand gives us */
+typedef struct {
+    unsigned long long f;
+    int e;
+} py_yajl_diyfp;
+
+Py_LOCAL_INLINE(py_yajl_diyfp) py_yajl_diyfp_mul(py_yajl_diyfp a, py_yajl_diyfp b)
+{
+    py_yajl_diyfp result;
+    unsigned long long high, low;
+
+    py_yajl_mul128(a.f, b.f, &high, &low);
+    /* round the discarded low half */
+    result.f = high + (low >> 63);
+    result.e = a.e + b.e + 64;
+    return result;
+}
+
+Py_LOCAL_INLINE(py_yajl_diyfp) py_yajl_diyfp_normalize(unsigned long long f, int e)
+{
+    py_yajl_diyfp result;
+    int shift = py_yajl_clz64(f);
+
+    result.f = f << shift;
+    result.e = e - shift;
+    return result;
+}
+
+/*
+ * Walk the last digit down towards the exact value while that stays
+ * inside the rounding interval
+ */
+Py_LOCAL_INLINE(void) py_yajl_grisu_round(char *digits, int length, unsigned long long delta,
+        unsigned long long rest, unsigned long long ten_kappa, unsigned long long wp_w)
+{
+    while ( (rest < wp_w) && (delta - rest >= ten_kappa) &&
+            ( (rest + ten_kappa < wp_w) || (wp_w - rest > rest + ten_kappa - wp_w) ) ) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+/*
+ * Generates the digits of `upper` until what's left is within `delta`,
+ * i.e. any further digits don't matter for reading the value back
+ */
+Py_LOCAL_INLINE(int) py_yajl_grisu_digits(py_yajl_diyfp w, py_yajl_diyfp upper,
+        unsigned long long delta, char *digits, int *K)
+{
+    int shift = -upper.e;
+    unsigned long long one = 1ULL << shift;
+    unsigned long long wp_w = upper.f - w.f;
+    unsigned int p1 = (unsigned int)(upper.f >> shift);
+    unsigned long long p2 = upper.f & (one - 1);
+    unsigned long long rest;
+    int kappa = py_yajl_count_digits(p1);
+    int length = 0;
+    unsigned int d;
+
+    while (kappa > 0) {
+        unsigned int pow10 = (unsigned int)(py_yajl_pow10_u64[kappa - 1]);
+        d = p1 / pow10;
+        p1 %= pow10;
+        if (d || length)
+            digits[length++] = (char)('0' + d);
+        kappa--;
+        rest = ((unsigned long long)(p1) << shift) + p2;
+        if (rest <= delta) {
+            *K += kappa;
+            py_yajl_grisu_round(digits, length, delta, rest,
+                    py_yajl_pow10_u64[kappa] << shift, wp_w);
+            return length;
+        }
+    }
+
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (unsigned int)(p2 >> shift);
+        if (d || length)
+            digits[length++] = (char)('0' + d);
+        p2 &= one - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            py_yajl_grisu_round(digits, length, delta, p2, one,
+                    (-kappa < 20) ? wp_w * py_yajl_pow10_u64[-kappa] : 0);
+            return length;
+        }
+    }
+}
+
+/*
+ * Writes the shortest (give or take, see above) digits of a positive,
+ * finite `value` to `digits`, such that value == digits * 10^K, and
+ * returns how many there were (at most 17)
+ */
+Py_LOCAL_INLINE(int) py_yajl_grisu2(double value, char *digits, int *K)
+{
+    const unsigned long long hidden = 1ULL << 52;
+    unsigned long long bits, f;
+    py_yajl_diyfp w, upper, lower, cached;
+    int e, biased, k, index;
+    double dk;
+
+    memcpy(&bits, &value, sizeof(bits));
+    biased = (int)((bits >> 52) & 0x7FF);
+    f = bits & (hidden - 1);
+    if (biased) {
+        f += hidden;
+        e = biased - 1075;
+    } else {
+        e = -1074;
+    }
+
+    /* the boundaries halfway to the neighbouring doubles, sharing an exponent */
+    upper = py_yajl_diyfp_normalize((f << 1) + 1, e - 1);
+    if (f == hidden) {
+        lower.f = (f << 2) - 1;
+        lower.e = e - 2;
+    } else {
+        lower.f = (f << 1) - 1;
+        lower.e = e - 1;
+    }
+    lower.f <<= lower.e - upper.e;
+    lower.e = upper.e;
+    w = py_yajl_diyfp_normalize(f, e);
+
+    /* pick a power of ten bringing the exponent into [-60, -32] */
+    dk = (-61 - upper.e) * 0.30102999566398114 + 347;
+    k = (int)(dk);
+    if (dk - k > 0.0)
+        k++;
+    index = (k >> 3) + 1;
+    *K = -(PY_YAJL_CACHED_POW10_MIN + index * PY_YAJL_CACHED_POW10_STEP);
+    cached.f = py_yajl_cached_pow10_f[index];
+    cached.e = py_yajl_cached_pow10_e[index];
+
+    w = py_yajl_diyfp_mul(w, cached);
+    upper = py_yajl_diyfp_mul(upper, cached);
+    lower = py_yajl_diyfp_mul(lower, cached);
+    /* allow for the error in the multiplications */
+    upper.f--;
+    lower.f++;
+    return py_yajl_grisu_digits(w, upper, upper.f - lower.f, digits, K);
+}
+
+/*
+ * Writes a finite `value` to `dest` laid out the same way as Python's
+ * repr() does it: "1.0", "0.0001", "1e-05", "1.5e+300"
+ */
+Py_LOCAL_INLINE(size_t) py_yajl_format_double(char *dest, double value)
+{
+    char digits[20];
+    char *out = dest;
+    unsigned long long bits;
+    int length, K, decpt, exponent;
+
+    if (value == 0.0) {
+        memcpy(&bits, &value, sizeof(bits));
+        if (bits >> 63)
+            *out++ = '-';
+        memcpy(out, "0.0", 3);
+        return (size_t)(out - dest) + 3;
+    }
+    if (value < 0) {
+        *out++ = '-';
+        value = -value;
+    }
+
+    length = py_yajl_grisu2(value, digits, &K);
+    /* where the decimal point goes relative to the digits */
+    decpt = length + K;
+
+    if ( (decpt >= -3) && (decpt <= 16) ) {
+        if (decpt <= 0) {
+            memcpy(out, "0.", 2);
+            out += 2;
+            memset(out, '0', -decpt);
+            out += -decpt;
+            memcpy(out, digits, length);
+            out += length;
+        } else if (decpt >= length) {
+            memcpy(out, digits, length);
+            out += length;
+            memset(out, '0', decpt - length);
+            out += decpt - length;
+            memcpy(out, ".0", 2);
+            out += 2;
+        } else {
+            memcpy(out, digits, decpt);
+            out += decpt;
+            *out++ = '.';
+            memcpy(out, digits + decpt, length - decpt);
+            out += length - decpt;
+        }
+        return (size_t)(out - dest);
+    }
+
+    *out++ = digits[0];
+    if (length > 1) {
+        *out++ = '.';
+        memcpy(out, digits + 1, length - 1);
+        out += length - 1;
+    }
+    *out++ = 'e';
+    exponent = decpt - 1;
+    if (exponent < 0) {
+        *out++ = '-';
+        exponent = -exponent;
+    } else {
+        *out++ = '+';
+    }
+    if (exponent >= 100) {
+        *out++ = (char)('0' + exponent / 100);
+        exponent %= 100;
+    }
+    *out++ = py_yajl_digit_pairs[exponent * 2];
+    *out++ = py_yajl_digit_pairs[exponent * 2 + 1];
+    return (size_t)(out - dest);
+}
+
+#endif
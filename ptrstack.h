@@ -41,6 +41,14 @@
 #include <Python.h>
 #include "assert.h"
 
+/* only files which push onto a stack call _py_yajl_ps_grow(), see tape.h */
+#ifdef __GNUC__
+#define PY_YAJL_PS_INLINE(type) __attribute__((unused)) Py_LOCAL_INLINE(type)
+#else
+#define PY_YAJL_PS_INLINE(type) Py_LOCAL_INLINE(type)
+#endif
+
+/* initial number of slots, the stack doubles whenever it fills up */
 #define PY_YAJL_PS_INC 128
 
 typedef struct py_yajl_bytestack_t
@@ -50,6 +58,12 @@ typedef struct py_yajl_bytestack_t
     unsigned int used;
 } py_yajl_bytestack;
 
+/*
+ * The macros below only rely on the `stack`, `size` and `used` members, so
+ * they work for any struct laid out like py_yajl_bytestack whatever the
+ * type of its entries
+ */
+
 /* initialize a bytestack */
 #define py_yajl_ps_init(ops) {                  \
         (ops).stack = NULL;                     \
@@ -67,13 +81,32 @@ typedef struct py_yajl_bytestack_t
 
 #define py_yajl_ps_length(ops) ((ops).used)
 
-#define py_yajl_ps_push(ops, pointer) {                       \
-    if (((ops).size - (ops).used) == 0) {               \
-        (ops).size += PY_YAJL_PS_INC;                      \
-        (ops).stack = realloc((void *) (ops).stack, sizeof(PyObject *) * (ops).size); \
-    }                                                   \
-    (ops).stack[((ops).used)++] = (pointer);               \
+/*
+ * Grows a stack of `width` byte entries to at least one free slot,
+ * returning 0 (and leaving the stack untouched) if that's not possible
+ */
+PY_YAJL_PS_INLINE(int) _py_yajl_ps_grow(void **stack, unsigned int *size, size_t width)
+{
+    unsigned int wanted = (*size) ? (*size) * 2 : PY_YAJL_PS_INC;
+    void *grown = NULL;
+
+    if ( (wanted <= *size) || ((size_t)(wanted) > ((size_t)(-1)) / width) )
+        return 0;
+
+    grown = realloc(*stack, width * wanted);
+    if (grown == NULL)
+        return 0;
+    *stack = grown;
+    *size = wanted;
+    return 1;
 }
+
+/* pushes an entry, evaluates to 1 or to 0 if the stack couldn't grow */
+#define py_yajl_ps_push(ops, pointer)                                   \
+    ( (((ops).used < (ops).size) ||                                     \
+       (_py_yajl_ps_grow((void **)(&(ops).stack), &(ops).size,          \
+                         sizeof(*((ops).stack))))) ?                    \
+      ((ops).stack[((ops).used)++] = (pointer), 1) : 0 )
     
 /* removes the top item of the stack, returns nothing */
 #define py_yajl_ps_pop(ops) { ((ops).used)--; }
@@ -34,32 +34,200 @@
 #define _PY_YAJL_H_
 
 #include <Python.h>
+#include <yajl/yajl_parse.h>
 #include <yajl/yajl_gen.h>
 #include "ptrstack.h"
+#include "arena.h"
+#include "tape.h"
 
 #if PY_MAJOR_VERSION >= 3
 #define IS_PYTHON3
+/* str is bytes in Python 3 */
+#define PyString_Check PyBytes_Check
+#define PyString_AsStringAndSize PyBytes_AsStringAndSize
 #endif
 
+/* Compact, fixed-width str objects (PEP 393) as of Python 3.3 */
+#if PY_VERSION_HEX >= 0x03030000
+#define IS_PEP393
+#endif
+
+/* METH_FASTCALL | METH_KEYWORDS is usable as of Python 3.7 */
+#if PY_VERSION_HEX >= 0x03070000
+#define PY_YAJL_FASTCALL
+#endif
+
+/* dicts which can be created with room for a known number of items */
+#if PY_VERSION_HEX < 0x030D0000
+#define PY_YAJL_NEW_DICT(size) _PyDict_NewPresized((Py_ssize_t)(size))
+#else
+#define PY_YAJL_NEW_DICT(size) PyDict_New()
+#endif
+
+/*
+ * documents at least this long are lexed onto a tape with the GIL released
+ * before any objects are built, shorter ones aren't worth the extra pass
+ */
+#define PY_YAJL_TAPE_MIN 16384
+
+/*
+ * yajl takes lengths as unsigned ints, so longer input is fed to it this
+ * many bytes at a time (which is also how often `progress` gets called)
+ */
+#define PY_YAJL_SLICE (1 << 24)
+
+/* slots in a decoder's dict key cache, must be a power of two */
+#define PY_YAJL_KEY_CACHE_SZ 256
+/* longer keys are rarely repeated enough to be worth caching */
+#define PY_YAJL_KEY_CACHE_LEN 32
+
+typedef struct {
+    PyObject *key;
+    unsigned int length;
+    unsigned char bytes[PY_YAJL_KEY_CACHE_LEN];
+} _YajlKeyCacheEntry;
+
+/*
+ * A node of the trie compiled from the `fields` paths handed to decode(),
+ * for the dict or list at some point along them
+ */
+typedef struct _YajlField {
+    /* a path ends here, so everything below is wanted */
+    unsigned int whole;
+    /* what's wanted from every item of a list (`[*]`), if anything */
+    struct _YajlField *items;
+    /* what's wanted from a dict, by key */
+    struct _YajlFieldKey *keys;
+    unsigned int count;
+} _YajlField;
+
+typedef struct _YajlFieldKey {
+    char *name;             /* UTF-8 */
+    unsigned int length;
+    _YajlField *field;
+} _YajlFieldKey;
+
+/* a dict or list which has been started but not yet ended */
+typedef struct {
+    /* whether this is a dict (of key, value pairs) rather than a list */
+    unsigned int dict;
+    /* where the container's items start on the decoder's value stack */
+    unsigned int start;
+    /* what's wanted from it, NULL for everything */
+    const _YajlField *field;
+} _YajlFrame;
+
+typedef struct {
+    _YajlFrame *stack;
+    unsigned int size;
+    unsigned int used;
+} _YajlFrameStack;
+
 typedef struct {
     PyObject_HEAD
 
-    py_yajl_bytestack elements;
-    py_yajl_bytestack keys;
+    _YajlFrameStack elements;
+    /* items of the open containers, moved into each once it's complete */
+    py_yajl_bytestack values;
     PyObject *root;
 
+    /* tuples=True, decode arrays as tuples rather than lists */
+    unsigned int tuples;
+
+    /* the `fields` projection in effect for the current document, if any */
+    const _YajlField *fields;
+    /* what's wanted of the value after the last dict key */
+    const _YajlField *pending;
+    /* how deep into a dict or list which isn't wanted at all */
+    unsigned int skipping;
+    /* the last `fields` given and the trie compiled from them */
+    PyObject *fields_spec;
+    _YajlField *fields_compiled;
+
+    /* recently decoded dict keys, indexed by a hash of their raw bytes */
+    _YajlKeyCacheEntry *keycache;
+
+    /* set between _internal_decode_start() and _internal_decode_finish() */
+    unsigned int parsing;
+    /* the `progress` callback for the current document, borrowed */
+    PyObject *progress;
+
+    /* backs all of yajl's allocations, rewound after every document */
+    py_yajl_arena arena;
+
+    /* tokens of the document being decoded by _internal_decode_tape() */
+    py_yajl_tape tape;
+
 } _YajlDecoder;
 
 typedef struct {
     PyObject_HEAD
     /* type specifics */
     void *_generator;
+    /* generator left over from the last encode, reset rather than freed */
+    void *_spare;
+    /* ensure_ascii=False, write non-ASCII characters out as UTF-8 */
+    unsigned int utf8;
+    /* significant digits for floats, 0 for the shortest round trip */
+    int float_precision;
+    /* most dicts and lists to be in at once, 0 for no limit */
+    unsigned int max_depth;
+    /* functions register()ed by type, NULL until the first one */
+    PyObject *handlers;
+    /* the function, or None, each type encoded so far resolved to */
+    PyObject *handler_cache;
 } _YajlEncoder;
 
+/* a structure used to pass context to our printer function */
+struct StringAndUsedCount
+{
+    PyObject * str;
+    size_t used;
+    /* when set, output is written out to `stream` past `flush_at` bytes */
+    PyObject * stream;
+    size_t flush_at;
+    /* set once anything other than 7-bit ASCII has been written */
+    unsigned int nonascii;
+};
+
+typedef struct {
+    PyObject *object;       /* dict being walked, or iterator over a sequence */
+    Py_ssize_t position;    /* PyDict_Next() position within a dict */
+} _YajlEncodeFrame;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *encoder;
+    PyObject *root;         /* the object to encode until we've started */
+    void *_generator;
+    struct StringAndUsedCount buffer;
+    _YajlEncodeFrame *frames;
+    unsigned int depth;
+    unsigned int size;
+    size_t chunksize;
+    unsigned int finished;
+} _YajlEncodeIterator;
+
+/* a read-only proxy for a dict or list on a lexed tape, see lazy.c */
+typedef struct {
+    PyObject_HEAD
+    PyObject *decoder;      /* the Decoder whose tape the document is on */
+    PyObject *owner;        /* the bytes the tape points into */
+    size_t start;           /* the token the dict or list starts at */
+    Py_ssize_t length;      /* items (key, value pairs for a dict) */
+    size_t *children;       /* the token each item (or value) starts at */
+    PyObject **cache;       /* the items decoded so far */
+    PyObject *keys;         /* maps a dict's keys to their items */
+} _YajlLazy;
+
 #define PYARGS PyObject *self, PyObject *args, PyObject *kwargs
 enum { failure, success };
 
 #define PY_YAJL_CHUNK_SZ 64
+/* default number of bytes yajl.load() pulls from a stream per read */
+#define PY_YAJL_READ_SZ (64 * 1024)
+/* default number of bytes buffered by yajl.dump()/iterencode() per write */
+#define PY_YAJL_FLUSH_SZ (64 * 1024)
 
 /* Defining the Py_SIZE macro for 2.4/2.5 compat */
 #ifndef Py_SIZE
@@ -87,19 +255,72 @@ enum { failure, success };
  * Methods defined for the YajlDecoder type in decoder.c
  */
 extern PyObject *py_yajldecoder_decode(PYARGS);
+extern PyObject *py_yajldecoder_arena_stats(PYARGS);
 extern int yajldecoder_init(PYARGS);
 extern void yajldecoder_dealloc(_YajlDecoder *self);
-extern PyObject *_internal_decode(_YajlDecoder *self, char *buffer, unsigned int buflen);
+extern PyObject *_internal_decode(_YajlDecoder *self, char *buffer, size_t buflen);
+extern PyObject *_internal_decode_fields(_YajlDecoder *self, char *buffer, size_t buflen,
+        PyObject *fields, PyObject *progress);
+extern int _internal_validate(_YajlDecoder *self, char *buffer, size_t buflen,
+        int check_utf8, int comments, Py_ssize_t *offset);
+extern yajl_handle _internal_decode_start(_YajlDecoder *self);
+extern PyObject *_internal_decode_finish(_YajlDecoder *self, yajl_handle parser, yajl_status yrc);
+extern PyObject *_internal_input(PyObject *object, char **buffer, Py_ssize_t *buflen);
+extern yajl_status _internal_lex(py_yajl_tape *tape, py_yajl_arena *arena,
+        const unsigned char *buffer, size_t buflen, PyObject *progress);
+extern PyObject *_internal_build(_YajlDecoder *self, py_yajl_tape *tape, yajl_status yrc);
+extern PyObject *_internal_decode_many(_YajlDecoder *self, PyObject *sequence,
+        int threads, int return_errors);
 
 
 /*
  * Methods defined for the YajlEncoder type in encoder.c
  */
 extern PyObject *py_yajlencoder_encode(PYARGS);
+extern PyObject *py_yajlencoder_encode_bytes(PYARGS);
 extern PyObject* py_yajlencoder_default(PYARGS);
+extern PyObject *py_yajlencoder_register(PYARGS);
 extern int yajlencoder_init(PYARGS);
+extern int yajlencoder_traverse(_YajlEncoder *self, visitproc visit, void *arg);
+extern int yajlencoder_clear(_YajlEncoder *self);
 extern void yajlencoder_dealloc(_YajlEncoder *self);
 extern PyObject *_internal_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config config);
+extern PyObject *_internal_encode_bytes(_YajlEncoder *self, PyObject *obj, yajl_gen_config config);
+extern PyObject *_internal_stream_encode(_YajlEncoder *self, PyObject *obj, yajl_gen_config config,
+        PyObject *stream, size_t flush_at);
+extern int _config_float_precision(PyObject *float_precision);
+extern long _config_max_depth(PyObject *max_depth);
+extern PyObject *py_yajlencoder_iterencode(PYARGS);
+extern PyObject *yajlencodeiter_next(_YajlEncodeIterator *self);
+extern void yajlencodeiter_dealloc(_YajlEncodeIterator *self);
+extern PyTypeObject YajlEncodeIteratorType;
+
+/*
+ * Methods defined for the LazyDict and LazyList types in lazy.c
+ */
+extern PyObject *_internal_build_value(_YajlDecoder *self, py_yajl_tape *tape, size_t index);
+extern PyObject *_internal_build_key(_YajlDecoder *self, py_yajl_tape *tape, size_t index);
+extern PyObject *_internal_decode_lazy(PyObject *decoder, PyObject *owner,
+        char *buffer, Py_ssize_t buflen);
+extern void yajllazy_dealloc(_YajlLazy *self);
+extern PyObject *py_yajllazy_to_python(PYARGS);
+extern PyObject *yajllazy_richcompare(PyObject *self, PyObject *other, int op);
+extern PyObject *yajllazy_repr(PyObject *self);
+extern Py_ssize_t yajllazylist_length(PyObject *self);
+extern PyObject *yajllazylist_item(PyObject *self, Py_ssize_t i);
+extern PyObject *yajllazylist_subscript(PyObject *self, PyObject *item);
+extern PyObject *py_yajllazylist_index(PYARGS);
+extern PyObject *py_yajllazylist_count(PYARGS);
+extern Py_ssize_t yajllazydict_length(PyObject *self);
+extern PyObject *yajllazydict_subscript(PyObject *self, PyObject *key);
+extern int yajllazydict_contains(PyObject *self, PyObject *key);
+extern PyObject *yajllazydict_iter(PyObject *self);
+extern PyObject *py_yajllazydict_get(PYARGS);
+extern PyObject *py_yajllazydict_keys(PYARGS);
+extern PyObject *py_yajllazydict_values(PYARGS);
+extern PyObject *py_yajllazydict_items(PYARGS);
+extern PyTypeObject YajlLazyDictType;
+extern PyTypeObject YajlLazyListType;
 
 #endif
 
@@ -25,6 +25,7 @@ base_modules = [
                 'yajl.c',
                 'encoder.c',
                 'decoder.c',
+                'lazy.c',
                 'yajl_hacks.c',
                 'yajl/src/yajl_alloc.c',
                 'yajl/src/yajl_buf.c',
@@ -0,0 +1,252 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */ 
+
+/*
+ * Header only helpers for scanning through runs of bytes (or of PEP 393
+ * code points) a block at a time, using SSE2/AVX2 where the compiler
+ * targets them and falling back to plain loops otherwise
+ */
+
+#ifndef __PY_YAJL_STRSCAN_H__
+#define __PY_YAJL_STRSCAN_H__
+
+#include <Python.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define PY_YAJL_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PY_YAJL_SSE2
+#endif
+
+/* the encoder and decoder each use only some of these, see tape.h */
+#ifdef __GNUC__
+#define PY_YAJL_STRSCAN_INLINE(type) __attribute__((unused)) Py_LOCAL_INLINE(type)
+#else
+#define PY_YAJL_STRSCAN_INLINE(type) Py_LOCAL_INLINE(type)
+#endif
+
+#define PY_YAJL_HIGH_BITS 0x8080808080808080ULL
+
+/* Returns the length of the leading run of 7-bit ASCII bytes in `str` */
+PY_YAJL_STRSCAN_INLINE(size_t) py_yajl_ascii_prefix(const unsigned char *str, size_t length)
+{
+    size_t offset = 0;
+    unsigned long long word;
+
+#if defined(PY_YAJL_AVX2)
+    for (; offset + 32 <= length; offset += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(str + offset));
+        if (_mm256_movemask_epi8(block))
+            break;
+    }
+#elif defined(PY_YAJL_SSE2)
+    for (; offset + 16 <= length; offset += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(str + offset));
+        if (_mm_movemask_epi8(block))
+            break;
+    }
+#endif
+
+    for (; offset + 8 <= length; offset += 8) {
+        memcpy(&word, str + offset, 8);
+        if (word & PY_YAJL_HIGH_BITS)
+            break;
+    }
+
+    while ( (offset < length) && (str[offset] < 0x80) )
+        offset++;
+    return offset;
+}
+
+/*
+ * Returns the offset of the first byte of `str` which isn't part of a well
+ * formed UTF-8 sequence (no overlong forms, surrogates or code points past
+ * U+10FFFF), or `length` if there's none. Runs of ASCII are skipped a block
+ * at a time.
+ */
+PY_YAJL_STRSCAN_INLINE(size_t) py_yajl_utf8_invalid(const unsigned char *str, size_t length)
+{
+    size_t offset = 0;
+    unsigned char c, low, high;
+    size_t need, i;
+
+    for (;;) {
+        offset += py_yajl_ascii_prefix(str + offset, length - offset);
+        if (offset >= length)
+            return length;
+
+        c = str[offset];
+        low = 0x80;
+        high = 0xBF;
+        if ( (c >= 0xC2) && (c <= 0xDF) ) {
+            need = 1;
+        } else if ( (c >= 0xE0) && (c <= 0xEF) ) {
+            need = 2;
+            if (c == 0xE0)
+                low = 0xA0;         /* overlong */
+            else if (c == 0xED)
+                high = 0x9F;        /* surrogates */
+        } else if ( (c >= 0xF0) && (c <= 0xF4) ) {
+            need = 3;
+            if (c == 0xF0)
+                low = 0x90;         /* overlong */
+            else if (c == 0xF4)
+                high = 0x8F;        /* past U+10FFFF */
+        } else {
+            return offset;
+        }
+
+        if (length - offset <= need)
+            return offset;
+        /* only the first continuation byte has a narrower range */
+        if ( (str[offset + 1] < low) || (str[offset + 1] > high) )
+            return offset;
+        for (i = 2; i <= need; i++) {
+            if ( (str[offset + i] & 0xC0) != 0x80 )
+                return offset;
+        }
+        offset += need + 1;
+    }
+}
+
+/*
+ * Characters which can be copied into a JSON string as they are: printable
+ * ASCII other than the quote and backslash
+ */
+#define PY_YAJL_PLAIN(c) ( ((c) >= 0x20) && ((c) < 0x7F) && ((c) != '"') && ((c) != '\\') )
+
+/*
+ * Return the length of the leading run of plain characters in a string
+ * of 1, 2 or 4 byte code points (the PEP 393 kinds)
+ */
+PY_YAJL_STRSCAN_INLINE(size_t) py_yajl_plain_prefix_ucs1(const unsigned char *str, size_t length)
+{
+    size_t offset = 0;
+
+#if defined(PY_YAJL_AVX2)
+    const __m256i space = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7F);
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+
+    for (; offset + 32 <= length; offset += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(str + offset));
+        /* a signed compare catches bytes >= 0x80 as well as control characters */
+        __m256i special = _mm256_or_si256(_mm256_cmpgt_epi8(space, block),
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, del),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(block, quote),
+                        _mm256_cmpeq_epi8(block, backslash))));
+        if (_mm256_movemask_epi8(special))
+            break;
+    }
+#elif defined(PY_YAJL_SSE2)
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+
+    for (; offset + 16 <= length; offset += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(str + offset));
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(block, space),
+                _mm_or_si128(_mm_cmpeq_epi8(block, del),
+                    _mm_or_si128(_mm_cmpeq_epi8(block, quote),
+                        _mm_cmpeq_epi8(block, backslash))));
+        if (_mm_movemask_epi8(special))
+            break;
+    }
+#endif
+
+    while ( (offset < length) && (PY_YAJL_PLAIN(str[offset])) )
+        offset++;
+    return offset;
+}
+
+PY_YAJL_STRSCAN_INLINE(size_t) py_yajl_plain_prefix_ucs2(const unsigned short *str, size_t length)
+{
+    size_t offset = 0;
+
+#if defined(PY_YAJL_SSE2)
+    const __m128i low = _mm_set1_epi16(0x20);
+    const __m128i high = _mm_set1_epi16(0x7E);
+    const __m128i quote = _mm_set1_epi16('"');
+    const __m128i backslash = _mm_set1_epi16('\\');
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; offset + 8 <= length; offset += 8) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(str + offset));
+        /* no unsigned 16-bit compare in SSE2, saturating subtraction does */
+        __m128i range = _mm_or_si128(_mm_subs_epu16(block, high),
+                _mm_subs_epu16(low, block));
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi16(block, quote),
+                _mm_cmpeq_epi16(block, backslash));
+        __m128i plain = _mm_andnot_si128(special, _mm_cmpeq_epi16(range, zero));
+        if (_mm_movemask_epi8(plain) != 0xFFFF)
+            break;
+    }
+#endif
+
+    while ( (offset < length) && (PY_YAJL_PLAIN(str[offset])) )
+        offset++;
+    return offset;
+}
+
+PY_YAJL_STRSCAN_INLINE(size_t) py_yajl_plain_prefix_ucs4(const unsigned int *str, size_t length)
+{
+    size_t offset = 0;
+
+#if defined(PY_YAJL_SSE2)
+    /* code points top out at 0x10FFFF, so signed compares are fine */
+    const __m128i space = _mm_set1_epi32(0x20);
+    const __m128i tilde = _mm_set1_epi32(0x7E);
+    const __m128i quote = _mm_set1_epi32('"');
+    const __m128i backslash = _mm_set1_epi32('\\');
+
+    for (; offset + 4 <= length; offset += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(str + offset));
+        __m128i special = _mm_or_si128(
+                _mm_or_si128(_mm_cmplt_epi32(block, space), _mm_cmpgt_epi32(block, tilde)),
+                _mm_or_si128(_mm_cmpeq_epi32(block, quote), _mm_cmpeq_epi32(block, backslash)));
+        if (_mm_movemask_epi8(special))
+            break;
+    }
+#endif
+
+    while ( (offset < length) && (PY_YAJL_PLAIN(str[offset])) )
+        offset++;
+    return offset;
+}
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */ 
+
+/*
+ * The "tape" a document is lexed into before any Python objects are made:
+ * a flat array of tokens in document order, plus a pool holding the few
+ * strings which can't simply point back into the input (i.e. ones with
+ * escapes in them). Filling it in needs nothing but malloc(), so it can be
+ * done without holding the GIL.
+ */
+
+#ifndef __PY_YAJL_TAPE_H__
+#define __PY_YAJL_TAPE_H__
+
+#include <Python.h>
+#include <string.h>
+
+/*
+ * Python 2 may define Py_LOCAL_INLINE() as a plain static, which warns in
+ * every file including this that doesn't call all of these
+ */
+#ifdef __GNUC__
+#define PY_YAJL_TAPE_INLINE(type) __attribute__((unused)) Py_LOCAL_INLINE(type)
+#else
+#define PY_YAJL_TAPE_INLINE(type) Py_LOCAL_INLINE(type)
+#endif
+
+enum {
+    PY_YAJL_TOKEN_NULL,
+    PY_YAJL_TOKEN_FALSE,
+    PY_YAJL_TOKEN_TRUE,
+    PY_YAJL_TOKEN_NUMBER,
+    PY_YAJL_TOKEN_STRING,
+    PY_YAJL_TOKEN_KEY,
+    PY_YAJL_TOKEN_START_DICT,
+    PY_YAJL_TOKEN_END_DICT,
+    PY_YAJL_TOKEN_START_LIST,
+    PY_YAJL_TOKEN_END_LIST
+};
+
+/* or'd into the type of a string, key or number kept in the pool */
+#define PY_YAJL_TOKEN_POOLED 0x100
+#define PY_YAJL_TOKEN_TYPE(token) ((token)->type & 0xff)
+
+/* a bigger tape than this is given back to the system after each document */
+#define PY_YAJL_TAPE_KEEP 65536
+/* initial number of tokens (and bytes in the pool) */
+#define PY_YAJL_TAPE_INC 1024
+
+typedef struct {
+    unsigned int type;
+    /*
+     * bytes in a string, key or number; the number of items (or key,
+     * value pairs) in a dict or list
+     */
+    unsigned int length;
+    /*
+     * where a string, key or number starts in the input (or the pool);
+     * the index of the matching end token for the start of a dict or list
+     */
+    size_t offset;
+} py_yajl_token;
+
+typedef struct {
+    py_yajl_token *tokens;
+    size_t used;
+    size_t size;
+
+    unsigned char *pool;
+    size_t pool_used;
+    size_t pool_size;
+
+    /* indices of the start tokens of the dicts and lists still open */
+    size_t *open;
+    size_t open_used;
+    size_t open_size;
+
+    const unsigned char *input;
+    size_t input_length;
+
+    /* set if the tape couldn't grow */
+    int failed;
+} py_yajl_tape;
+
+PY_YAJL_TAPE_INLINE(void) py_yajl_tape_init(py_yajl_tape *tape)
+{
+    memset(tape, 0, sizeof(py_yajl_tape));
+}
+
+PY_YAJL_TAPE_INLINE(void) py_yajl_tape_release(py_yajl_tape *tape)
+{
+    free(tape->tokens);
+    free(tape->pool);
+    free(tape->open);
+    py_yajl_tape_init(tape);
+}
+
+/* Empty the tape, ready to lex `input` into it */
+PY_YAJL_TAPE_INLINE(void) py_yajl_tape_reset(py_yajl_tape *tape,
+        const unsigned char *input, size_t length)
+{
+    tape->used = 0;
+    tape->pool_used = 0;
+    tape->open_used = 0;
+    tape->input = input;
+    tape->input_length = length;
+    tape->failed = 0;
+}
+
+/* Hand back the memory of an unusually big document */
+PY_YAJL_TAPE_INLINE(void) py_yajl_tape_trim(py_yajl_tape *tape)
+{
+    if ( (tape->size > PY_YAJL_TAPE_KEEP) ||
+            (tape->pool_size > PY_YAJL_TAPE_KEEP * sizeof(py_yajl_token)) ) {
+        py_yajl_tape_release(tape);
+    }
+    tape->input = NULL;
+    tape->input_length = 0;
+}
+
+/*
+ * Gives back the memory a lexed tape has no more use for, for when it's
+ * going to be kept around
+ */
+PY_YAJL_TAPE_INLINE(void) py_yajl_tape_shrink(py_yajl_tape *tape)
+{
+    void *shrunk = NULL;
+
+    free(tape->open);
+    tape->open = NULL;
+    tape->open_used = 0;
+    tape->open_size = 0;
+
+    if ( (tape->used) && (tape->used < tape->size) ) {
+        shrunk = realloc(tape->tokens, tape->used * sizeof(py_yajl_token));
+        if (shrunk) {
+            tape->tokens = (py_yajl_token *)(shrunk);
+            tape->size = tape->used;
+        }
+    }
+    if ( (tape->pool_used) && (tape->pool_used < tape->pool_size) ) {
+        shrunk = realloc(tape->pool, tape->pool_used);
+        if (shrunk) {
+            tape->pool = (unsigned char *)(shrunk);
+            tape->pool_size = tape->pool_used;
+        }
+    }
+}
+
+/*
+ * Copies the tokens and pool of a lexed tape into exactly sized memory of
+ * `copy`'s own, for when a lot of tapes are kept around at once; returns
+ * 0 (flagging `copy`) if that's not possible
+ */
+PY_YAJL_TAPE_INLINE(int) py_yajl_tape_copy(py_yajl_tape *copy, const py_yajl_tape *tape)
+{
+    py_yajl_tape_release(copy);
+    copy->input = tape->input;
+    copy->input_length = tape->input_length;
+    copy->failed = tape->failed;
+
+    if (tape->used) {
+        copy->tokens = (py_yajl_token *)(malloc(tape->used * sizeof(py_yajl_token)));
+        if (copy->tokens == NULL) {
+            copy->failed = 1;
+            return 0;
+        }
+        memcpy(copy->tokens, tape->tokens, tape->used * sizeof(py_yajl_token));
+        copy->used = copy->size = tape->used;
+    }
+    if (tape->pool_used) {
+        copy->pool = (unsigned char *)(malloc(tape->pool_used));
+        if (copy->pool == NULL) {
+            copy->failed = 1;
+            return 0;
+        }
+        memcpy(copy->pool, tape->pool, tape->pool_used);
+        copy->pool_used = copy->pool_size = tape->pool_used;
+    }
+    return 1;
+}
+
+/*
+ * Makes room for `extra` more entries of `width` bytes, doubling the
+ * array as needed; returns 0 (and flags the tape) if that's not possible
+ */
+PY_YAJL_TAPE_INLINE(int) _py_yajl_tape_grow(py_yajl_tape *tape, void **array,
+        size_t *size, size_t used, size_t extra, size_t width)
+{
+    size_t wanted = (*size) ? (*size) : PY_YAJL_TAPE_INC;
+    void *grown = NULL;
+
+    while (wanted - used < extra) {
+        if (wanted > ((size_t)(-1)) / (2 * width)) {
+            tape->failed = 1;
+            return 0;
+        }
+        wanted *= 2;
+    }
+    if (wanted == *size)
+        return 1;
+
+    grown = realloc(*array, wanted * width);
+    if (grown == NULL) {
+        tape->failed = 1;
+        return 0;
+    }
+    *array = grown;
+    *size = wanted;
+    return 1;
+}
+
+/*
+ * Appends a token, counting it as an item of the innermost open dict or
+ * list unless it's a key or the end of a container
+ */
+PY_YAJL_TAPE_INLINE(py_yajl_token *) py_yajl_tape_push(py_yajl_tape *tape,
+        unsigned int type, unsigned int length, size_t offset)
+{
+    py_yajl_token *token = NULL;
+
+    if ( (tape->used == tape->size) && (!_py_yajl_tape_grow(tape,
+                    (void **)(&tape->tokens), &tape->size, tape->used, 1,
+                    sizeof(py_yajl_token))) ) {
+        return NULL;
+    }
+
+    if ( (tape->open_used) && ((type & 0xff) != PY_YAJL_TOKEN_KEY) &&
+            (type != PY_YAJL_TOKEN_END_DICT) && (type != PY_YAJL_TOKEN_END_LIST) ) {
+        tape->tokens[tape->open[tape->open_used - 1]].length++;
+    }
+
+    token = &tape->tokens[tape->used++];
+    token->type = type;
+    token->length = length;
+    token->offset = offset;
+    return token;
+}
+
+/*
+ * Appends a string, key or number token; the bytes are only copied into
+ * the pool if they don't lie within the input (yajl unescapes strings
+ * into a buffer of its own)
+ */
+PY_YAJL_TAPE_INLINE(int) py_yajl_tape_push_bytes(py_yajl_tape *tape,
+        unsigned int type, const unsigned char *value, unsigned int length)
+{
+    if ( (value >= tape->input) &&
+            (value + length <= tape->input + tape->input_length) ) {
+        return py_yajl_tape_push(tape, type, length,
+                (size_t)(value - tape->input)) != NULL;
+    }
+
+    if ( (tape->pool_size - tape->pool_used < length) &&
+            (!_py_yajl_tape_grow(tape, (void **)(&tape->pool), &tape->pool_size,
+                    tape->pool_used, length, 1)) ) {
+        return 0;
+    }
+    memcpy(tape->pool + tape->pool_used, value, length);
+    tape->pool_used += length;
+    return py_yajl_tape_push(tape, type | PY_YAJL_TOKEN_POOLED, length,
+            tape->pool_used - length) != NULL;
+}
+
+/* Appends the start of a dict or list, which stays open until its end */
+PY_YAJL_TAPE_INLINE(int) py_yajl_tape_open(py_yajl_tape *tape, unsigned int type)
+{
+    if ( (tape->open_used == tape->open_size) && (!_py_yajl_tape_grow(tape,
+                    (void **)(&tape->open), &tape->open_size, tape->open_used, 1,
+                    sizeof(size_t))) ) {
+        return 0;
+    }
+    if (py_yajl_tape_push(tape, type, 0, 0) == NULL)
+        return 0;
+    tape->open[tape->open_used++] = tape->used - 1;
+    return 1;
+}
+
+/* Appends the end of the innermost dict or list, linking its start to it */
+PY_YAJL_TAPE_INLINE(int) py_yajl_tape_close(py_yajl_tape *tape, unsigned int type)
+{
+    if ( (tape->open_used == 0) || (py_yajl_tape_push(tape, type, 0, 0) == NULL) )
+        return 0;
+    tape->open_used--;
+    tape->tokens[tape->open[tape->open_used]].offset = tape->used - 1;
+    return 1;
+}
+
+/* The bytes of a string, key or number token */
+#define py_yajl_tape_bytes(tape, token)                                 \
+    ((((token)->type & PY_YAJL_TOKEN_POOLED) ? (tape)->pool : (tape)->input) \
+     + (token)->offset)
+
+#endif
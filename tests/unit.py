@@ -2,6 +2,7 @@
 # -*- coding: utf-8 -*-
 
 import sys
+import threading
 import unittest
 
 def is_python3():
@@ -112,6 +113,75 @@ class BasicJSONEncodeTests(EncoderBase):
 
 
 
+class StringDecodeTests(unittest.TestCase):
+    def test_ascii(self):
+        for length in (0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 100):
+            value = ''.join(chr(ord('a') + (i % 26)) for i in range(length))
+            self.assertEquals(yajl.loads('"%s"' % value), value)
+
+    def test_non_ascii_tail(self):
+        for length in (0, 7, 8, 16, 31, 32, 64):
+            rc = yajl.loads('["%s\\u00e9", "%s\\u65e9"]' % ('a' * length, 'b' * length))
+            self.assertEquals(rc, ['a' * length + u'\u00e9', 'b' * length + u'\u65e9'])
+
+
+class NumberDecodeTests(unittest.TestCase):
+    def assertSameNumber(self, json, value):
+        rc = yajl.loads(json)
+        self.assertEquals(type(rc), type(value))
+        self.assertEquals(repr(rc), repr(value))
+
+    def test_ints(self):
+        self.assertSameNumber('0', 0)
+        self.assertSameNumber('-0', 0)
+        self.assertSameNumber('[9223372036854775807]', [9223372036854775807])
+        self.assertSameNumber('[-9223372036854775808]', [-9223372036854775808])
+        self.assertSameNumber('[18446744073709551615]', [18446744073709551615])
+
+    def test_big_ints(self):
+        self.assertSameNumber('[-9223372036854775809]', [-9223372036854775809])
+        self.assertSameNumber('[123456789012345678901234567890]',
+                [123456789012345678901234567890])
+
+    def test_floats(self):
+        for value in ('0.1', '-0.0', '1e22', '1e23', '2.2250738585072014e-308',
+                '5e-324', '1.7976931348623157e308', '9007199254740993.0',
+                '0.30000000000000004', '123456.789e-3', '1E+2'):
+            self.assertSameNumber(value, float(value))
+
+    def test_long_floats(self):
+        value = '3.14159265358979323846264338327950288'
+        self.assertSameNumber(value, float(value))
+        self.assertSameNumber('1' * 30 + '.5', float('1' * 30 + '.5'))
+
+    def test_out_of_range_floats(self):
+        self.assertSameNumber('1e400', float('inf'))
+        self.assertSameNumber('-1e400', float('-inf'))
+        self.assertSameNumber('1e-400', 0.0)
+
+
+class KeyCacheTests(unittest.TestCase):
+    def test_shared_keys(self):
+        rc = yajl.Decoder().decode('[{"key" : 1}, {"key" : 2}]')
+        self.assertEquals(rc, [{'key' : 1}, {'key' : 2}])
+        self.assertTrue(list(rc[0].keys())[0] is list(rc[1].keys())[0])
+
+    def test_across_calls(self):
+        decoder = yajl.Decoder()
+        first = decoder.decode('{"key" : 1}')
+        second = decoder.decode('{"key" : 2}')
+        self.assertTrue(list(first.keys())[0] is list(second.keys())[0])
+
+    def test_unicode_keys(self):
+        rc = yajl.loads('[{"k\u00e9y" : 1}, {"k\u00e9y" : 2}]')
+        self.assertEquals(rc, [{u'k\u00e9y' : 1}, {u'k\u00e9y' : 2}])
+
+    def test_long_keys(self):
+        key = 'k' * 100
+        self.assertEquals(yajl.loads('[{"%s" : 1}, {"%s" : 2}]' % (key, key)),
+                [{key : 1}, {key : 2}])
+
+
 class LoadsTest(BasicJSONDecodeTests):
     def decode(self, json):
         return yajl.loads(json)
@@ -145,9 +215,25 @@ class StreamBlockingDecodingTests(unittest.TestCase):
         obj = yajl.load(self.stream)
         self.assertEquals(obj, {'foo' : ['one', 'two', ['three', 'four']]})
 
-class StreamIterDecodingTests(object): # TODO: Change to unittest.TestCase when I start to think about iterative
+    def test_chunked_decode(self):
+        obj = yajl.load(self.stream, chunk_size=3)
+        self.assertEquals(obj, {'foo' : ['one', 'two', ['three', 'four']]})
+
+    def test_readinto_decode(self):
+        import io
+        stream = io.BytesIO(b'[3.14, 2.718, {"key" : "pair"}, 1]')
+        obj = yajl.load(stream, chunk_size=4)
+        self.assertEquals(obj, [3.14, 2.718, {'key' : 'pair'}, 1])
+
+    def test_truncated_stream(self):
+        self.failUnlessRaises(ValueError, yajl.load, StringIO('{"foo":["one"'), chunk_size=5)
+
+    def test_bad_chunk_size(self):
+        self.failUnlessRaises(ValueError, yajl.load, self.stream, chunk_size=0)
+
+class StreamIterDecodingTests(unittest.TestCase):
     def setUp(self):
-        self.stream = StringIO('{"foo":["one","two",["three", "four"]]}')
+        self.stream = StringIO('{"foo":["one","two",["three", "four"]]}\n[1, 2] 3\n"four"{}\n')
 
     def test_no_object(self):
         self.failUnlessRaises(TypeError, yajl.iterload)
@@ -156,8 +242,23 @@ class StreamIterDecodingTests(object): # TODO: Change to unittest.TestCase when
         self.failUnlessRaises(TypeError, yajl.iterload, 'this is no stream!')
 
     def test_simple_decode(self):
-        for k, v in yajl.iterload(self.stream):
-            print(k, v)
+        values = list(yajl.iterload(self.stream))
+        self.assertEquals(values, [{'foo' : ['one', 'two', ['three', 'four']]},
+                [1, 2], 3, 'four', {}])
+
+    def test_chunked_decode(self):
+        values = list(yajl.iterload(self.stream, chunk_size=2))
+        self.assertEquals(values, [{'foo' : ['one', 'two', ['three', 'four']]},
+                [1, 2], 3, 'four', {}])
+
+    def test_lazy(self):
+        values = yajl.iterload(StringIO('[1] [2] [3'))
+        self.assertEquals(next(values), [1])
+        self.assertEquals(next(values), [2])
+        self.failUnlessRaises(ValueError, next, values)
+
+    def test_empty(self):
+        self.assertEquals(list(yajl.iterload(StringIO('  \n'))), [])
 
 
 class StreamEncodingTests(unittest.TestCase):
@@ -167,6 +268,43 @@ class StreamEncodingTests(unittest.TestCase):
         buffer = yajl.dump(obj, stream)
         self.assertEquals(stream.getvalue(), '{"foo":["one","two",["three","four"]]}')
 
+    def test_chunked_encode(self):
+        class Stream(object):
+            def __init__(self):
+                self.chunks = []
+            def write(self, chunk):
+                self.chunks.append(chunk)
+        obj = {'foo' : ['one', 'two', ['three', 'four']]}
+        stream = Stream()
+        yajl.dump(obj, stream, chunk_size=8)
+        self.assertTrue(len(stream.chunks) > 1)
+        self.assertEquals(''.join(stream.chunks), '{"foo":["one","two",["three","four"]]}')
+
+class IterEncodeTests(unittest.TestCase):
+    def test_iterencode(self):
+        obj = {'foo' : ['one', 'two', ['three', 'four', {}]], 'bar' : (1, None, True)}
+        chunks = list(yajl.Encoder().iterencode(obj, chunk_size=4))
+        self.assertTrue(len(chunks) > 1)
+        self.assertEquals(''.join(chunks), yajl.dumps(obj))
+
+    def test_generator(self):
+        rows = ({'row' : i} for i in range(1000))
+        chunks = yajl.Encoder().iterencode(rows, chunk_size=64)
+        self.assertEquals(yajl.loads(''.join(chunks)), [{'row' : i} for i in range(1000)])
+
+    def test_scalar(self):
+        self.assertEquals(list(yajl.Encoder().iterencode('foo')), ['"foo"'])
+
+    def test_default(self):
+        class MyEncode(yajl.Encoder):
+            def default(self, obj):
+                return ['foo']
+        self.assertEquals(''.join(MyEncode().iterencode([1, set()])), '[1,["foo"]]')
+
+    def test_error(self):
+        chunks = yajl.Encoder().iterencode([1, set()])
+        self.failUnlessRaises(TypeError, list, chunks)
+
 class DumpsOptionsTests(unittest.TestCase):
     def test_indent_four(self):
         rc = yajl.dumps({'foo' : 'bar'}, indent=4)
@@ -191,6 +329,700 @@ class DumpsOptionsTests(unittest.TestCase):
         rc = yajl.dumps({'foo' : 'bar'}, indent=None)
         self.assertEquals(rc, '{"foo":"bar"}')
 
+    def test_keyword_object(self):
+        self.assertEquals(yajl.dumps(object=[1], indent=None), '[1]')
+
+    def test_bad_arguments(self):
+        self.failUnlessRaises(TypeError, yajl.dumps)
+        self.failUnlessRaises(TypeError, yajl.dumps, [1], None, True, None, None, 1)
+        self.failUnlessRaises(TypeError, yajl.dumps, [1], spam=1)
+        self.failUnlessRaises(TypeError, yajl.dumps, [1], None, indent=None)
+
+class StringEncodeTests(unittest.TestCase):
+    def test_escapes(self):
+        self.assertEquals(yajl.dumps(u'a"b\\c\n\t\r\b\f\x01\x7f/'),
+                '"a\\"b\\\\c\\n\\t\\r\\b\\f\\u0001\\u007f/"')
+
+    def test_kinds(self):
+        self.assertEquals(yajl.dumps(u'caf\xe9'), '"caf\\u00e9"')
+        self.assertEquals(yajl.dumps(u'\u65e9 \u5b89'), '"\\u65e9 \\u5b89"')
+
+    def test_astral(self):
+        self.assertEquals(yajl.dumps(u'x\U0001f600y'), '"x\\ud83d\\ude00y"')
+        self.assertEquals(yajl.loads(yajl.dumps(u'\U0001f600')), u'\U0001f600')
+
+    def test_long_strings(self):
+        for ch in (u'a', u'\xe9', u'\u65e9', u'\U0001f600'):
+            value = (u'0123456789abcdef' * 600 + ch + u'"') * 3
+            self.assertEquals(yajl.loads(yajl.dumps(value)), value)
+            self.assertEquals(yajl.loads(yajl.dumps(value, ensure_ascii=False)), value)
+
+    def test_ensure_ascii_false(self):
+        value = u'caf\xe9 \u65e9 \U0001f600 "\n'
+        rc = yajl.dumps(value, ensure_ascii=False)
+        if not is_python3():
+            rc = rc.decode('utf-8')
+        self.assertEquals(rc, u'"caf\xe9 \u65e9 \U0001f600 \\"\\n"')
+        self.assertEquals(yajl.Encoder(ensure_ascii=False).encode([value]), '[%s]' % yajl.dumps(value, ensure_ascii=False))
+        self.assertEquals(yajl.dumps(value), yajl.Encoder().encode(value))
+
+    def test_ensure_ascii_false_dump(self):
+        stream = StringIO()
+        yajl.dump([u'\u65e9'], stream, ensure_ascii=False)
+        rc = stream.getvalue()
+        if not is_python3():
+            rc = rc.decode('utf-8')
+        self.assertEquals(rc, u'["\u65e9"]')
+
+    def test_lone_surrogate(self):
+        if is_python3():
+            self.assertEquals(yajl.dumps(u'\ud800', ensure_ascii=False), '"\\ud800"')
+
+class IntEncodeTests(unittest.TestCase):
+    def test_boundaries(self):
+        values = [0, 1, -1, 9, 10, 99, 100, -100, 12345678901,
+                2 ** 63 - 1, -2 ** 63, 2 ** 63, 2 ** 64 - 1]
+        self.assertEquals(yajl.dumps(values), '[%s]' % ','.join(str(v) for v in values))
+
+    def test_big(self):
+        values = [2 ** 64, -2 ** 63 - 1, 10 ** 40, -(10 ** 40) - 7]
+        self.assertEquals(yajl.dumps(values), '[%s]' % ','.join(str(v) for v in values))
+        self.assertEquals(yajl.loads(yajl.dumps(values)), values)
+
+    def test_subclass(self):
+        base = int if is_python3() else long
+        class Id(base):
+            def __str__(self):
+                return 'not a number'
+        self.assertEquals(yajl.dumps([Id(7), Id(2 ** 70)]), '[7,%d]' % 2 ** 70)
+        self.assertEquals(yajl.dumps([True, False]), '[true,false]')
+
+    def test_keys(self):
+        self.assertEquals(yajl.dumps({2 ** 70 : -12}), '{"%d":-12}' % 2 ** 70)
+
+class FloatEncodeTests(unittest.TestCase):
+    def test_repr_layout(self):
+        values = [0.0, -0.0, 1.0, -1.5, 0.1, 0.0001, 0.00001, 1e15, 1e16, 123456.789,
+                1e300, 2.5e-300, 5e-324, 1.7976931348623157e308, 2.2250738585072014e-308]
+        self.assertEquals(yajl.dumps(values), '[%s]' % ','.join(repr(v) for v in values))
+
+    def test_round_trip(self):
+        values = [0.1 + 0.2, 1 / 3.0, 2 / 3.0, 9007199254740993.0, 3.141592653589793]
+        self.assertEquals(yajl.loads(yajl.dumps(values)), values)
+
+    def test_float_precision(self):
+        self.assertEquals(yajl.dumps([1 / 3.0, 2.0, 1e20], float_precision=3),
+                '[0.333,2.0,1e+20]')
+        self.assertEquals(yajl.Encoder(float_precision=5).encode(3.14159265), '3.1416')
+        self.assertEquals(yajl.dumps(1 / 3.0), repr(1 / 3.0))
+        self.failUnlessRaises(ValueError, yajl.dumps, 1.0, float_precision=0)
+        self.failUnlessRaises(ValueError, yajl.dumps, 1.0, float_precision=18)
+
+    def test_non_finite(self):
+        self.failUnlessRaises(ValueError, yajl.dumps, [float('inf')])
+        self.failUnlessRaises(ValueError, yajl.dumps, float('nan'))
+
+class BytesOutputTests(unittest.TestCase):
+    def test_dumpb(self):
+        for value in ([1, 'a', {'b' : None}], u'caf\xe9', u'\U0001f600'):
+            rc = yajl.dumpb(value)
+            self.assertEquals(type(rc), bytes)
+            self.assertEquals(rc, yajl.dumps(value).encode('utf-8'))
+            self.assertEquals(hash(rc), hash(bytes(bytearray(rc))))
+        self.assertEquals(yajl.dumpb(u'\u65e9', ensure_ascii=False), u'"\u65e9"'.encode('utf-8'))
+        self.assertEquals(yajl.dumpb([1.5], indent=0), b'[\n1.5\n]\n')
+
+    def test_encode_bytes(self):
+        self.assertEquals(yajl.Encoder().encode_bytes({'a' : [1, 2]}), b'{"a":[1,2]}')
+
+    def test_non_ascii_bytes_value(self):
+        rc = yajl.dumps(u'caf\xe9'.encode('utf-8'))
+        if not is_python3():
+            rc = rc.decode('utf-8')
+        self.assertEquals(rc, u'"caf\xe9"')
+
+class ReusedStateTests(unittest.TestCase):
+    def test_after_error(self):
+        self.failUnlessRaises(ValueError, yajl.loads, '{"a" : [1, 2')
+        self.assertEquals(yajl.loads('{"a" : [1, 2]}'), {'a' : [1, 2]})
+        self.failUnlessRaises(TypeError, yajl.dumps, [1, {'a' : set()}])
+        self.assertEquals(yajl.dumps([1, {'a' : 2}]), '[1,{"a":2}]')
+        self.assertEquals(yajl.dumps([1], indent=0), '[\n1\n]\n')
+        self.assertEquals(yajl.dumps([1]), '[1]')
+
+    def test_reentrant_default(self):
+        class Nested(yajl.Encoder):
+            def default(self, obj):
+                return yajl.loads(yajl.dumps(sorted(obj)))
+        self.assertEquals(Nested().encode({'a' : set([2, 1])}), '{"a":[1,2]}')
+
+    def test_threads(self):
+        import threading
+        failures = []
+        def worker(n):
+            for i in range(200):
+                value = {'n' : n, 'i' : i, 'items' : list(range(i % 7))}
+                if yajl.loads(yajl.dumps(value)) != value:
+                    failures.append(value)
+        threads = [threading.Thread(target=worker, args=(n,)) for n in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEquals(failures, [])
+
+class ArrayDecodeTests(unittest.TestCase):
+    def test_exact_size(self):
+        value = yajl.loads(yajl.dumps(list(range(10000))))
+        self.assertEquals(value, list(range(10000)))
+        self.assertEquals(sys.getsizeof(value), sys.getsizeof([None] * 10000))
+
+    def test_nested(self):
+        value = [[], [1, [2, [3, {'a' : [4, 5]}]]], {'b' : [[6], 7]}, 8]
+        self.assertEquals(yajl.loads(yajl.dumps(value)), value)
+
+    def test_tuples(self):
+        decoder = yajl.Decoder(tuples=True)
+        self.assertEquals(decoder.decode('[1, [2, []], {"a" : [3]}]'),
+                (1, (2, ()), {'a' : (3,)}))
+        self.assertEquals(decoder.decode('[]'), ())
+        self.assertEquals(yajl.Decoder().decode('[1, [2]]'), [1, [2]])
+
+    def test_truncated(self):
+        self.failUnlessRaises(ValueError, yajl.loads, '[1, [2, [3, {"a" : [4')
+        self.assertEquals(yajl.loads('[1, [2]]'), [1, [2]])
+
+class DictDecodeTests(unittest.TestCase):
+    def test_wide(self):
+        value = dict(('field%d' % i, [i, {'n' : i}]) for i in range(80))
+        self.assertEquals(yajl.loads(yajl.dumps(value)), value)
+        self.assertEquals(yajl.loads(yajl.dumps([value, value])), [value, value])
+
+    def test_duplicate_keys(self):
+        self.assertEquals(yajl.loads('{"a" : 1, "b" : 2, "a" : 3}'), {'a' : 3, 'b' : 2})
+
+    def test_empty(self):
+        self.assertEquals(yajl.loads('{"a" : {}, "b" : [{}]}'), {'a' : {}, 'b' : [{}]})
+
+class TapeDecodeTests(unittest.TestCase):
+    ''' Documents long enough to be lexed with the GIL released '''
+    def setUp(self):
+        self.value = [{'id' : i, 'name' : 'user%d' % i, 'tags' : ['a', 'b\n'],
+                'nested' : {'x\t' : [i * 0.5, None, True, False, []]}, 'empty' : {}}
+                for i in range(1000)]
+        self.text = yajl.dumps(self.value)
+        self.failUnless(len(self.text) > 16384)
+
+    def test_roundtrip(self):
+        self.assertEquals(yajl.loads(self.text), self.value)
+        self.assertEquals(yajl.Decoder().decode(self.text), self.value)
+
+    def test_scalar_padding(self):
+        self.assertEquals(yajl.loads(' ' * 20000 + '12345'), 12345)
+        self.assertEquals(yajl.loads(yajl.dumps('x\u00e9\n' * 10000)), 'x\u00e9\n' * 10000)
+
+    def test_tuples(self):
+        value = yajl.Decoder(tuples=True).decode(self.text)
+        self.assertEquals(value[3]['nested']['x\t'], (1.5, None, True, False, ()))
+        self.assertEquals(len(value), 1000)
+
+    def test_errors(self):
+        self.failUnlessRaises(ValueError, yajl.loads, self.text[:-1])
+        self.assertEquals(yajl.loads(self.text), self.value)
+
+    def test_threads(self):
+        import threading
+        failures = []
+        def worker():
+            for i in range(5):
+                if yajl.loads(self.text) != self.value:
+                    failures.append(i)
+        threads = [threading.Thread(target=worker) for n in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEquals(failures, [])
+
+class LoadsManyTests(unittest.TestCase):
+    def test_order(self):
+        messages = [yajl.dumps({'i' : i, 'items' : list(range(i % 9)), 's' : 'a\nb' * (i % 3)})
+                for i in range(500)]
+        expected = [yajl.loads(m) for m in messages]
+        for threads in (0, 1, 3, 16):
+            self.assertEquals(yajl.loads_many(messages, threads=threads), expected)
+        self.assertEquals(yajl.loads_many(tuple(messages[:3])), expected[:3])
+
+    def test_pool(self):
+        # big enough to be spread over the pool, again and again
+        messages = [yajl.dumps({'i' : i, 'items' : list(range(500))}) for i in range(200)]
+        expected = [yajl.loads(m) for m in messages]
+        results = []
+        def decode():
+            for n in range(5):
+                results.append(yajl.loads_many(messages, threads=4) == expected)
+        workers = [threading.Thread(target=decode) for i in range(3)]
+        for worker in workers:
+            worker.start()
+        decode()
+        for worker in workers:
+            worker.join()
+        self.assertEquals(results, [True] * 20)
+
+    def test_types(self):
+        self.assertEquals(yajl.loads_many([b'[1]', u'"\u00e9"']), [[1], u'\u00e9'])
+        self.assertEquals(yajl.loads_many([]), [])
+        self.failUnlessRaises(ValueError, yajl.loads_many, [None])
+        self.failUnlessRaises(TypeError, yajl.loads_many, 1)
+
+    def test_errors(self):
+        try:
+            yajl.loads_many(['[1]', '{"a" :', '2'])
+            self.fail('no error raised')
+        except ValueError:
+            self.assertEquals(sys.exc_info()[1].index, 1)
+
+        results = yajl.loads_many(['[1', '', '3'], return_errors=True)
+        self.failUnless(isinstance(results[0], ValueError))
+        self.assertEquals(results[0].index, 0)
+        self.assertEquals(results[1].index, 1)
+        self.assertEquals(results[2], 3)
+
+class LazyTests(unittest.TestCase):
+    def setUp(self):
+        self.value = {'a' : [1, 2.5, {'b' : None, 'c' : [True, False]}],
+                'k\n' : 'v\u00e9', 'n' : -12345678901234567890}
+        self.lazy = yajl.loads_lazy(yajl.dumps(self.value))
+
+    def test_access(self):
+        self.failUnless(isinstance(self.lazy, yajl.LazyDict))
+        self.failUnless(isinstance(self.lazy['a'], yajl.LazyList))
+        self.assertEquals(self.lazy['a'][2]['c'][-1], False)
+        self.assertEquals(self.lazy['a'][0:3:2][0], 1)
+        self.assertEquals(self.lazy['k\n'], 'v\u00e9')
+        self.assertEquals(self.lazy['n'], -12345678901234567890)
+        self.assertEquals(len(self.lazy), 3)
+        self.assertEquals(len(self.lazy['a']), 3)
+        self.assertEquals(sorted(self.lazy.keys()), ['a', 'k\n', 'n'])
+        self.assertEquals(self.lazy.get('x', 5), 5)
+        self.failUnless('a' in self.lazy)
+        self.failUnlessRaises(KeyError, lambda: self.lazy['x'])
+        self.failUnlessRaises(IndexError, lambda: self.lazy['a'][3])
+
+    def test_cached(self):
+        self.failUnless(self.lazy['a'] is self.lazy['a'])
+        self.failUnless(self.lazy['a'][2] is self.lazy['a'][2])
+
+    def test_to_python(self):
+        self.assertEquals(self.lazy.to_python(), self.value)
+        self.assertEquals(type(self.lazy['a'].to_python()), list)
+        self.assertEquals(self.lazy, self.value)
+        self.assertEquals(dict(self.lazy.items())['n'], self.value['n'])
+
+    def test_unhashable_key(self):
+        self.failUnlessRaises(TypeError, lambda: self.lazy[[1]])
+        self.failUnlessRaises(TypeError, self.lazy.get, [1], 0)
+        self.failUnlessRaises(TypeError, lambda: [1] in self.lazy)
+        self.assertEquals(self.lazy.get('missing', 0), 0)
+        self.failUnlessRaises(KeyError, lambda: self.lazy['missing'])
+
+    def test_sequence_methods(self):
+        items = yajl.loads_lazy('[1, 2, [3], 2, {"a" : 1}]')
+        self.assertEquals(items.index(2), 1)
+        self.assertEquals(items.index(2, 2), 3)
+        self.assertEquals(items.index([3]), 2)
+        self.assertEquals(items.index({'a' : 1}, -1), 4)
+        self.failUnlessRaises(ValueError, items.index, 2, 0, 1)
+        self.failUnlessRaises(ValueError, items.index, 5)
+        self.assertEquals(items.count(2), 2)
+        self.assertEquals(items.count(7), 0)
+
+    def test_encode(self):
+        self.assertEquals(yajl.loads(yajl.dumps(self.lazy)), self.value)
+        self.assertEquals(yajl.dumps(self.lazy['a'][2]['c']), '[true,false]')
+        self.assertEquals(''.join(yajl.Encoder().iterencode([self.lazy['a']])),
+                yajl.dumps([self.value['a']]))
+
+    def test_documents(self):
+        self.assertEquals(yajl.loads_lazy('5'), 5)
+        self.assertEquals(yajl.loads_lazy('{"a" : 1, "a" : 2}')['a'], 2)
+        self.assertEquals(len(yajl.loads_lazy('{"a" : 1, "a" : 2}')), 1)
+        self.failUnlessRaises(ValueError, yajl.loads_lazy, '[1, ')
+        text = yajl.dumps([{'id' : i, 'tags' : ['x\ty'] * 3} for i in range(2000)])
+        lazy = yajl.loads_lazy(text)
+        self.assertEquals(lazy[1999]['tags'][2], 'x\ty')
+        self.assertEquals(lazy.to_python(), yajl.loads(text))
+
+class FieldsTests(unittest.TestCase):
+    def setUp(self):
+        self.value = {'user' : {'id' : 7, 'name' : 'x', 'tags' : [1, 2]},
+                'items' : [{'price' : 1.5, 'sku' : 'a'}, {'sku' : 'b'}, {'price' : [1, {'z' : 2}]}],
+                'other' : [[{}]], 'n' : None}
+        self.text = yajl.dumps(self.value)
+
+    def test_projection(self):
+        expected = {'user' : {'id' : 7}, 'items' : [{'price' : 1.5}, {}, {'price' : [1, {'z' : 2}]}]}
+        self.assertEquals(yajl.loads(self.text, fields=['user.id', 'items[*].price']), expected)
+        self.assertEquals(yajl.Decoder().decode(self.text, fields=('user.id', 'items[*].price')), expected)
+        self.assertEquals(yajl.loads(self.text, fields=['user', 'user.id', 'n']),
+                {'user' : self.value['user'], 'n' : None})
+        self.assertEquals(yajl.loads(self.text, fields=[]), {})
+        self.assertEquals(yajl.loads('[{"a" : 1, "b" : 2}, {"a" : 3}]', fields=['[*].a']),
+                [{'a' : 1}, {'a' : 3}])
+
+    def test_long_document(self):
+        value = dict(self.value, pad=['x' * 100] * 300)
+        self.assertEquals(yajl.loads(yajl.dumps(value), fields=['user.id', 'items[*].price']),
+                yajl.loads(self.text, fields=['user.id', 'items[*].price']))
+
+    def test_still_validated(self):
+        self.failUnlessRaises(ValueError, yajl.loads, '{"a" : 1, "b" : [1,}', fields=['a'])
+
+    def test_bad_fields(self):
+        for fields in (['a..b'], ['.a'], ['a.'], ['a[1]'], ['a[*]b'], ['']):
+            self.failUnlessRaises(ValueError, yajl.loads, self.text, fields=fields)
+        self.failUnlessRaises(TypeError, yajl.loads, self.text, fields='user.id')
+        self.failUnlessRaises(TypeError, yajl.loads, self.text, fields=[1])
+
+class BufferInputTests(unittest.TestCase):
+    def setUp(self):
+        self.value = {'a' : [1, 2.5, None], 'b' : {'c' : u'\u00e9'}}
+        self.data = yajl.dumps(self.value).encode('utf-8')
+
+    def test_buffers(self):
+        self.assertEquals(yajl.loads(bytearray(self.data)), self.value)
+        self.assertEquals(yajl.loads(memoryview(self.data)), self.value)
+        self.assertEquals(yajl.Decoder().decode(bytearray(self.data)), self.value)
+        self.assertEquals(yajl.loads(memoryview(b'[1, 2]xxx')[:6]), [1, 2])
+        self.assertEquals(yajl.loads_many([bytearray(b'[1]'), memoryview(b'2')]), [[1], 2])
+
+    def test_long_buffer(self):
+        value = [{'key%d' % i : [u'x' * 20] * 3} for i in range(1000)]
+        self.assertEquals(yajl.loads(bytearray(yajl.dumps(value).encode('utf-8'))), value)
+
+    def test_export_held(self):
+        data = bytearray(self.data)
+        lazy = yajl.loads_lazy(data)
+        self.failUnlessRaises(BufferError, data.extend, b' ')
+        self.assertEquals(lazy.to_python(), self.value)
+
+    def test_bad_buffers(self):
+        if is_python3():
+            self.failUnlessRaises(ValueError, yajl.loads, memoryview(b'[1, 2]')[::2])
+        self.failUnlessRaises(ValueError, yajl.loads, 1)
+
+    def test_str_in_place(self):
+        text = ' ' * 1000000 + '[1]'
+        self.assertEquals(yajl.loads(u'["\u00e9", 1]' + text), [u'\u00e9', 1])
+        if sys.version_info < (3, 4):
+            return
+        import tracemalloc
+        tracemalloc.start()
+        try:
+            self.assertEquals(yajl.loads(text), [1])
+            peak = tracemalloc.get_traced_memory()[1]
+        finally:
+            tracemalloc.stop()
+        self.failUnless(peak < len(text) // 2, peak)
+
+    def test_load_file(self):
+        import os
+        import tempfile
+        fd, path = tempfile.mkstemp()
+        try:
+            os.write(fd, self.data)
+            os.close(fd)
+            self.assertEquals(yajl.load_file(path), self.value)
+            open(path, 'w').close()
+            self.failUnlessRaises(ValueError, yajl.load_file, path)
+        finally:
+            os.unlink(path)
+        self.failUnlessRaises(IOError, yajl.load_file, path)
+
+    def test_load_pipe(self):
+        import os
+        if not os.path.isdir('/dev/fd'):
+            return
+        # a pipe has no size to map, so has to be read
+        value = [self.value] * 5000
+        data = yajl.dumps(value).encode('utf-8')
+        read, write = os.pipe()
+        def feed():
+            try:
+                os.write(write, data)
+            except OSError:
+                # the reading end went away early, the assertion says why
+                pass
+            os.close(write)
+        writer = threading.Thread(target=feed)
+        writer.start()
+        try:
+            self.assertEquals(yajl.load_file('/dev/fd/%d' % read), value)
+        finally:
+            # closed first, so a writer still blocked on a full pipe gets EPIPE
+            os.close(read)
+            writer.join()
+
+class SlicedInputTests(unittest.TestCase):
+    ''' Documents longer than a slice (16MB) are fed to yajl a slice at a time '''
+    slice = 1 << 24
+
+    def test_spanning_token(self):
+        # the string straddles the first slice boundary
+        text = '[' + ' ' * (self.slice - 4) + '"abcdef", 1.25]'
+        self.assertEquals(yajl.loads(text), ['abcdef', 1.25])
+        self.assertEquals(yajl.validate(text), True)
+        self.assertEquals(yajl.loads_lazy(text)[0], 'abcdef')
+
+    def test_progress(self):
+        text = '[' + ' ' * (2 * self.slice) + '1]'
+        calls = []
+        self.assertEquals(yajl.loads(text, progress=lambda done, total: calls.append((done, total))), [1])
+        self.assertEquals(calls, [(self.slice, len(text)), (2 * self.slice, len(text))])
+        calls = []
+        yajl.Decoder().decode('[1]', progress=lambda done, total: calls.append((done, total)))
+        self.assertEquals(calls, [])
+
+    def test_progress_raises(self):
+        def stop(done, total):
+            raise KeyboardInterrupt()
+        text = '[' + ' ' * self.slice + '1]'
+        self.failUnlessRaises(KeyboardInterrupt, yajl.loads, text, progress=stop)
+        self.failUnlessRaises(TypeError, yajl.loads, text, progress=1)
+        self.assertEquals(yajl.loads(text), [1])
+
+    def test_long_bytes_value(self):
+        value = b'x' * 1000 + b'"'
+        if is_python3():
+            self.assertEquals(yajl.dumps(value), '"' + 'x' * 1000 + '\\""')
+
+class ValidateTests(unittest.TestCase):
+    def test_valid(self):
+        self.failUnless(yajl.validate('{"a" : [1, 2.5, "x", null, true]}'))
+        self.failUnless(yajl.validate(b'["\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80"]'))
+        self.failUnless(yajl.validate(u'["\u00e9"]'))
+        self.assertEquals(yajl.validate(b'[1, 2]', offset=True), -1)
+
+    def test_invalid(self):
+        for text in ('{"a" : }', '[1, 2', '', 'nul'):
+            self.failIf(yajl.validate(text))
+        self.failUnless(yajl.validate('[1, 2 }', offset=True) in (6, 7))
+
+    def test_trailing_content(self):
+        self.assertEquals(yajl.validate('[1] x', offset=True), 4)
+        self.assertEquals(yajl.validate('1 2', offset=True), 2)
+        self.assertEquals(yajl.validate('{"a" : 1}{}', offset=True), 9)
+        self.failUnless(yajl.validate('[1] \r\n\t '))
+        self.failUnless(yajl.validate('  "x"\n'))
+
+    def test_comments(self):
+        self.failIf(yajl.validate('[1] // c'))
+        self.failIf(yajl.validate('[1, /* c */ 2]'))
+        self.failUnless(yajl.validate('[1] // c', allow_comments=True))
+        self.failUnless(yajl.validate('[1, /* c */ 2] /* d */\n', allow_comments=True))
+        self.assertEquals(yajl.validate('[1] /* c', offset=True, allow_comments=True), 4)
+        self.assertEquals(yajl.validate('[1] // c\n2', offset=True, allow_comments=True), 9)
+
+    def test_utf8(self):
+        for bad in (b'\xff', b'\xc0\xaf', b'\xe0\x80\xaf', b'\xed\xa0\x80',
+                b'\xf4\x90\x80\x80', b'\xc3', b'\xe2\x82'):
+            self.assertEquals(yajl.validate(b'["abc' + bad + b'"]', offset=True), 5)
+
+    def test_long_document(self):
+        text = yajl.dumps([{'key%d' % i : [u'\u00e9' * 30] * 3} for i in range(500)],
+                ensure_ascii=False)
+        self.failUnless(yajl.validate(text))
+        data = isinstance(text, bytes) and text or text.encode('utf-8')
+        self.failUnless(yajl.validate(data))
+        at = data.rfind(b'\xc3')
+        self.assertEquals(yajl.validate(data[:at] + b'\xff' + data[at:], offset=True), at)
+        self.failIf(yajl.validate(data[:-3]))
+
+    def test_bad_input(self):
+        self.failUnlessRaises(ValueError, yajl.validate, 1)
+
+class ArenaTests(unittest.TestCase):
+    def test_counters(self):
+        before = yajl.arena_stats()['documents']
+        for i in range(5):
+            self.assertEquals(yajl.loads('{"a" : [1, 2, {"b" : null}]}'), {'a' : [1, 2, {'b' : None}]})
+        stats = yajl.arena_stats()
+        self.assertEquals(stats['documents'], before + 5)
+        self.assertEquals(stats['in_use'], 0)
+        self.failUnless(stats['reserved'] > 0)
+        self.failUnless(stats['high_water'] >= stats['in_use'])
+
+    def test_large_document(self):
+        value = [{'key%d' % i : ['x' * (i % 50)] * 3} for i in range(5000)]
+        decoder = yajl.Decoder()
+        for i in range(2):
+            self.assertEquals(decoder.decode(yajl.dumps(value)), value)
+        self.assertEquals(decoder.arena_stats()['documents'], 2)
+
+class DepthTests(unittest.TestCase):
+    def nested(self, depth):
+        value = []
+        for i in range(depth - 1):
+            value = [value]
+        return value
+
+    def test_deep(self):
+        # deeper than yajl's own generator would go
+        self.assertEquals(yajl.dumps(self.nested(500)), '[' * 500 + ']' * 500)
+        value = {'a' : self.nested(300)}
+        self.assertEquals(yajl.dumps(value, indent=0).count('\n'), 603)
+
+    def test_iterencode_unbounded(self):
+        chunks = yajl.Encoder().iterencode(self.nested(5000))
+        self.assertEquals(''.join(chunks), '[' * 5000 + ']' * 5000)
+
+    def test_max_depth(self):
+        self.assertEquals(yajl.dumps(self.nested(3), max_depth=3), '[[[]]]')
+        self.failUnlessRaises(ValueError, yajl.dumps, self.nested(4), max_depth=3)
+        self.failUnlessRaises(ValueError, yajl.dumps, {'a' : {'b' : {}}}, max_depth=2)
+        self.failUnlessRaises(ValueError, yajl.Encoder(max_depth=1).encode, [[]])
+        self.failUnlessRaises(ValueError, yajl.dumps, [], max_depth=0)
+        self.failUnlessRaises(ValueError, yajl.dump, self.nested(4), StringIO(), max_depth=3)
+
+    def test_recursion(self):
+        self.failUnlessRaises(RuntimeError, yajl.dumps, self.nested(100000))
+
+class RegisterTests(unittest.TestCase):
+    class Point(object):
+        def __init__(self, x, y):
+            self.x, self.y = x, y
+
+    class Point3(Point):
+        pass
+
+    class Row(list):
+        pass
+
+    def test_register(self):
+        e = yajl.Encoder()
+        e.register(self.Point, lambda p: [p.x, p.y])
+        self.assertEquals(e.encode([self.Point(1, 2), self.Point(3, 4)]), '[[1,2],[3,4]]')
+        # subclasses are found through their MRO
+        self.assertEquals(e.encode({'p' : self.Point3(5, 6)}), '{"p":[5,6]}')
+        e.register(self.Point3, lambda p: {'x' : p.x})
+        self.assertEquals(e.encode(self.Point3(5, 6)), '{"x":5}')
+        self.assertEquals(e.encode(self.Point(5, 6)), '[5,6]')
+
+    def test_unregister(self):
+        e = yajl.Encoder()
+        e.register(self.Point, lambda p: p.x)
+        self.assertEquals(e.encode(self.Point3(1, 2)), '1')
+        e.register(self.Point, None)
+        self.failUnlessRaises(TypeError, e.encode, self.Point3(1, 2))
+        e.register(self.Point, None)
+
+    def test_before_default(self):
+        class Encoder(yajl.Encoder):
+            def default(self, obj):
+                return 'default'
+        e = Encoder()
+        e.register(self.Row, lambda r: len(r))
+        self.assertEquals(e.encode([self.Row([1, 2]), [1, 2], object()]), '[2,[1,2],"default"]')
+        self.assertEquals(''.join(e.iterencode([self.Row([1, 2])])), '[2]')
+
+    def test_bad_arguments(self):
+        e = yajl.Encoder()
+        self.failUnlessRaises(TypeError, e.register, self.Point(1, 2), str)
+        self.failUnlessRaises(TypeError, e.register, self.Point, 1)
+        e.register(self.Point, lambda p: 1 / 0)
+        self.failUnlessRaises(ZeroDivisionError, e.encode, [self.Point(1, 2)])
+
+    def test_builtins_refused(self):
+        e = yajl.Encoder()
+        for builtin in (dict, list, tuple, type(u''), int, float, bool, type(None)):
+            self.failUnlessRaises(TypeError, e.register, builtin, str)
+        e.register(self.Row, len)
+        self.assertEquals(e.encode(self.Row([1, 2])), '2')
+
+    def test_register_object(self):
+        e = yajl.Encoder()
+        e.register(object, lambda o: 'X')
+        self.assertEquals(e.encode(['abc', u'abc', self.Point(1, 2), 1]), '["abc","abc","X",1]')
+        if not is_python3():
+            self.failUnlessRaises(TypeError, e.register, str, len)
+
+    def test_reregister_while_encoding(self):
+        e = yajl.Encoder()
+        def handler(p):
+            e.register(self.Point, lambda p: 'replaced')
+            return 'first'
+        e.register(self.Point, handler)
+        self.assertEquals(e.encode([self.Point(1, 2), self.Point(1, 2)]), '["first","replaced"]')
+
+    def test_collected(self):
+        import gc
+        import weakref
+        class Encoder(yajl.Encoder):
+            def __init__(self):
+                yajl.Encoder.__init__(self)
+                self.register(RegisterTests.Point, self.point)
+            def point(self, p):
+                return p.x
+        e = Encoder()
+        self.assertEquals(e.encode(self.Point(1, 2)), '1')
+        ref = weakref.ref(e)
+        del e
+        gc.collect()
+        self.failUnless(ref() is None)
+
+    def test_cache_bounded(self):
+        import gc
+        import weakref
+        e = yajl.Encoder()
+        e.register(self.Point, lambda p: 0)
+        Dynamic = type('Dynamic', (self.Point,), {})
+        self.assertEquals(e.encode(Dynamic(1, 2)), '0')
+        ref = weakref.ref(Dynamic)
+        del Dynamic
+        for i in range(300):
+            e.encode(type('Other%d' % i, (self.Point,), {})(1, 2))
+        gc.collect()
+        self.failUnless(ref() is None)
+
+    def test_unserializable_item(self):
+        self.failUnlessRaises(TypeError, yajl.dumps, [object(), 1])
+        self.failUnlessRaises(TypeError, yajl.dumps, (1, object(), 2))
+
+class BufferEncodeTests(unittest.TestCase):
+    def setUp(self):
+        if not is_python3():
+            # array.array only has the old buffer interface
+            self.skipTest('needs the new buffer protocol')
+        import array
+        self.array = array.array
+
+    def test_arrays(self):
+        values = [1.5, -2.0, 0.1, 1e300, 0.0]
+        self.assertEquals(yajl.dumps(self.array('d', values)), yajl.dumps(values))
+        self.assertEquals(yajl.dumps({'v' : self.array('f', [0.5, 2])}), '{"v":[0.5,2.0]}')
+        self.assertEquals(yajl.dumps([self.array('i', [1, -2]), self.array('Q', [2 ** 64 - 1])]),
+                '[[1,-2],[18446744073709551615]]')
+        self.assertEquals(yajl.dumps(self.array('b')), '[]')
+        self.assertEquals(yajl.dumps(memoryview(bytes([1, 0])).cast('?')), '[true,false]')
+        values = [i * 0.37 for i in range(5000)]
+        self.assertEquals(yajl.loads(yajl.dumps(self.array('d', values))), values)
+
+    def test_memoryviews(self):
+        view = memoryview(self.array('h', range(6))).cast('B').cast('h', [2, 3])
+        self.assertEquals(yajl.dumps(view), '[[0,1,2],[3,4,5]]')
+        self.assertEquals(yajl.dumps(view[::-1]), '[[3,4,5],[0,1,2]]')
+        self.assertEquals(yajl.dumps(memoryview(b'ab')), '[97,98]')
+        self.assertEquals(yajl.dumps(b'ab'), '"ab"')
+        self.failUnlessRaises(TypeError, yajl.dumps, memoryview(b'ab').cast('c'))
+
+    def test_options(self):
+        values = self.array('d', [1.0 / 3, 2])
+        self.assertEquals(yajl.dumps(values, indent=1), yajl.dumps(values.tolist(), indent=1))
+        self.assertEquals(yajl.dumps(values, float_precision=3), '[0.333,2.0]')
+        self.assertEquals(''.join(yajl.Encoder().iterencode([values])), yajl.dumps([values]))
+        self.failUnlessRaises(ValueError, yajl.dumps, [[values]], max_depth=2)
+        self.failUnlessRaises(ValueError, yajl.dumps, self.array('d', [float('nan')]))
+
 class DumpOptionsTests(unittest.TestCase):
     stream = None
     def setUp(self):
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2010, R. Tyler Ballance <tyler@monkeypox.org>
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  1. Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ * 
+ *  2. Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in
+ *     the documentation and/or other materials provided with the
+ *     distribution.
+ * 
+ *  3. Neither the name of R. Tyler Ballance nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */ 
+
+/*
+ * 64 bit integer helpers shared by numparse.h and numformat.h
+ */
+
+#ifndef __PY_YAJL_WIDEINT_H__
+#define __PY_YAJL_WIDEINT_H__
+
+#include <Python.h>
+
+/* 64x64 -> 128 bit multiplication */
+Py_LOCAL_INLINE(void) py_yajl_mul128(unsigned long long a, unsigned long long b,
+        unsigned long long *high, unsigned long long *low)
+{
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = (unsigned __int128)(a) * b;
+    *high = (unsigned long long)(product >> 64);
+    *low = (unsigned long long)(product);
+#else
+    unsigned long long a_lo = a & 0xFFFFFFFFULL, a_hi = a >> 32;
+    unsigned long long b_lo = b & 0xFFFFFFFFULL, b_hi = b >> 32;
+    unsigned long long lo_lo = a_lo * b_lo;
+    unsigned long long hi_lo = a_hi * b_lo;
+    unsigned long long lo_hi = a_lo * b_hi;
+    unsigned long long hi_hi = a_hi * b_hi;
+    unsigned long long cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFFULL) + lo_hi;
+
+    *high = hi_hi + (hi_lo >> 32) + (cross >> 32);
+    *low = (cross << 32) | (lo_lo & 0xFFFFFFFFULL);
+#endif
+}
+
+Py_LOCAL_INLINE(int) py_yajl_clz64(unsigned long long value)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(value);
+#else
+    int count = 0;
+    while (!(value & 0x8000000000000000ULL)) {
+        value <<= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+#endif
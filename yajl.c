@@ -31,16 +31,43 @@
  */
 #include <Python.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "py_yajl.h"
 
 static PyMethodDef yajldecoder_methods[] = {
-    {"decode", (PyCFunction)(py_yajldecoder_decode), METH_VARARGS, NULL},
+    {"decode", (PyCFunction)(py_yajldecoder_decode), METH_VARARGS | METH_KEYWORDS,
+"decode(s [, fields=None, progress=None])\n\n\
+Returns a decoded object from the JSON string `s`, see `yajl.loads()`"},
+    {"arena_stats", (PyCFunction)(py_yajldecoder_arena_stats), METH_NOARGS,
+"arena_stats()\n\n\
+Returns a dict of counters for the memory pool backing this decoder's\n\
+parsers: bytes `reserved` from the system, bytes `in_use` by the current\n\
+document, the `high_water` mark of bytes in use and `documents` parsed"},
     {NULL}
 };
 
 static PyMethodDef yajlencoder_methods[] = {
     {"encode", (PyCFunction)(py_yajlencoder_encode), METH_VARARGS, NULL},
+    {"encode_bytes", (PyCFunction)(py_yajlencoder_encode_bytes), METH_VARARGS,
+"encode_bytes(obj)\n\n\
+Like encode(), but returns the UTF-8 encoded bytes of the JSON text"},
     {"default", (PyCFunction)(py_yajlencoder_default), METH_VARARGS, NULL},
+    {"iterencode", (PyCFunction)(py_yajlencoder_iterencode), METH_VARARGS | METH_KEYWORDS,
+"iterencode(obj [, chunk_size=65536])\n\n\
+Returns an iterator yielding the JSON encoding of `obj` in pieces of\n\
+roughly `chunk_size` bytes, only encoding as much as each piece needs"},
+    {"register", (PyCFunction)(py_yajlencoder_register), METH_VARARGS | METH_KEYWORDS,
+"register(type, fn)\n\n\
+Encodes instances of `type`, and of classes derived from it, as whatever\n\
+fn(instance) returns, before default() is consulted. The closest class\n\
+registered in a type's MRO wins; fn=None unregisters `type`. str, int,\n\
+float, bool, None, dict, list and tuple themselves (though not classes\n\
+derived from them) are always encoded natively, so raise TypeError"},
     {NULL}
 };
 
@@ -114,10 +141,10 @@ static PyTypeObject YajlEncoderType = {
     0,                         /*tp_getattro*/
     0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
-    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE,        /*tp_flags*/
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_BASETYPE|Py_TPFLAGS_HAVE_GC,        /*tp_flags*/
     "Yajl-based encoder",      /* tp_doc */
-    0,                     /* tp_traverse */
-    0,                     /* tp_clear */
+    (traverseproc)(yajlencoder_traverse),  /* tp_traverse */
+    (inquiry)(yajlencoder_clear),          /* tp_clear */
     0,                     /* tp_richcompare */
     0,                     /* tp_weaklistoffset */
     0,                     /* tp_iter */
@@ -134,54 +161,354 @@ static PyTypeObject YajlEncoderType = {
     0,                         /* tp_alloc */
 };
 
-static PyObject *py_loads(PYARGS)
+PyTypeObject YajlEncodeIteratorType = {
+#ifdef IS_PYTHON3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+#endif
+    "yajl.EncodeIterator",     /*tp_name*/
+    sizeof(_YajlEncodeIterator),   /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)yajlencodeiter_dealloc,    /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+#ifdef IS_PYTHON3
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+#else
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_ITER,        /*tp_flags*/
+#endif
+    "Iterator over the pieces of an encoded JSON document",    /* tp_doc */
+    0,                     /* tp_traverse */
+    0,                     /* tp_clear */
+    0,                     /* tp_richcompare */
+    0,                     /* tp_weaklistoffset */
+    PyObject_SelfIter,     /* tp_iter */
+    (iternextfunc)(yajlencodeiter_next),    /* tp_iternext */
+};
+
+static PyMethodDef yajllazylist_methods[] = {
+    {"index", (PyCFunction)(py_yajllazylist_index), METH_VARARGS,
+"index(value [, start [, stop]])\n\n\
+Returns the first index of `value`, raising ValueError if it's not there"},
+    {"count", (PyCFunction)(py_yajllazylist_count), METH_O,
+"count(value)\n\n\
+Returns the number of times `value` occurs in the list"},
+    {"to_python", (PyCFunction)(py_yajllazy_to_python), METH_NOARGS,
+"to_python()\n\n\
+Returns the whole list, with everything in it decoded"},
+    {NULL}
+};
+
+static PySequenceMethods yajllazylist_as_sequence = {
+    yajllazylist_length,       /* sq_length */
+    0,                         /* sq_concat */
+    0,                         /* sq_repeat */
+    yajllazylist_item,         /* sq_item */
+};
+
+static PyMappingMethods yajllazylist_as_mapping = {
+    yajllazylist_length,       /* mp_length */
+    yajllazylist_subscript,    /* mp_subscript */
+    0,                         /* mp_ass_subscript */
+};
+
+PyTypeObject YajlLazyListType = {
+#ifdef IS_PYTHON3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+#endif
+    "yajl.LazyList",           /*tp_name*/
+    sizeof(_YajlLazy),         /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)yajllazy_dealloc,          /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    yajllazy_repr,             /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &yajllazylist_as_sequence, /*tp_as_sequence*/
+    &yajllazylist_as_mapping,  /*tp_as_mapping*/
+    PyObject_HashNotImplemented,   /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+#ifdef IS_PYTHON3
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+#else
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_ITER|Py_TPFLAGS_HAVE_RICHCOMPARE,   /*tp_flags*/
+#endif
+    "Read-only list decoded as its items are accessed, see yajl.loads_lazy()",  /* tp_doc */
+    0,                     /* tp_traverse */
+    0,                     /* tp_clear */
+    yajllazy_richcompare,  /* tp_richcompare */
+    0,                     /* tp_weaklistoffset */
+    0,                     /* tp_iter */
+    0,                     /* tp_iternext */
+    yajllazylist_methods,  /* tp_methods */
+};
+
+static PyMethodDef yajllazydict_methods[] = {
+    {"get", (PyCFunction)(py_yajllazydict_get), METH_VARARGS, NULL},
+    {"keys", (PyCFunction)(py_yajllazydict_keys), METH_NOARGS, NULL},
+    {"values", (PyCFunction)(py_yajllazydict_values), METH_NOARGS, NULL},
+    {"items", (PyCFunction)(py_yajllazydict_items), METH_NOARGS, NULL},
+    {"to_python", (PyCFunction)(py_yajllazy_to_python), METH_NOARGS,
+"to_python()\n\n\
+Returns the whole dict, with everything in it decoded"},
+    {NULL}
+};
+
+static PySequenceMethods yajllazydict_as_sequence = {
+    0,                         /* sq_length */
+    0,                         /* sq_concat */
+    0,                         /* sq_repeat */
+    0,                         /* sq_item */
+    0,                         /* sq_slice */
+    0,                         /* sq_ass_item */
+    0,                         /* sq_ass_slice */
+    yajllazydict_contains,     /* sq_contains */
+};
+
+static PyMappingMethods yajllazydict_as_mapping = {
+    yajllazydict_length,       /* mp_length */
+    yajllazydict_subscript,    /* mp_subscript */
+    0,                         /* mp_ass_subscript */
+};
+
+PyTypeObject YajlLazyDictType = {
+#ifdef IS_PYTHON3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+#endif
+    "yajl.LazyDict",           /*tp_name*/
+    sizeof(_YajlLazy),         /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)yajllazy_dealloc,          /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    yajllazy_repr,             /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &yajllazydict_as_sequence, /*tp_as_sequence*/
+    &yajllazydict_as_mapping,  /*tp_as_mapping*/
+    PyObject_HashNotImplemented,   /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+#ifdef IS_PYTHON3
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+#else
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_ITER|Py_TPFLAGS_HAVE_RICHCOMPARE,   /*tp_flags*/
+#endif
+    "Read-only dict decoded as its values are accessed, see yajl.loads_lazy()",  /* tp_doc */
+    0,                     /* tp_traverse */
+    0,                     /* tp_clear */
+    yajllazy_richcompare,  /* tp_richcompare */
+    0,                     /* tp_weaklistoffset */
+    yajllazydict_iter,     /* tp_iter */
+    0,                     /* tp_iternext */
+    yajllazydict_methods,  /* tp_methods */
+};
+
+/*
+ * loads() and dumps() share one Decoder and one Encoder per thread, kept
+ * in the thread state dict, so that their parser stacks, key cache and
+ * generator are reset for each call rather than built up from scratch
+ */
+static PyObject *__thread_decoder = NULL;
+static PyObject *__thread_encoder = NULL;
+
+static PyObject *_thread_cached(PyObject **key, const char *name, PyTypeObject *type)
+{
+    PyObject *dict = PyThreadState_GetDict();
+    PyObject *cached = NULL;
+
+    if (*key == NULL) {
+        *key = PyUnicode_FromString(name);
+        if (*key == NULL) {
+            return NULL;
+        }
+    }
+
+    if (dict) {
+        cached = PyDict_GetItem(dict, *key);
+        if (cached) {
+            Py_INCREF(cached);
+            return cached;
+        }
+    }
+
+    cached = PyObject_CallObject((PyObject *)(type), NULL);
+    if ( (cached) && (dict) && (PyDict_SetItem(dict, *key, cached) < 0) ) {
+        PyErr_Clear();
+    }
+    return cached;
+}
+
+static PyObject *_thread_decoder(void)
+{
+    PyObject *decoder = _thread_cached(&__thread_decoder, "yajl.decoder", &YajlDecoderType);
+
+    /*
+     * loads() can be re-entered on the same thread from a finalizer run
+     * during a parse, that call gets a decoder of its own
+     */
+    if ( (decoder) && (((_YajlDecoder *)decoder)->parsing) ) {
+        Py_DECREF(decoder);
+        decoder = PyObject_CallObject((PyObject *)(&YajlDecoderType), NULL);
+    }
+    return decoder;
+}
+
+static PyObject *_internal_loads(PyObject *pybuffer, PyObject *fields, PyObject *progress)
 {
     PyObject *decoder = NULL;
     PyObject *result = NULL;
-    PyObject *pybuffer = NULL;
     char *buffer = NULL;
     Py_ssize_t buflen = 0;
 
-    if (!PyArg_ParseTuple(args, "O", &pybuffer))
+    if (!(pybuffer = _internal_input(pybuffer, &buffer, &buflen)))
         return NULL;
 
-    Py_INCREF(pybuffer);
-
-    if (PyUnicode_Check(pybuffer)) {
-        if (!(result = PyUnicode_AsUTF8String(pybuffer))) {
-            Py_DECREF(pybuffer);
-            return NULL;
-        }
+    decoder = _thread_decoder();
+    if (decoder == NULL) {
         Py_DECREF(pybuffer);
-        pybuffer = result;
-        result = NULL;
+        return NULL;
     }
 
-    if (PyString_Check(pybuffer)) {
-        if (PyString_AsStringAndSize(pybuffer, &buffer, &buflen)) {
-            Py_DECREF(pybuffer);
+    result = _internal_decode_fields(
+            (_YajlDecoder *)decoder, buffer, (size_t)(buflen), fields, progress);
+    Py_DECREF(pybuffer);
+    Py_XDECREF(decoder);
+    return result;
+}
+
+static PyObject *py_loads_many(PYARGS)
+{
+    PyObject *decoder = NULL;
+    PyObject *result = NULL;
+    PyObject *buffers = NULL;
+    PyObject *return_errors = NULL;
+    static char *kwlist[] = {"buffers", "threads", "return_errors", NULL};
+    int threads = 0, truth = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO:loads_many", kwlist,
+                &buffers, &threads, &return_errors)) {
+        return NULL;
+    }
+    if (return_errors) {
+        truth = PyObject_IsTrue(return_errors);
+        if (truth < 0)
             return NULL;
-        }
-    } else {
-        /* really seems like this should be a TypeError, but
-           tests/unit.py:ErrorCasesTests.test_None disagrees */
-        Py_DECREF(pybuffer);
-        PyErr_SetString(PyExc_ValueError, "string or unicode expected");
+    }
+
+    decoder = _thread_decoder();
+    if (decoder == NULL) {
         return NULL;
     }
+    result = _internal_decode_many((_YajlDecoder *)decoder, buffers, threads, truth);
+    Py_DECREF(decoder);
+    return result;
+}
+
+static PyObject *py_loads_lazy(PyObject *self, PyObject *pybuffer)
+{
+    PyObject *decoder = NULL;
+    PyObject *result = NULL;
+    char *buffer = NULL;
+    Py_ssize_t buflen = 0;
+
+    if (!(pybuffer = _internal_input(pybuffer, &buffer, &buflen)))
+        return NULL;
 
-    decoder = PyObject_Call((PyObject *)(&YajlDecoderType), NULL, NULL);
+    /* the document keeps the decoder, and its tape, to itself */
+    decoder = PyObject_CallObject((PyObject *)(&YajlDecoderType), NULL);
     if (decoder == NULL) {
+        Py_DECREF(pybuffer);
         return NULL;
     }
 
-    result = _internal_decode(
-            (_YajlDecoder *)decoder, buffer, (unsigned int)buflen);
+    result = _internal_decode_lazy(decoder, pybuffer, buffer, buflen);
     Py_DECREF(pybuffer);
-    Py_XDECREF(decoder);
+    Py_DECREF(decoder);
     return result;
 }
 
+static PyObject *py_validate(PYARGS)
+{
+    PyObject *decoder = NULL;
+    PyObject *pybuffer = NULL;
+    PyObject *want_offset = NULL;
+    PyObject *allow_comments = NULL;
+    static char *kwlist[] = {"s", "offset", "allow_comments", NULL};
+    char *buffer = NULL;
+    Py_ssize_t buflen = 0;
+    Py_ssize_t offset = -1;
+    int check_utf8, truth = 0, comments = 0, rc;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO:validate", kwlist,
+                &pybuffer, &want_offset, &allow_comments)) {
+        return NULL;
+    }
+    if (want_offset) {
+        truth = PyObject_IsTrue(want_offset);
+        if (truth < 0)
+            return NULL;
+    }
+    if (allow_comments) {
+        comments = PyObject_IsTrue(allow_comments);
+        if (comments < 0)
+            return NULL;
+    }
+
+    /* text comes to us already encoded, and so can't be malformed UTF-8 */
+    check_utf8 = !PyUnicode_Check(pybuffer);
+    if (!(pybuffer = _internal_input(pybuffer, &buffer, &buflen)))
+        return NULL;
+
+    decoder = _thread_decoder();
+    if (decoder == NULL) {
+        Py_DECREF(pybuffer);
+        return NULL;
+    }
+
+    rc = _internal_validate((_YajlDecoder *)decoder, buffer, (size_t)(buflen),
+            check_utf8, comments, &offset);
+    Py_DECREF(pybuffer);
+    Py_DECREF(decoder);
+    if (rc != success)
+        return NULL;
+
+    if (truth) {
+        return PyLong_FromSsize_t(offset);
+    }
+    return PyBool_FromLong(offset < 0);
+}
+
 static char *__config_gen_config(PyObject *indent, yajl_gen_config *config)
 {
     long indentLevel = -1;
@@ -219,17 +546,63 @@ static char *__config_gen_config(PyObject *indent, yajl_gen_config *config)
     return spaces;
 }
 
-static PyObject *py_dumps(PYARGS)
+/*
+ * The per-call options of dumps() and dump(), which are swapped onto the
+ * encoder doing the work for the length of the call
+ */
+typedef struct {
+    unsigned int utf8;
+    int float_precision;
+    unsigned int max_depth;
+} _YajlEncodeOptions;
+
+static int __config_options(PyObject *ensure_ascii, PyObject *float_precision,
+        PyObject *max_depth, _YajlEncodeOptions *options)
+{
+    long depth;
+    int truth = 1;
+
+    if ( (ensure_ascii) && (ensure_ascii != Py_True) ) {
+        truth = PyObject_IsTrue(ensure_ascii);
+        if (truth < 0)
+            return failure;
+    }
+    options->utf8 = !truth;
+
+    options->float_precision = _config_float_precision(float_precision);
+    if (options->float_precision < 0)
+        return failure;
+
+    depth = _config_max_depth(max_depth);
+    if (depth < 0)
+        return failure;
+    options->max_depth = (unsigned int)(depth);
+    return success;
+}
+
+static void __swap_options(_YajlEncoder *encoder, _YajlEncodeOptions *options)
+{
+    _YajlEncodeOptions previous;
+
+    previous.utf8 = encoder->utf8;
+    previous.float_precision = encoder->float_precision;
+    previous.max_depth = encoder->max_depth;
+    encoder->utf8 = options->utf8;
+    encoder->float_precision = options->float_precision;
+    encoder->max_depth = options->max_depth;
+    *options = previous;
+}
+
+static PyObject *_internal_dumps(PyObject *obj, PyObject *indent, PyObject *ensure_ascii,
+        PyObject *float_precision, PyObject *max_depth, int as_bytes)
 {
     PyObject *encoder = NULL;
-    PyObject *obj = NULL;
     PyObject *result = NULL;
-    PyObject *indent = NULL;
     yajl_gen_config config = { 0, NULL };
-    static char *kwlist[] = {"object", "indent", NULL};
+    _YajlEncodeOptions options;
     char *spaces = NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O", kwlist, &obj, &indent)) {
+    if (__config_options(ensure_ascii, float_precision, max_depth, &options) == failure) {
         return NULL;
     }
 
@@ -238,69 +611,445 @@ static PyObject *py_dumps(PYARGS)
         return NULL;
     }
 
-    encoder = PyObject_Call((PyObject *)(&YajlEncoderType), NULL, NULL);
-    if (encoder == NULL) {
-        return NULL;
+    encoder = _thread_cached(&__thread_encoder, "yajl.encoder", &YajlEncoderType);
+    if (encoder != NULL) {
+        /* and back again, for an enclosing dumps() on this thread */
+        __swap_options((_YajlEncoder *)encoder, &options);
+        if (as_bytes) {
+            result = _internal_encode_bytes((_YajlEncoder *)encoder, obj, config);
+        } else {
+            result = _internal_encode((_YajlEncoder *)encoder, obj, config);
+        }
+        __swap_options((_YajlEncoder *)encoder, &options);
+        Py_DECREF(encoder);
     }
-
-    result = _internal_encode((_YajlEncoder *)encoder, obj, config);
-    Py_XDECREF(encoder);
     if (spaces) {
         free(spaces);
     }
     return result;
 }
 
+#ifdef PY_YAJL_FASTCALL
+/*
+ * Sorts the arguments of a METH_FASTCALL | METH_KEYWORDS call into
+ * `values` (which should start out NULL) by their position in `kwlist`,
+ * the first `required` of them have to be given
+ */
+static int _fastcall_args(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+        PyObject *kwnames, char **kwlist, Py_ssize_t required, PyObject **values)
+{
+    Py_ssize_t count = 0;
+    Py_ssize_t i, j;
+
+    while (kwlist[count]) {
+        count++;
+    }
+
+    if (nargs > count) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd arguments (%zd given)",
+                fname, count, nargs);
+        return failure;
+    }
+    for (i = 0; i < nargs; i++) {
+        values[i] = args[i];
+    }
+
+    if (kwnames) {
+        for (i = 0; i < PyTuple_GET_SIZE(kwnames); i++) {
+            PyObject *name = PyTuple_GET_ITEM(kwnames, i);
+
+            for (j = 0; j < count; j++) {
+                if (PyUnicode_CompareWithASCIIString(name, kwlist[j]) == 0) {
+                    break;
+                }
+            }
+            if (j == count) {
+                PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'",
+                        fname, name);
+                return failure;
+            }
+            if (values[j]) {
+                PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'",
+                        fname, kwlist[j]);
+                return failure;
+            }
+            values[j] = args[nargs + i];
+        }
+    }
+
+    for (i = 0; i < required; i++) {
+        if (!values[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'",
+                    fname, kwlist[i]);
+            return failure;
+        }
+    }
+    return success;
+}
+
+static PyObject *_fastcall_dumps(const char *fname, PyObject *const *args, Py_ssize_t nargs,
+        PyObject *kwnames, int as_bytes)
+{
+    static char *kwlist[] = {"object", "indent", "ensure_ascii", "float_precision",
+        "max_depth", NULL};
+    PyObject *values[5] = { NULL, NULL, NULL, NULL, NULL };
+
+    if (_fastcall_args(fname, args, nargs, kwnames, kwlist, 1, values) == failure) {
+        return NULL;
+    }
+    return _internal_dumps(values[0], values[1], values[2], values[3], values[4], as_bytes);
+}
+
+static PyObject *py_dumps(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+        PyObject *kwnames)
+{
+    return _fastcall_dumps("dumps", args, nargs, kwnames, 0);
+}
+
+static PyObject *py_dumpb(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+        PyObject *kwnames)
+{
+    return _fastcall_dumps("dumpb", args, nargs, kwnames, 1);
+}
+
+static PyObject *py_loads(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+        PyObject *kwnames)
+{
+    static char *kwlist[] = {"s", "fields", "progress", NULL};
+    PyObject *values[3] = { NULL, NULL, NULL };
+
+    /* the usual case, a single positional argument */
+    if ( (nargs == 1) && (kwnames == NULL) ) {
+        return _internal_loads(args[0], NULL, NULL);
+    }
+    if (_fastcall_args("loads", args, nargs, kwnames, kwlist, 1, values) == failure) {
+        return NULL;
+    }
+    return _internal_loads(values[0], values[1], values[2]);
+}
+#else
+static PyObject *_varargs_dumps(PyObject *args, PyObject *kwargs, const char *format,
+        int as_bytes)
+{
+    PyObject *obj = NULL;
+    PyObject *indent = NULL;
+    PyObject *ensure_ascii = NULL;
+    PyObject *float_precision = NULL;
+    PyObject *max_depth = NULL;
+    static char *kwlist[] = {"object", "indent", "ensure_ascii", "float_precision",
+        "max_depth", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, format, kwlist, &obj, &indent,
+                &ensure_ascii, &float_precision, &max_depth)) {
+        return NULL;
+    }
+    return _internal_dumps(obj, indent, ensure_ascii, float_precision, max_depth, as_bytes);
+}
+
+static PyObject *py_dumps(PYARGS)
+{
+    return _varargs_dumps(args, kwargs, "O|OOOO:dumps", 0);
+}
+
+static PyObject *py_dumpb(PYARGS)
+{
+    return _varargs_dumps(args, kwargs, "O|OOOO:dumpb", 1);
+}
+
+static PyObject *py_loads(PYARGS)
+{
+    PyObject *pybuffer = NULL;
+    PyObject *fields = NULL;
+    PyObject *progress = NULL;
+    static char *kwlist[] = {"s", "fields", "progress", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO:loads", kwlist, &pybuffer,
+                &fields, &progress)) {
+        return NULL;
+    }
+    return _internal_loads(pybuffer, fields, progress);
+}
+#endif
+
+/*
+ * State for pulling JSON values out of a stream one chunk at a time,
+ * shared by load() and the iterator handed back by iterload()
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *decoder;
+    PyObject *stream;
+    PyObject *buffer;       /* bytearray reused by readinto() */
+    PyObject *readsize;     /* argument to read() otherwise */
+    PyObject *chunk;        /* keeps `data` alive for read() streams */
+    char *data;
+    Py_ssize_t length;
+    Py_ssize_t offset;      /* how much of `data` yajl has consumed */
+    yajl_handle parser;
+    unsigned int started;   /* has the current value seen any input? */
+    unsigned int eof;
+} _YajlStreamLoader;
+
 static PyObject *__read = NULL;
-static PyObject *_internal_stream_load(PyObject *args, unsigned int blocking)
+static PyObject *__readinto = NULL;
+
+static int _loader_read(_YajlStreamLoader *self)
 {
-    PyObject *decoder = NULL;
-    PyObject *stream = NULL;
-    PyObject *buffer = NULL;
+    PyObject *chunk = NULL;
+
+    Py_CLEAR(self->chunk);
+    self->data = NULL;
+    self->length = 0;
+    self->offset = 0;
+
+    if (self->buffer) {
+        chunk = PyObject_CallMethodObjArgs(self->stream, __readinto, self->buffer, NULL);
+        if (chunk == NULL) {
+            return failure;
+        }
+        if (chunk != Py_None) {
+            self->length = PyNumber_AsSsize_t(chunk, PyExc_OverflowError);
+        }
+        Py_DECREF(chunk);
+        if ( (self->length == -1) && (PyErr_Occurred()) ) {
+            return failure;
+        }
+        if (self->length > PyByteArray_GET_SIZE(self->buffer)) {
+            PyErr_SetObject(PyExc_ValueError,
+                    PyUnicode_FromString("`readinto()` returned more bytes than requested"));
+            return failure;
+        }
+        self->data = PyByteArray_AS_STRING(self->buffer);
+    } else {
+        chunk = PyObject_CallMethodObjArgs(self->stream, __read, self->readsize, NULL);
+        if (chunk == NULL) {
+            return failure;
+        }
+        if (PyUnicode_Check(chunk)) {
+            PyObject *encoded = PyUnicode_AsUTF8String(chunk);
+            Py_DECREF(chunk);
+            if (encoded == NULL) {
+                return failure;
+            }
+            chunk = encoded;
+        }
+        if (PyString_Check(chunk)) {
+            PyString_AsStringAndSize(chunk, &self->data, &self->length);
+        } else if (chunk != Py_None) {
+            Py_DECREF(chunk);
+            PyErr_SetObject(PyExc_TypeError,
+                    PyUnicode_FromString("`read()` must return a string"));
+            return failure;
+        }
+        self->chunk = chunk;
+    }
+
+    /* An empty read means we've hit the end of the stream */
+    if (self->length <= 0) {
+        self->eof = 1;
+    }
+    return success;
+}
+
+/*
+ * Returns the next value decoded from the stream, or NULL without an
+ * exception set once the stream is exhausted
+ */
+static PyObject *_loader_next(_YajlStreamLoader *self)
+{
+    yajl_handle parser = NULL;
+    yajl_status yrc = yajl_status_insufficient_data;
     PyObject *result = NULL;
+
+    if (self->parser == NULL) {
+        self->parser = _internal_decode_start((_YajlDecoder *)self->decoder);
+        if (self->parser == NULL) {
+            return PyErr_NoMemory();
+        }
+        self->started = 0;
+    }
+
+    for (;;) {
+        if (self->offset >= self->length) {
+            if (self->eof) {
+                break;
+            }
+            if (_loader_read(self) == failure) {
+                goto error;
+            }
+            continue;
+        }
+
+        if (!self->started) {
+            /* Skip the whitespace separating top-level values */
+            while (self->offset < self->length) {
+                switch (self->data[self->offset]) {
+                    case ' ': case '\t': case '\n': case '\r': case '\f': case '\v':
+                        self->offset++;
+                        continue;
+                }
+                break;
+            }
+            if (self->offset >= self->length) {
+                continue;
+            }
+            self->started = 1;
+        }
+
+        yrc = yajl_parse(self->parser,
+                (const unsigned char *)(self->data + self->offset),
+                (unsigned int)(self->length - self->offset));
+
+        if (yrc == yajl_status_insufficient_data) {
+            self->offset = self->length;
+            continue;
+        }
+        if (yrc == yajl_status_ok) {
+            /* Anything past the end of this value belongs to the next one */
+            self->offset += yajl_get_bytes_consumed(self->parser);
+        }
+        break;
+    }
+
+    if (!self->started) {
+        /* Nothing but whitespace left, we're done */
+        yajl_free(self->parser);
+        self->parser = NULL;
+        return NULL;
+    }
+
+    parser = self->parser;
+    self->parser = NULL;
+    result = _internal_decode_finish((_YajlDecoder *)self->decoder, parser, yrc);
+    if (result == NULL) {
+        goto error;
+    }
+    return result;
+
+error:
+    /* Don't try to resynchronize after a bad value, just stop */
+    self->eof = 1;
+    self->offset = self->length;
+    return NULL;
+}
+
+static void _loader_dealloc(_YajlStreamLoader *self)
+{
+    if (self->parser) {
+        yajl_free(self->parser);
+    }
+    Py_XDECREF(self->decoder);
+    Py_XDECREF(self->stream);
+    Py_XDECREF(self->buffer);
+    Py_XDECREF(self->readsize);
+    Py_XDECREF(self->chunk);
+    PyObject_Del(self);
+}
+
+static PyTypeObject YajlStreamLoaderType = {
 #ifdef IS_PYTHON3
-    PyObject *bufferstring = NULL;
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
 #endif
+    "yajl.StreamLoader",       /*tp_name*/
+    sizeof(_YajlStreamLoader), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)_loader_dealloc,           /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+#ifdef IS_PYTHON3
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+#else
+    Py_TPFLAGS_DEFAULT|Py_TPFLAGS_HAVE_ITER,        /*tp_flags*/
+#endif
+    "Iterator over the JSON values in a stream",    /* tp_doc */
+    0,                     /* tp_traverse */
+    0,                     /* tp_clear */
+    0,                     /* tp_richcompare */
+    0,                     /* tp_weaklistoffset */
+    PyObject_SelfIter,     /* tp_iter */
+    (iternextfunc)(_loader_next),   /* tp_iternext */
+};
+
+static _YajlStreamLoader *_internal_stream_loader(PyObject *args, PyObject *kwargs)
+{
+    _YajlStreamLoader *loader = NULL;
+    PyObject *stream = NULL;
+    Py_ssize_t chunksize = PY_YAJL_READ_SZ;
+    static char *kwlist[] = {"fp", "chunk_size", NULL};
 
-    if (!PyArg_ParseTuple(args, "O", &stream)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|n", kwlist, &stream, &chunksize)) {
         goto bad_type;
     }
 
+    if (chunksize <= 0) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("`chunk_size` must be a positive integer"));
+        return NULL;
+    }
+
     if (__read == NULL) {
         __read = PyUnicode_FromString("read");
     }
+    if (__readinto == NULL) {
+        __readinto = PyUnicode_FromString("readinto");
+    }
 
     if (!PyObject_HasAttr(stream, __read)) {
         goto bad_type;
     }
 
-    buffer = PyObject_CallMethodObjArgs(stream, __read, NULL);
-
-    if (!buffer)
+    loader = PyObject_New(_YajlStreamLoader, &YajlStreamLoaderType);
+    if (loader == NULL) {
         return NULL;
+    }
+    loader->decoder = NULL;
+    loader->stream = stream;
+    Py_INCREF(stream);
+    loader->buffer = NULL;
+    loader->readsize = NULL;
+    loader->chunk = NULL;
+    loader->data = NULL;
+    loader->length = 0;
+    loader->offset = 0;
+    loader->parser = NULL;
+    loader->started = 0;
+    loader->eof = 0;
 
-#ifdef IS_PYTHON3
-    bufferstring = PyUnicode_AsUTF8String(buffer);
-    if (!bufferstring)
+    /*
+     * Binary streams let us read every chunk into the same buffer rather
+     * than allocating a new string for each read() call
+     */
+    if (PyObject_HasAttr(stream, __readinto)) {
+        loader->buffer = PyByteArray_FromStringAndSize(NULL, chunksize);
+    } else {
+        loader->readsize = PyLong_FromSsize_t(chunksize);
+    }
+    if ( (loader->buffer == NULL) && (loader->readsize == NULL) ) {
+        Py_DECREF(loader);
         return NULL;
-#endif
+    }
 
-    decoder = PyObject_Call((PyObject *)(&YajlDecoderType), NULL, NULL);
-    if (decoder == NULL) {
+    loader->decoder = PyObject_CallObject((PyObject *)(&YajlDecoderType), NULL);
+    if (loader->decoder == NULL) {
+        Py_DECREF(loader);
         return NULL;
     }
-
-#ifdef IS_PYTHON3
-    result = _internal_decode((_YajlDecoder *)decoder, PyBytes_AsString(bufferstring),
-                PyBytes_Size(bufferstring));
-    Py_XDECREF(bufferstring);
-#else
-    result = _internal_decode((_YajlDecoder *)decoder, PyString_AsString(buffer),
-                  PyString_Size(buffer));
-#endif
-    Py_XDECREF(decoder);
-    Py_XDECREF(buffer);
-    return result;
+    return loader;
 
 bad_type:
     PyErr_SetObject(PyExc_TypeError, PyUnicode_FromString("Must pass a single stream object"));
@@ -309,19 +1058,147 @@ bad_type:
 
 static PyObject *py_load(PYARGS)
 {
-    return _internal_stream_load(args, 1);
+    _YajlStreamLoader *loader = _internal_stream_loader(args, kwargs);
+    PyObject *result = NULL;
+
+    if (loader == NULL) {
+        return NULL;
+    }
+
+    result = _loader_next(loader);
+    if ( (result == NULL) && (!PyErr_Occurred()) ) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString(yajl_status_to_string(yajl_status_insufficient_data)));
+    }
+    Py_DECREF(loader);
+    return result;
+}
+
+/*
+ * Reads whatever's left of `fd` into a malloc()ed buffer, for files whose
+ * size isn't known up front (pipes, /proc entries), NULL with errno set if
+ * it couldn't be read
+ */
+static char *_read_fd(int fd, size_t *length)
+{
+    size_t size = PY_YAJL_READ_SZ, used = 0;
+    char *buffer = (char *)(malloc(size));
+    char *grown = NULL;
+    ssize_t got;
+
+    while (buffer) {
+        if (used == size) {
+            if (!(grown = (char *)(realloc(buffer, size * 2))))
+                break;
+            buffer = grown;
+            size *= 2;
+        }
+        got = read(fd, buffer + used, size - used);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buffer);
+            return NULL;
+        }
+        if (got == 0) {
+            *length = used;
+            return buffer;
+        }
+        used += (size_t)(got);
+    }
+    free(buffer);
+    errno = ENOMEM;
+    return NULL;
+}
+
+static PyObject *py_load_file(PYARGS)
+{
+    PyObject *decoder = NULL;
+    PyObject *result = NULL;
+    PyObject *progress = NULL;
+    static char *kwlist[] = {"path", "progress", NULL};
+    const char *path = NULL;
+    void *map = MAP_FAILED;
+    char *buffer = NULL;
+    size_t length = 0;
+    struct stat st;
+    int fd = -1, failed = 0;
+#ifdef IS_PYTHON3
+    PyObject *pypath = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|O:load_file", kwlist,
+                PyUnicode_FSConverter, &pypath, &progress))
+        return NULL;
+    path = PyBytes_AS_STRING(pypath);
+#else
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|O:load_file", kwlist,
+                &path, &progress))
+        return NULL;
+#endif
+
+    memset(&st, 0, sizeof(st));
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(path, O_RDONLY);
+    if ( (fd < 0) || (fstat(fd, &st) != 0) ) {
+        failed = 1;
+    }
+    else if ( (S_ISREG(st.st_mode)) && (st.st_size > 0) ) {
+        length = (size_t)(st.st_size);
+        map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            failed = 1;
+#ifdef MADV_SEQUENTIAL
+        else
+            madvise(map, length, MADV_SEQUENTIAL);
+#endif
+    }
+    else {
+        /* no size to map, so the file is read until it runs out */
+        if (!(buffer = _read_fd(fd, &length)))
+            failed = 1;
+    }
+    Py_END_ALLOW_THREADS
+
+    if (failed) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+        goto done;
+    }
+    if (length == 0) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("Cannot parse an empty buffer"));
+        goto done;
+    }
+
+    decoder = _thread_decoder();
+    if (decoder == NULL)
+        goto done;
+    result = _internal_decode_fields((_YajlDecoder *)decoder,
+            (map != MAP_FAILED) ? (char *)(map) : buffer, length, NULL, progress);
+    Py_DECREF(decoder);
+
+done:
+    if (map != MAP_FAILED)
+        munmap(map, length);
+    free(buffer);
+    if (fd >= 0)
+        close(fd);
+#ifdef IS_PYTHON3
+    Py_DECREF(pypath);
+#endif
+    return result;
 }
+
 static PyObject *py_iterload(PYARGS)
 {
-    return _internal_stream_load(args, 0);
+    return (PyObject *)(_internal_stream_loader(args, kwargs));
 }
 
 static PyObject *__write = NULL;
-static PyObject *_internal_stream_dump(PyObject *object, PyObject *stream, unsigned int blocking,
-            yajl_gen_config config)
+static PyObject *_internal_stream_dump(PyObject *object, PyObject *stream, Py_ssize_t chunksize,
+            yajl_gen_config config, _YajlEncodeOptions *options)
 {
     PyObject *encoder = NULL;
-    PyObject *buffer = NULL;
+    PyObject *result = NULL;
 
     if (__write == NULL) {
         __write = PyUnicode_FromString("write");
@@ -331,15 +1208,16 @@ static PyObject *_internal_stream_dump(PyObject *object, PyObject *stream, unsig
         goto bad_type;
     }
 
-    encoder = PyObject_Call((PyObject *)(&YajlEncoderType), NULL, NULL);
+    encoder = PyObject_CallObject((PyObject *)(&YajlEncoderType), NULL);
     if (encoder == NULL) {
         return NULL;
     }
+    __swap_options((_YajlEncoder *)encoder, options);
 
-    buffer = _internal_encode((_YajlEncoder *)encoder, object, config);
-    PyObject_CallMethodObjArgs(stream, __write, buffer, NULL);
+    result = _internal_stream_encode((_YajlEncoder *)encoder, object, config,
+            stream, (size_t)(chunksize));
     Py_XDECREF(encoder);
-    return Py_True;
+    return result;
 
 bad_type:
     PyErr_SetObject(PyExc_TypeError, PyUnicode_FromString("Must pass a stream object"));
@@ -352,11 +1230,28 @@ static PyObject *py_dump(PYARGS)
     PyObject *indent = NULL;
     PyObject *stream = NULL;
     PyObject *result = NULL;
+    PyObject *ensure_ascii = NULL;
+    PyObject *float_precision = NULL;
+    PyObject *max_depth = NULL;
+    Py_ssize_t chunksize = PY_YAJL_FLUSH_SZ;
     yajl_gen_config config = { 0, NULL };
-    static char *kwlist[] = {"object", "stream", "indent", NULL};
+    _YajlEncodeOptions options;
+    static char *kwlist[] = {"object", "stream", "indent", "chunk_size", "ensure_ascii",
+        "float_precision", "max_depth", NULL};
     char *spaces = NULL;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O", kwlist, &object, &stream, &indent)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OnOOO", kwlist, &object, &stream,
+                &indent, &chunksize, &ensure_ascii, &float_precision, &max_depth)) {
+        return NULL;
+    }
+
+    if (__config_options(ensure_ascii, float_precision, max_depth, &options) == failure) {
+        return NULL;
+    }
+
+    if (chunksize <= 0) {
+        PyErr_SetObject(PyExc_ValueError,
+                PyUnicode_FromString("`chunk_size` must be a positive integer"));
         return NULL;
     }
 
@@ -364,13 +1259,26 @@ static PyObject *py_dump(PYARGS)
     if (PyErr_Occurred()) {
         return NULL;
     }
-    result = _internal_stream_dump(object, stream, 0, config);
+    result = _internal_stream_dump(object, stream, chunksize, config, &options);
     if (spaces) {
         free(spaces);
     }
     return result;
 }
 
+static PyObject *py_arena_stats(PYARGS)
+{
+    PyObject *decoder = _thread_cached(&__thread_decoder, "yajl.decoder", &YajlDecoderType);
+    PyObject *result = NULL;
+
+    if (decoder == NULL) {
+        return NULL;
+    }
+    result = py_yajldecoder_arena_stats(decoder, NULL, NULL);
+    Py_DECREF(decoder);
+    return result;
+}
+
 static PyObject *py_monkeypatch(PYARGS)
 {
     PyObject *sys = PyImport_ImportModule("sys");
@@ -378,7 +1286,7 @@ static PyObject *py_monkeypatch(PYARGS)
     PyObject *yajl = PyDict_GetItemString(modules, "yajl");
 
     if (!yajl) {
-        return Py_False;
+        Py_RETURN_FALSE;
     }
 
     PyDict_SetItemString(modules, "json_old", PyDict_GetItemString(modules, "json"));
@@ -386,28 +1294,82 @@ static PyObject *py_monkeypatch(PYARGS)
 
     Py_XDECREF(sys);
     Py_XDECREF(modules);
-    return Py_True;
+    Py_RETURN_TRUE;
 }
 
 static struct PyMethodDef yajl_methods[] = {
+#ifdef PY_YAJL_FASTCALL
+    {"dumps", (PyCFunction)(void (*)(void))(py_dumps), METH_FASTCALL | METH_KEYWORDS,
+#else
     {"dumps", (PyCFunctionWithKeywords)(py_dumps), METH_VARARGS | METH_KEYWORDS,
-"yajl.dumps(obj [, indent=None])\n\n\
+#endif
+"yajl.dumps(obj [, indent=None, ensure_ascii=True, float_precision=None,\n\
+        max_depth=None])\n\n\
 Returns an encoded JSON string of the specified `obj`\n\
 \n\
 If `indent` is a non-negative integer, then JSON array elements \n\
 and object members will be pretty-printed with that indent level. \n\
 An indent level of 0 will only insert newlines. None (the default) \n\
 selects the most compact representation.\n\
+\n\
+If `ensure_ascii` is false, non-ASCII characters are written out as \n\
+they are rather than as \\uXXXX escapes (as UTF-8 under Python 2).\n\
+\n\
+Floats are written with the fewest digits that read back as the same \n\
+value, unless `float_precision` gives a number of significant digits \n\
+(1 to 17) to round them to instead, for smaller output.\n\
+\n\
+`max_depth` is the most dicts and lists `obj` may have nested inside \n\
+each other, past which ValueError is raised; by default there's no \n\
+limit other than Python's recursion limit.\n\
+"},
+#ifdef PY_YAJL_FASTCALL
+    {"dumpb", (PyCFunction)(void (*)(void))(py_dumpb), METH_FASTCALL | METH_KEYWORDS,
+#else
+    {"dumpb", (PyCFunctionWithKeywords)(py_dumpb), METH_VARARGS | METH_KEYWORDS,
+#endif
+"yajl.dumpb(obj [, indent=None, ensure_ascii=True, float_precision=None,\n\
+        max_depth=None])\n\n\
+Like `yajl.dumps()`, but returns the UTF-8 encoded JSON as bytes, which \n\
+saves decoding it into a str only to encode it again on the way out\n\
 "},
-    {"loads", (PyCFunction)(py_loads), METH_VARARGS,
-"yajl.loads(string)\n\n\
-Returns a decoded object based on the given JSON `string`"},
-    {"load", (PyCFunction)(py_load), METH_VARARGS,
-"yajl.load(fp)\n\n\
+#ifdef PY_YAJL_FASTCALL
+    {"loads", (PyCFunction)(void (*)(void))(py_loads), METH_FASTCALL | METH_KEYWORDS,
+#else
+    {"loads", (PyCFunctionWithKeywords)(py_loads), METH_VARARGS | METH_KEYWORDS,
+#endif
+"yajl.loads(string [, fields=None, progress=None])\n\n\
+Returns a decoded object based on the given JSON `string`\n\
+\n\
+`fields` is a list of paths such as \"user.id\" or \"items[*].price\" \n\
+(dict keys separated by dots, `[*]` for every item of a list); only \n\
+what they lead to is decoded, though the whole document is still \n\
+checked to be valid JSON.\n\
+\n\
+`progress` is called as `progress(done, total)` with the number of \n\
+bytes parsed so far every 16MB of a long document; anything it raises \n\
+stops the decoding.\n\
+"},
+    {"load", (PyCFunctionWithKeywords)(py_load), METH_VARARGS | METH_KEYWORDS,
+"yajl.load(fp [, chunk_size=65536])\n\n\
 Returns a decoded object based on the JSON read from the `fp` stream-like\n\
-object; *Note:* It is expected that `fp` supports the `read()` method"},
+object; *Note:* It is expected that `fp` supports the `read()` method\n\
+\n\
+The stream is read and parsed `chunk_size` bytes at a time, so only the \n\
+decoded objects and a single chunk are held in memory. Streams which \n\
+support `readinto()` are read into one reused buffer.\n\
+"},
+    {"load_file", (PyCFunctionWithKeywords)(py_load_file), METH_VARARGS | METH_KEYWORDS,
+"yajl.load_file(path [, progress=None])\n\n\
+Returns a decoded object based on the JSON in the file at `path`. A \n\
+regular file is mapped into memory and parsed where it lies rather than \n\
+read, anything else (a pipe, say) is read until it runs out\n\
+\n\
+`progress` is as for `yajl.loads()`.\n\
+"},
     {"dump", (PyCFunctionWithKeywords)(py_dump), METH_VARARGS | METH_KEYWORDS,
-"yajl.dump(obj, fp [, indent=None])\n\n\
+"yajl.dump(obj, fp [, indent=None, chunk_size=65536, ensure_ascii=True,\n\
+        float_precision=None, max_depth=None])\n\n\
 Encodes the given `obj` and writes it to the `fp` stream-like object. \n\
 *Note*: It is expected that `fp` supports the `write()` method\n\
 \n\
@@ -415,10 +1377,56 @@ If `indent` is a non-negative integer, then JSON array elements \n\
 and object members will be pretty-printed with that indent level. \n\
 An indent level of 0 will only insert newlines. None (the default) \n\
 selects the most compact representation.\n\
+\n\
+Output is handed to `fp.write()` whenever roughly `chunk_size` bytes \n\
+have been buffered, rather than once the whole document is done.\n\
+`ensure_ascii`, `float_precision` and `max_depth` are as for \n\
+`yajl.dumps()`.\n\
+"},
+    {"iterload", (PyCFunctionWithKeywords)(py_iterload), METH_VARARGS | METH_KEYWORDS,
+"yajl.iterload(fp [, chunk_size=65536])\n\n\
+Returns an iterator over the JSON values read from the `fp` stream-like\n\
+object, such as newline delimited or simply concatenated JSON documents.\n\
+Each value is yielded as soon as it has been completely read, with the \n\
+stream read `chunk_size` bytes at a time as with `yajl.load()`\n\
+"},
+    {"loads_lazy", (PyCFunction)(py_loads_lazy), METH_O,
+"yajl.loads_lazy(string)\n\n\
+Returns a decoded object from the given JSON string, without decoding \n\
+anything in it until it's needed\n\
+\n\
+Dicts and lists come back as read-only `LazyDict` and `LazyList` \n\
+proxies, which only decode the values they're asked for (and keep \n\
+them). `to_python()` returns a real dict or list from either.\n\
+"},
+    {"loads_many", (PyCFunctionWithKeywords)(py_loads_many), METH_VARARGS | METH_KEYWORDS,
+"yajl.loads_many(buffers [, threads=0, return_errors=False])\n\n\
+Decodes each JSON string (str or bytes) in the sequence `buffers`, \n\
+returning a list of the results in the same order\n\
+\n\
+The documents are lexed in parallel on up to `threads` threads, kept \n\
+between calls, without holding the GIL; 0 (the default) uses one \n\
+thread per CPU, and small batches are lexed by the caller alone. A document \n\
+which can't be decoded raises a ValueError whose `index` attribute \n\
+says which it was, or with `return_errors` set, that ValueError is \n\
+returned in place of the document's value.\n\
+"},
+    {"validate", (PyCFunctionWithKeywords)(py_validate), METH_VARARGS | METH_KEYWORDS,
+"yajl.validate(string [, offset=False, allow_comments=False])\n\n\
+Returns whether the given JSON string (str or bytes) is a well formed \n\
+document, without decoding any of it\n\
+\n\
+Nothing but whitespace may follow the document's value, and comments \n\
+are only accepted with `allow_comments` set. Bytes are also checked \n\
+to be valid UTF-8. With `offset` set, returns \n\
+-1 for a well formed document, and otherwise the offset of the byte \n\
+at which it went wrong.\n\
+"},
+    {"arena_stats", (PyCFunction)(py_arena_stats), METH_NOARGS,
+"yajl.arena_stats()\n\n\
+Returns the counters of the memory pool used by `yajl.loads()` on the \n\
+calling thread, see `Decoder.arena_stats()`\n\
 "},
-    /*
-     {"iterload", (PyCFunction)(py_iterload), METH_VARARGS, NULL},
-     */
     {"monkeypatch", (PyCFunction)(py_monkeypatch), METH_NOARGS,
 "yajl.monkeypatch()\n\n\
 Monkey-patches the yajl module into sys.modules as \"json\"\n\
@@ -426,6 +1434,37 @@ Monkey-patches the yajl module into sys.modules as \"json\"\n\
     {NULL}
 };
 
+/*
+ * Lets the lazy proxies pass isinstance() checks against the Mapping and
+ * Sequence ABCs; not being able to is no reason to fail the import
+ */
+static void _register_lazy_abc(PyObject *abcs, const char *name, PyTypeObject *type)
+{
+    PyObject *abc = PyObject_GetAttrString(abcs, name);
+    PyObject *result = NULL;
+
+    if (abc) {
+        result = PyObject_CallMethod(abc, "register", "O", (PyObject *)(type));
+        Py_XDECREF(result);
+        Py_DECREF(abc);
+    }
+}
+
+static void _register_lazy_abcs(void)
+{
+#ifdef IS_PYTHON3
+    PyObject *abcs = PyImport_ImportModule("collections.abc");
+#else
+    PyObject *abcs = PyImport_ImportModule("collections");
+#endif
+
+    if (abcs) {
+        _register_lazy_abc(abcs, "Mapping", &YajlLazyDictType);
+        _register_lazy_abc(abcs, "Sequence", &YajlLazyListType);
+        Py_DECREF(abcs);
+    }
+    PyErr_Clear();
+}
 
 #ifdef IS_PYTHON3
 static struct PyModuleDef yajlmodule = {
@@ -478,6 +1517,27 @@ PyMODINIT_FUNC PyInit_yajl(void)
     Py_INCREF(&YajlEncoderType);
     PyModule_AddObject(module, "Encoder", (PyObject *)(&YajlEncoderType));
 
+    if (PyType_Ready(&YajlStreamLoaderType) < 0) {
+        goto bad_exit;
+    }
+
+    if (PyType_Ready(&YajlEncodeIteratorType) < 0) {
+        goto bad_exit;
+    }
+
+    if (PyType_Ready(&YajlLazyDictType) < 0) {
+        goto bad_exit;
+    }
+    Py_INCREF(&YajlLazyDictType);
+    PyModule_AddObject(module, "LazyDict", (PyObject *)(&YajlLazyDictType));
+
+    if (PyType_Ready(&YajlLazyListType) < 0) {
+        goto bad_exit;
+    }
+    Py_INCREF(&YajlLazyListType);
+    PyModule_AddObject(module, "LazyList", (PyObject *)(&YajlLazyListType));
+    _register_lazy_abcs();
+
 #ifdef IS_PYTHON3
     return module;
 #endif
@@ -29,95 +29,339 @@
  * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <yajl_encode.h>
 
 
 /*
- * This code was yanked largely from yajl_gen.c
- * it is merely a set of hacks
+ * Our own JSON generator: it writes what yajl_gen.c would, but the stack
+ * of container states grows as deep as it's asked to go rather than being
+ * a YAJL_MAX_DEPTH array, and callers can write the contents of strings
+ * and numbers straight into the printer's context
  */
 
 typedef enum {
-    yajl_gen_start,
-    yajl_gen_map_start,
-    yajl_gen_map_key,
-    yajl_gen_map_val,
-    yajl_gen_array_start,
-    yajl_gen_in_array,
-    yajl_gen_complete,
-    yajl_gen_error
-} yajl_gen_state;
-
-struct yajl_gen_t
+    py_yajl_gen_start,
+    py_yajl_gen_map_start,
+    py_yajl_gen_map_key,
+    py_yajl_gen_map_val,
+    py_yajl_gen_array_start,
+    py_yajl_gen_in_array,
+    py_yajl_gen_complete,
+    py_yajl_gen_error
+} py_yajl_gen_state;
+
+/* states held within the generator itself, deeper documents go to the heap */
+#define PY_YAJL_GEN_INLINE 32
+
+typedef struct py_yajl_gen_t
 {
     unsigned int depth;
+    /* containers allowed to be open at once, 0 for no limit */
+    unsigned int max_depth;
     unsigned int pretty;
     const char * indentString;
-    yajl_gen_state state[YAJL_MAX_DEPTH];
+    unsigned int indentLength;
+    /* `inline_state` until the document gets deeper than that */
+    unsigned char * state;
+    unsigned int size;
     yajl_print_t print;
-    void * ctx; /* yajl_buf */
-    /* memory allocation routines */
-    yajl_alloc_funcs alloc;
-};
+    void * ctx;
+    unsigned char inline_state[PY_YAJL_GEN_INLINE];
+} * py_yajl_gen;
 
 #define INSERT_SEP \
-    if (g->state[g->depth] == yajl_gen_map_key ||               \
-        g->state[g->depth] == yajl_gen_in_array) {              \
+    if (g->state[g->depth] == py_yajl_gen_map_key ||            \
+        g->state[g->depth] == py_yajl_gen_in_array) {           \
         g->print(g->ctx, ",", 1);                               \
         if (g->pretty) g->print(g->ctx, "\n", 1);               \
-    } else if (g->state[g->depth] == yajl_gen_map_val) {        \
+    } else if (g->state[g->depth] == py_yajl_gen_map_val) {     \
         g->print(g->ctx, ":", 1);                               \
         if (g->pretty) g->print(g->ctx, " ", 1);                \
    } 
 
 #define INSERT_WHITESPACE                                               \
     if (g->pretty) {                                                    \
-        if (g->state[g->depth] != yajl_gen_map_val) {                   \
+        if (g->state[g->depth] != py_yajl_gen_map_val) {                \
             unsigned int _i;                                            \
             for (_i=0;_i<g->depth;_i++)                                 \
-                g->print(g->ctx, g->indentString,                       \
-                         strlen(g->indentString));                      \
+                g->print(g->ctx, g->indentString, g->indentLength);     \
         }                                                               \
     }
+#define ENSURE_NOT_KEY \
+    if (g->state[g->depth] == py_yajl_gen_map_key ||    \
+        g->state[g->depth] == py_yajl_gen_map_start)  { \
+        return yajl_gen_keys_must_be_strings;           \
+    }                                                   \
+
 /* check that we're not complete, or in error state.  in a valid state
  * to be generating */
 #define ENSURE_VALID_STATE \
-    if (g->state[g->depth] == yajl_gen_error) {   \
+    if (g->state[g->depth] == py_yajl_gen_error) {   \
         return yajl_gen_in_error_state;\
-    } else if (g->state[g->depth] == yajl_gen_complete) {   \
+    } else if (g->state[g->depth] == py_yajl_gen_complete) {   \
         return yajl_gen_generation_complete;                \
     }
 
+#define INCREMENT_DEPTH \
+    if ( ((g->max_depth) && (g->depth >= g->max_depth)) ||      \
+         ((g->depth + 1 >= g->size) && (!_grow_state(g))) ) {   \
+        return yajl_max_depth_exceeded;                         \
+    }                                                           \
+    (g->depth)++;
+
 #define APPENDED_ATOM \
     switch (g->state[g->depth]) {                   \
-        case yajl_gen_start:                        \
-            g->state[g->depth] = yajl_gen_complete; \
+        case py_yajl_gen_start:                     \
+            g->state[g->depth] = py_yajl_gen_complete; \
             break;                                  \
-        case yajl_gen_map_start:                    \
-        case yajl_gen_map_key:                      \
-            g->state[g->depth] = yajl_gen_map_val;  \
+        case py_yajl_gen_map_start:                 \
+        case py_yajl_gen_map_key:                   \
+            g->state[g->depth] = py_yajl_gen_map_val;  \
             break;                                  \
-        case yajl_gen_array_start:                  \
-            g->state[g->depth] = yajl_gen_in_array; \
+        case py_yajl_gen_array_start:               \
+            g->state[g->depth] = py_yajl_gen_in_array; \
             break;                                  \
-        case yajl_gen_map_val:                      \
-            g->state[g->depth] = yajl_gen_map_key;  \
+        case py_yajl_gen_map_val:                   \
+            g->state[g->depth] = py_yajl_gen_map_key;  \
             break;                                  \
         default:                                    \
             break;                                  \
     }                                               \
 
 #define FINAL_NEWLINE                                        \
-    if (g->pretty && g->state[g->depth] == yajl_gen_complete) \
+    if (g->pretty && g->state[g->depth] == py_yajl_gen_complete) \
         g->print(g->ctx, "\n", 1);        
 
-yajl_gen_status yajl_gen_raw_string(yajl_gen g, const unsigned char * str, unsigned int len)
+/* Doubles the state stack, returns 0 if that's not possible */
+static int _grow_state(py_yajl_gen g)
+{
+    unsigned int wanted = g->size * 2;
+    unsigned char * grown = NULL;
+
+    if (wanted <= g->size)
+        return 0;
+    if (g->state == g->inline_state) {
+        grown = (unsigned char *) malloc(wanted);
+        if (grown)
+            memcpy(grown, g->inline_state, g->size);
+    } else {
+        grown = (unsigned char *) realloc(g->state, wanted);
+    }
+    if (!grown)
+        return 0;
+    g->state = grown;
+    g->size = wanted;
+    return 1;
+}
+
+/*
+ * Rewind a generator which has finished (or given up on) a document so
+ * that it can be reused for the next one, with a new config and printer
+ * context, without going back through py_yajl_gen_alloc()
+ */
+void py_yajl_gen_reset(py_yajl_gen g, const yajl_gen_config * config,
+        unsigned int max_depth, void * ctx)
+{
+    g->depth = 0;
+    g->state[0] = py_yajl_gen_start;
+    g->max_depth = max_depth;
+    g->pretty = config->beautify;
+    g->indentString = config->indentString ? config->indentString : "  ";
+    g->indentLength = (unsigned int) strlen(g->indentString);
+    g->ctx = ctx;
+}
+
+py_yajl_gen py_yajl_gen_alloc(yajl_print_t print, const yajl_gen_config * config,
+        unsigned int max_depth, void * ctx)
+{
+    py_yajl_gen g = (py_yajl_gen) malloc(sizeof(struct py_yajl_gen_t));
+
+    if (!g)
+        return NULL;
+    g->state = g->inline_state;
+    g->size = PY_YAJL_GEN_INLINE;
+    g->print = print;
+    py_yajl_gen_reset(g, config, max_depth, ctx);
+    return g;
+}
+
+void py_yajl_gen_free(py_yajl_gen g)
+{
+    if (!g)
+        return;
+    if (g->state != g->inline_state)
+        free(g->state);
+    free(g);
+}
+
+/* How many containers are open */
+unsigned int py_yajl_gen_depth(py_yajl_gen g)
+{
+    return g->depth;
+}
+
+/* Whether output is beautified, so atoms can't simply be comma separated */
+unsigned int py_yajl_gen_pretty(py_yajl_gen g)
+{
+    return g->pretty;
+}
+
+void * py_yajl_gen_context(py_yajl_gen g)
+{
+    return g->ctx;
+}
+
+yajl_gen_status py_yajl_gen_null(py_yajl_gen g)
+{
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
+    g->print(g->ctx, "null", 4);
+    APPENDED_ATOM;
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+yajl_gen_status py_yajl_gen_bool(py_yajl_gen g, int boolean)
+{
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
+    if (boolean)
+        g->print(g->ctx, "true", 4);
+    else
+        g->print(g->ctx, "false", 5);
+    APPENDED_ATOM;
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+yajl_gen_status py_yajl_gen_number(py_yajl_gen g, const char * str, unsigned int len)
+{
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
+    g->print(g->ctx, str, len);
+    APPENDED_ATOM;
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+yajl_gen_status py_yajl_gen_map_open(py_yajl_gen g)
+{
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
+    INCREMENT_DEPTH;
+    g->state[g->depth] = py_yajl_gen_map_start;
+    g->print(g->ctx, "{", 1);
+    if (g->pretty) g->print(g->ctx, "\n", 1);
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+yajl_gen_status py_yajl_gen_map_close(py_yajl_gen g)
+{
+    ENSURE_VALID_STATE;
+    (g->depth)--;
+    if (g->pretty) g->print(g->ctx, "\n", 1);
+    APPENDED_ATOM;
+    INSERT_WHITESPACE;
+    g->print(g->ctx, "}", 1);
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+yajl_gen_status py_yajl_gen_array_open(py_yajl_gen g)
+{
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
+    INCREMENT_DEPTH;
+    g->state[g->depth] = py_yajl_gen_array_start;
+    g->print(g->ctx, "[", 1);
+    if (g->pretty) g->print(g->ctx, "\n", 1);
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+yajl_gen_status py_yajl_gen_array_close(py_yajl_gen g)
 {
+    ENSURE_VALID_STATE;
+    if (g->pretty) g->print(g->ctx, "\n", 1);
+    (g->depth)--;
+    APPENDED_ATOM;
+    INSERT_WHITESPACE;
+    g->print(g->ctx, "]", 1);
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+/*
+ * The printer and yajl_string_encode2() only take unsigned int lengths, so
+ * longer strings are handed to them this many bytes at a time
+ */
+#define PY_YAJL_GEN_SLICE (1U << 30)
+
+yajl_gen_status py_yajl_gen_raw_string(py_yajl_gen g, const unsigned char * str, size_t len)
+{
+    size_t slice;
+
     ENSURE_VALID_STATE; INSERT_SEP; INSERT_WHITESPACE;
     g->print(g->ctx, "\"", 1);
-    g->print(g->ctx, str, len);
+    for (; len; str += slice, len -= slice) {
+        slice = (len > PY_YAJL_GEN_SLICE) ? PY_YAJL_GEN_SLICE : len;
+        g->print(g->ctx, (const char *) str, (unsigned int) slice);
+    }
+    g->print(g->ctx, "\"", 1);
+    APPENDED_ATOM;
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+/*
+ * A string of any length, escaping is done a byte at a time so it can be
+ * done a slice at a time too
+ */
+yajl_gen_status py_yajl_gen_string(py_yajl_gen g, const unsigned char * str, size_t len)
+{
+    size_t slice;
+
+    ENSURE_VALID_STATE; INSERT_SEP; INSERT_WHITESPACE;
+    g->print(g->ctx, "\"", 1);
+    for (; len; str += slice, len -= slice) {
+        slice = (len > PY_YAJL_GEN_SLICE) ? PY_YAJL_GEN_SLICE : len;
+        yajl_string_encode2(g->print, g->ctx, str, (unsigned int) slice);
+    }
     g->print(g->ctx, "\"", 1);
     APPENDED_ATOM;
     FINAL_NEWLINE;
     return yajl_gen_status_ok;
 }
+
+/*
+ * Like py_yajl_gen_raw_string(), except the caller writes the contents of
+ * the string straight into the printer's context between the two calls
+ */
+yajl_gen_status py_yajl_gen_string_open(py_yajl_gen g)
+{
+    ENSURE_VALID_STATE; INSERT_SEP; INSERT_WHITESPACE;
+    g->print(g->ctx, "\"", 1);
+    return yajl_gen_status_ok;
+}
+
+yajl_gen_status py_yajl_gen_string_close(py_yajl_gen g)
+{
+    g->print(g->ctx, "\"", 1);
+    APPENDED_ATOM;
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}
+
+/* The same again for numbers, which are written out without the quotes */
+yajl_gen_status py_yajl_gen_number_open(py_yajl_gen g)
+{
+    ENSURE_VALID_STATE; ENSURE_NOT_KEY; INSERT_SEP; INSERT_WHITESPACE;
+    return yajl_gen_status_ok;
+}
+
+yajl_gen_status py_yajl_gen_number_close(py_yajl_gen g)
+{
+    APPENDED_ATOM;
+    FINAL_NEWLINE;
+    return yajl_gen_status_ok;
+}